@@ -0,0 +1,173 @@
+/*
+ * alog.c - Asynchronous access log
+ *
+ * Each ring has a single producer, its thread, and a single consumer,
+ * the writer, so head and tail need no lock: the producer only moves
+ * head and the writer only moves tail, each publishing with a release
+ * store that the other side reads with an acquire load. They sit on
+ * cache lines of their own so the two sides do not contend for one.
+ */
+#include "alog.h"
+#include "stats.h"
+
+/* Longest line alog_format writes: the URL, and fixed fields of which
+   the widest are an IPv6 address and five 20-digit numbers */
+#define ALOG_LINEMAX (ALOG_URLMAX + 160)
+
+typedef struct alog_ring {
+    alog_rec_t recs[ALOG_RING];
+    unsigned long head __attribute__((aligned(64)));  /* Next to fill */
+    unsigned long tail __attribute__((aligned(64)));  /* Next to drain */
+    struct alog_ring *next;
+} alog_ring_t;
+
+static __thread alog_ring_t *alog_mine;
+static pthread_mutex_t alog_lock = PTHREAD_MUTEX_INITIALIZER;
+static alog_ring_t *alog_rings;             /* Every thread's, newest first */
+static int alog_fd = -1;
+
+static void *alog_writer(void *vargp);
+
+/* alog_init - Start the writer thread, logging to fd */
+void alog_init(int fd)
+{
+    pthread_t tid;
+
+    alog_fd = fd;
+    Pthread_create(&tid, NULL, alog_writer, NULL);
+}
+
+/* alog_peer - Record the client address sa in p */
+void alog_peer(alog_peer_t *p, struct sockaddr *sa)
+{
+    memset(p, 0, sizeof(*p));
+    if (sa->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+
+        p->family = AF_INET;
+        memcpy(p->addr, &sin->sin_addr, 4);
+        p->port = ntohs(sin->sin_port);
+    }
+    else if (sa->sa_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+
+        p->family = AF_INET6;
+        memcpy(p->addr, &sin6->sin6_addr, 16);
+        p->port = ntohs(sin6->sin6_port);
+    }
+}
+
+/*
+ * alog_start - Return the next free record in this thread's ring for
+ *     the caller to fill in and alog_commit, or NULL if the ring is
+ *     full, in which case the record is counted as dropped.
+ */
+alog_rec_t *alog_start(void)
+{
+    alog_ring_t *rp = alog_mine;
+    unsigned long head;
+
+    if (!rp) {
+        rp = alog_mine = Calloc(1, sizeof(alog_ring_t));
+        pthread_mutex_lock(&alog_lock);
+        rp->next = alog_rings;
+        alog_rings = rp;
+        pthread_mutex_unlock(&alog_lock);
+    }
+    head = rp->head;
+    if (head - __atomic_load_n(&rp->tail, __ATOMIC_ACQUIRE) == ALOG_RING) {
+        stats_add(STATS_LOG_DROPPED, 1);
+        return NULL;
+    }
+    return &rp->recs[head & (ALOG_RING - 1)];
+}
+
+/* alog_commit - Hand the record from alog_start to the writer */
+void alog_commit(void)
+{
+    alog_ring_t *rp = alog_mine;
+
+    __atomic_store_n(&rp->head, rp->head + 1, __ATOMIC_RELEASE);
+}
+
+/* alog_format - Append rec to buf as a line; returns its length */
+static size_t alog_format(char *buf, size_t size, alog_rec_t *rec)
+{
+    char addr[INET6_ADDRSTRLEN] = "-";
+    int n;
+
+    if (rec->peer.family)
+        inet_ntop(rec->peer.family, rec->peer.addr, addr, sizeof(addr));
+    n = snprintf(buf, size, "%lld.%03lld\t%s\t%u\t%.8s\t%.*s\t%d\t%lu\t%c\t%lld\n",
+            rec->time / 1000000, rec->time / 1000 % 1000, addr,
+            rec->peer.port, rec->method[0] ? rec->method : "-",
+            rec->urllen ? (int)rec->urllen : 1,
+            rec->urllen ? rec->url : "-",
+            rec->status, rec->sent, rec->cache, rec->duration);
+    return (n < 0) ? 0 : ((size_t)n < size) ? (size_t)n : size - 1;
+}
+
+/* alog_flush - Write out len bytes of buf, retrying short writes */
+static void alog_flush(char *buf, size_t len)
+{
+    if (len > 0 && rio_writen(alog_fd, buf, len) < 0)
+        ;   /* Nowhere to report it; the lines are lost */
+}
+
+/*
+ * alog_oldest - The ring whose next record to drain ended first, or
+ *     NULL if every ring is empty. Draining in that order keeps the
+ *     lines of different threads in time order.
+ */
+static alog_ring_t *alog_oldest(alog_ring_t *rings)
+{
+    alog_ring_t *rp, *oldest = NULL;
+    alog_rec_t *rec, *first = NULL;
+
+    for (rp = rings; rp; rp = rp->next) {
+        if (rp->tail == __atomic_load_n(&rp->head, __ATOMIC_ACQUIRE))
+            continue;
+        rec = &rp->recs[rp->tail & (ALOG_RING - 1)];
+        if (!first || rec->time < first->time) {
+            first = rec;
+            oldest = rp;
+        }
+    }
+    return oldest;
+}
+
+/*
+ * alog_writer - Drain every ring into alog_fd, a buffer at a time.
+ *     Sleeps for ALOG_FLUSH_MS whenever a pass finds nothing to do.
+ */
+static void *alog_writer(void *vargp)
+{
+    char buf[MAXBUF * 8];
+    size_t len;
+    alog_ring_t *rp, *rings;
+    int busy;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&alog_lock);
+        rings = alog_rings;
+        pthread_mutex_unlock(&alog_lock);
+
+        busy = 0;
+        len = 0;
+        while ((rp = alog_oldest(rings))) {
+            if (sizeof(buf) - len < ALOG_LINEMAX) {
+                alog_flush(buf, len);
+                len = 0;
+            }
+            len += alog_format(buf + len, sizeof(buf) - len,
+                    &rp->recs[rp->tail & (ALOG_RING - 1)]);
+            __atomic_store_n(&rp->tail, rp->tail + 1, __ATOMIC_RELEASE);
+            busy = 1;
+        }
+        alog_flush(buf, len);
+        if (!busy)
+            usleep(ALOG_FLUSH_MS * 1000);
+    }
+    return NULL;
+}
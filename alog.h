@@ -0,0 +1,50 @@
+/*
+ * alog.h - Asynchronous access log
+ *
+ * Threads handling requests never write the log themselves. Each one
+ * fills fixed-size records in a ring of its own, with no lock, and a
+ * writer thread drains every ring a few times a second, turning the
+ * records into tab-separated lines:
+ *
+ *   time  client  port  method  url  status  bytes  cache  us
+ *
+ * where time is seconds since the epoch, bytes is what went to the
+ * client, cache is H(it), F(ollowed another fetch), M(iss) or - and us
+ * is how long the request took. A thread whose ring is full drops the
+ * record and counts it (log_dropped on the stats page) rather than
+ * waiting for the writer.
+ */
+#ifndef __ALOG_H__
+#define __ALOG_H__
+
+#include "csapp.h"
+
+#define ALOG_RING 1024          /* Records per thread; a power of two */
+#define ALOG_URLMAX 200         /* Longer URLs are cut short */
+#define ALOG_FLUSH_MS 100       /* Writer's sleep between empty drains */
+
+/* A client's address, kept raw until the writer formats it */
+typedef struct {
+    unsigned char family;       /* AF_INET, AF_INET6, or 0 if unknown */
+    unsigned char addr[16];
+    unsigned short port;        /* In host byte order */
+} alog_peer_t;
+
+typedef struct {
+    long long time;             /* Wall clock at the end, in us */
+    long long duration;         /* us */
+    unsigned long sent;         /* Bytes sent to the client */
+    alog_peer_t peer;
+    int status;                 /* Sent to the client, 0 if none */
+    char cache;
+    char method[8];
+    unsigned char urllen;
+    char url[ALOG_URLMAX];
+} alog_rec_t;
+
+void alog_init(int fd);
+void alog_peer(alog_peer_t *p, struct sockaddr *sa);
+alog_rec_t *alog_start(void);
+void alog_commit(void);
+
+#endif /* __ALOG_H__ */
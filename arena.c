@@ -0,0 +1,102 @@
+/*
+ * arena.c - Per-connection bump allocator for request state
+ *
+ * Allocations are 16-byte aligned and never freed one by one. Chunks
+ * form a list from the newest back to the first, which arena_reset
+ * keeps and rewinds.
+ */
+#include "arena.h"
+
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+/* arena_init - Start an empty arena; no memory is taken until used */
+void arena_init(arena_t *a)
+{
+    a->head = NULL;
+    a->last = NULL;
+}
+
+/*
+ * arena_alloc - Allocate n bytes. A request that does not fit in the
+ *     newest chunk gets a new chunk of its own size or ARENA_CHUNK,
+ *     whichever is larger.
+ */
+void *arena_alloc(arena_t *a, size_t n)
+{
+    arena_chunk_t *c = a->head;
+    size_t size;
+
+    n = ARENA_ALIGN(n);
+    if (!c || c->size - c->used < n) {
+        size = (n > ARENA_CHUNK) ? n : ARENA_CHUNK;
+        c = Malloc(sizeof(arena_chunk_t) + size);
+        c->size = size;
+        c->used = 0;
+        c->next = a->head;
+        a->head = c;
+    }
+    a->last = c->data + c->used;
+    c->used += n;
+    return a->last;
+}
+
+/*
+ * arena_grow - Make the oldn-byte allocation p newn bytes long. The
+ *     most recent allocation grows in place if its chunk has room, as
+ *     when a header block is read in line by line; anything else is
+ *     copied to a new allocation.
+ */
+void *arena_grow(arena_t *a, void *p, size_t oldn, size_t newn)
+{
+    arena_chunk_t *c = a->head;
+    char *q;
+
+    if (p && p == a->last
+            && (size_t)(c->data + c->size - (char *)p) >= ARENA_ALIGN(newn)) {
+        c->used = (char *)p - c->data + ARENA_ALIGN(newn);
+        return p;
+    }
+    q = arena_alloc(a, newn);
+    if (p)
+        memcpy(q, p, oldn);
+    return q;
+}
+
+/* arena_strndup - Copy s[0..n) into the arena as a C string */
+char *arena_strndup(arena_t *a, char *s, size_t n)
+{
+    char *p = arena_alloc(a, n + 1);
+
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+/*
+ * arena_reset - Give back everything allocated. The first chunk is
+ *     kept for the next request, any later ones are freed.
+ */
+void arena_reset(arena_t *a)
+{
+    arena_chunk_t *c;
+
+    while ((c = a->head) && c->next) {
+        a->head = c->next;
+        Free(c);
+    }
+    if (c)
+        c->used = 0;
+    a->last = NULL;
+}
+
+/* arena_free - Free all of the arena's memory */
+void arena_free(arena_t *a)
+{
+    arena_chunk_t *c;
+
+    while ((c = a->head)) {
+        a->head = c->next;
+        Free(c);
+    }
+    a->last = NULL;
+}
@@ -0,0 +1,39 @@
+/*
+ * arena.h - Per-connection bump allocator for request state
+ *
+ * Everything a request needs while it is being handled (its header
+ * block, the parse of it, the request rewritten for the origin, host,
+ * port and cache key) is carved out of the connection's arena, sized
+ * to what actually arrived, and given back all at once by arena_reset
+ * when the next request on the connection starts. The first chunk is
+ * kept across resets, so a keep-alive connection reuses the same few
+ * warm kilobytes for every request; anything larger goes into extra
+ * chunks that the reset frees.
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "csapp.h"
+
+#define ARENA_CHUNK 16384       /* Bytes in an arena's first chunk */
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;   /* Chunk allocated before this one */
+    size_t size;                /* Bytes in data */
+    size_t used;
+    char data[] __attribute__((aligned(16)));  /* As malloc's blocks are */
+} arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t *head;        /* Newest chunk, NULL until first use */
+    char *last;                 /* Most recent allocation, for arena_grow */
+} arena_t;
+
+void arena_init(arena_t *a);
+void *arena_alloc(arena_t *a, size_t n);
+void *arena_grow(arena_t *a, void *p, size_t oldn, size_t newn);
+char *arena_strndup(arena_t *a, char *s, size_t n);
+void arena_reset(arena_t *a);
+void arena_free(arena_t *a);
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,182 @@
+#!/bin/bash
+#
+# bench.sh - Throughput and latency benchmark for the proxy. Starts
+#     the origin simulator, with the routes in bench.scenario, and the
+#     proxy on free ports, the way driver.sh does, and runs loadgen
+#     through the proxy for each of a standard set of scenarios, after
+#     a baseline straight to the origin.
+#
+#     usage: ./bench.sh   (or make bench)
+#
+#     BENCH_SECS   seconds per scenario (default 5)
+#     PROXY_ARGS   extra options for the proxy, e.g. "-e 4" or "-u"
+#
+
+BENCH_SECS=${BENCH_SECS:-5}
+MAX_RAND=63000
+PORT_START=1024
+PORT_MAX=65000
+MAX_PORT_TRIES=10
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Times out after 10 seconds.
+#
+function wait_for_port_use() {
+    timeout_count="0"
+    portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+        | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+        | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+    echo "${portsinuse}" | grep -wq "${1}"
+    while [ "$?" != "0" ]
+    do
+        timeout_count=`expr ${timeout_count} + 1`
+        if [ "${timeout_count}" == "${MAX_PORT_TRIES}" ]; then
+            kill -ALRM $$
+        fi
+
+        sleep 1
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+        echo "${portsinuse}" | grep -wq "${1}"
+    done
+}
+
+#
+# free_port - returns an available unused TCP port
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ]
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+#
+# cleanup - Kill the origin and the proxy and remove the mix file
+#
+function cleanup {
+    kill $origin_pid $proxy_pid 2> /dev/null
+    wait $origin_pid $proxy_pid 2> /dev/null
+    rm -f ${MIX_FILE}
+}
+
+#
+# nfds - Number of descriptors the process passed as an argument has
+#     open, read through any of its threads, since the proxy's main
+#     thread exits once the others are running
+#
+function nfds {
+    for task in /proc/${1}/task/*
+    do
+        n=`ls ${task}/fd 2> /dev/null | wc -l`
+        if [ "${n}" != "0" ]; then
+            echo "${n}"
+            return
+        fi
+    done
+    echo 0
+}
+
+#
+# scenario - Run loadgen through the proxy as one named scenario
+# usage: scenario <name> <loadgen args...>
+#
+function scenario {
+    name=$1
+    shift
+    ./loadgen -p localhost:${proxy_port} -d ${BENCH_SECS} -b ${name} "$@"
+}
+
+if [ ! -x ./proxy ] || [ ! -x ./loadgen ] || [ ! -x ./origin ]
+then
+    echo "Error: build proxy, loadgen and origin first (make bench does)."
+    exit 1
+fi
+
+trap 'echo "Timeout waiting for the server to grab the port reserved for it"; cleanup; exit 1' ALRM
+trap 'cleanup; exit 1' INT TERM
+
+origin_port=$(free_port)
+./origin -f bench.scenario ${origin_port} &> /dev/null &
+origin_pid=$!
+wait_for_port_use "${origin_port}"
+
+proxy_port=$(free_port)
+./proxy ${PROXY_ARGS} ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use "${proxy_port}"
+
+ORIGIN="http://localhost:${origin_port}"
+MIX_FILE=`mktemp`
+for i in `seq 1 50`; do echo "3 ${ORIGIN}/small/${i}"; done > ${MIX_FILE}
+for i in `seq 1 10`; do echo "2 ${ORIGIN}/chunked/${i}"; done >> ${MIX_FILE}
+echo "10 ${ORIGIN}/large/1" >> ${MIX_FILE}
+
+# Warm the cache so the hit scenarios measure hits
+./loadgen -p localhost:${proxy_port} -c 1 -n 20 -f ${MIX_FILE} > /dev/null
+
+echo "proxy ${PROXY_ARGS:-(defaults)}, ${BENCH_SECS} s per scenario"
+printf "%-14s %10s %8s %8s %8s %8s %8s %6s\n" scenario "req/s" "MB/s" \
+    "p50 us" "p99 us" "p99.9 us" "max us" errors
+./loadgen -d ${BENCH_SECS} -b origin-direct -c 32 -f ${MIX_FILE}
+scenario hit-keepalive -c 32 ${ORIGIN}/small/1
+scenario hit-close -c 32 -C ${ORIGIN}/small/1
+scenario miss-large -c 8 ${ORIGIN}/large/1
+scenario miss-slow -c 32 ${ORIGIN}/slow/1
+scenario mix-keepalive -c 32 -f ${MIX_FILE}
+scenario mix-open-loop -c 32 -r 2000 -f ${MIX_FILE}
+
+# Some clients give up on their responses part way, often once the
+# proxy has the whole body; anyone following the same fetch must still
+# get all of it, and the next response on the same connection, without
+# waiting for a timeout (a retry after one shows up as a max over 3 s)
+GONE_FILE=`mktemp`
+for i in `seq 1 50`; do echo "1 ${ORIGIN}/gone/${i}"; done > ${GONE_FILE}
+./loadgen -p localhost:${proxy_port} -d ${BENCH_SECS} -c 8 -a 200 \
+    -f ${GONE_FILE} > /dev/null &
+gone_pid=$!
+result=$(scenario leader-gone -c 16 -t 3 -f ${GONE_FILE})
+wait ${gone_pid}
+rm -f ${GONE_FILE}
+echo "${result}"
+if ! echo "${result}" | awk '{ exit !($NF == 0 && $(NF-1) < 2000000) }'
+then
+    echo "Error: requests following an abandoned fetch stalled or failed"
+    cleanup
+    exit 1
+fi
+
+# Every response is cut off in its head, so every request fails; the
+# proxy must still close each of those origin connections
+fds=$(nfds ${proxy_pid})
+scenario bad-head -c 8 ${ORIGIN}/badhead/1
+sleep 1
+leaked=$(($(nfds ${proxy_pid}) - ${fds}))
+if [ ${leaked} -gt 0 ]; then
+    echo "Error: the proxy leaked ${leaked} descriptors on bad response heads"
+    cleanup
+    exit 1
+fi
+
+cleanup
+exit 0
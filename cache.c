@@ -0,0 +1,726 @@
+/*
+ * cache.c - Thread-safe in-memory cache of web objects
+ *
+ * The cache is split into CACHE_SHARDS shards, picked by a hash of the
+ * host:port/path key. Each shard has its own lock, its own slice of
+ * the capacity, its own eviction state and an open-addressing (linear
+ * probing) hash index, so a lookup touches O(1) slots instead of
+ * scanning every cached object.
+ *
+ * Lookups take no lock at all, so hits never write to a shared lock's
+ * cache line or wait for an insert. They probe the index with atomic
+ * loads inside an epoch (see epoch.h), and the shard's lock only
+ * serializes writers. A writer fills in an object before storing it in
+ * its slot, rebuilds the index into a new array which it then swaps
+ * in, and retires what it unlinks, evicted objects and old arrays,
+ * rather than freeing it, so a reader's probe never reaches freed
+ * memory. The eviction policy (see evict.h) hears of a hit from the
+ * lookup, with no lock held, so it only sets bits and counters on the
+ * object there; anything that moves objects between its queues waits
+ * for an insert to ask it for a victim.
+ *
+ * Objects are reference counted. A lookup takes a reference before it
+ * leaves its epoch and the reader holds it while it streams the object
+ * to its client, so eviction never frees data that is still being sent;
+ * the cache's own reference is only dropped once the object is retired.
+ *
+ * Misses are collapsed: the first thread to miss on a key becomes the
+ * leader of a "flight" that fetches it from the origin, and threads
+ * missing on the same key meanwhile attach to the flight as followers.
+ * The leader appends the response to the flight as it streams in, in
+ * pool buffers that never move, and followers relay those bytes to
+ * their own clients. The origin sees a single fetch. A leader that
+ * reads into pool buffers itself hands them to the flight as they are
+ * (cache_flight_append), and a completed flight's buffers become the
+ * cached object's, so the response is never copied. A response too big
+ * to cache is only kept until every follower has read it: the flight
+ * tracks their cursors and drops the buffers they have all passed, and
+ * a follower that arrives after the start was dropped fetches for
+ * itself.
+ */
+#include "proxy.h"
+#include "cache.h"
+#include "stats.h"
+#include "evict.h"
+#include "epoch.h"
+
+#define CACHE_INDEX_MIN 64          /* Initial index slots per shard */
+
+#if MAX_CACHE_SIZE / CACHE_SHARDS < MAX_OBJECT_SIZE
+#error "Each cache shard must be able to hold a MAX_OBJECT_SIZE object"
+#endif
+
+/* A rewritten response head, at most 2 * MAXBUF, fits in one buffer */
+#if IOBUF_SIZE < 2 * MAXBUF
+#error "The first buffer of a response must hold its whole head"
+#endif
+
+/* Marks an index slot whose object was removed; probing continues */
+#define CACHE_TOMBSTONE ((cache_obj_t *)-1)
+
+/* An open-addressing hash index, replaced whole when it is rebuilt */
+typedef struct {
+    unsigned mask;                  /* Slots - 1 */
+    cache_obj_t *slot[];
+} cache_index_t;
+
+typedef struct {
+    pthread_mutex_t lock;           /* Serializes writers */
+    evict_t ev;                     /* Eviction policy's queues */
+    size_t size;                    /* Bytes of object data cached */
+    cache_index_t *index;           /* Readers load it without the lock */
+    unsigned used;                  /* Live plus tombstone slots */
+    unsigned count;                 /* Live slots */
+    pthread_mutex_t flight_lock;    /* Protects flights */
+    cache_flight_t *flights;        /* Fetches in progress */
+} cache_shard_t;
+
+struct cache_flight {
+    char *key;
+    unsigned hash;
+    pthread_mutex_t lock;           /* Protects chunk lengths and state */
+    pthread_cond_t cond;            /* Signalled on new bytes and at end */
+    iobuf_t *head, *tail;           /* Response received so far; tail's
+                                       len only grows, under lock */
+    size_t len;
+    int state;                      /* FLIGHT_RUNNING, _DONE or _FAILED */
+    int buffering;                  /* Still keeping the bytes */
+    int streaming;                  /* Too big to cache: chunks are
+                                       dropped once every cursor has
+                                       passed them */
+    int trimmed;                    /* The head has been dropped */
+    cache_cursor_t *cursors;        /* Followers' cursors, once they read */
+    int published;                  /* Listed in shard, can be joined */
+    int followers;
+    int refcnt;                     /* Leader plus followers */
+    int *wakefds;                   /* Event loops with followers */
+    int nwakefds, wakecap;
+    struct cache_flight *next;      /* In the shard's flights list */
+};
+
+#define FLIGHT_RUNNING 0
+#define FLIGHT_DONE 1
+#define FLIGHT_FAILED 2
+
+static cache_shard_t cache_shards[CACHE_SHARDS];
+
+/* cache_index_new - An empty index of nslots, a power of two */
+static cache_index_t *cache_index_new(unsigned nslots)
+{
+    cache_index_t *idx;
+
+    idx = Calloc(1, sizeof(cache_index_t) + nslots * sizeof(cache_obj_t *));
+    idx->mask = nslots - 1;
+    return idx;
+}
+
+/*
+ * cache_init - Start the cache empty, holding up to capacity bytes and
+ *     evicting by policy (NULL: LRU). Each shard gets an equal slice,
+ *     which must fit a MAX_OBJECT_SIZE object.
+ */
+void cache_init(evict_policy_t *policy, size_t capacity)
+{
+    int i;
+    cache_shard_t *sp;
+
+    if (capacity / CACHE_SHARDS < MAX_OBJECT_SIZE)
+        app_error("cache_init: capacity too small");
+    if (!policy)
+        policy = evict_policy(NULL);
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        sp = &cache_shards[i];
+        pthread_mutex_init(&sp->lock, NULL);
+        evict_init(&sp->ev, policy, capacity / CACHE_SHARDS);
+        sp->size = 0;
+        sp->index = cache_index_new(CACHE_INDEX_MIN);
+        sp->used = sp->count = 0;
+        pthread_mutex_init(&sp->flight_lock, NULL);
+        sp->flights = NULL;
+    }
+}
+
+/* cache_hash - 32-bit FNV-1a hash of a cache key */
+static unsigned cache_hash(char *key)
+{
+    unsigned h = 2166136261u;
+
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * The low bits of the hash pick the shard, so the index probes with the
+ * remaining bits to keep a shard's keys spread over its slots.
+ */
+static cache_shard_t *cache_shard(unsigned hash)
+{
+    return &cache_shards[hash & (CACHE_SHARDS - 1)];
+}
+
+static unsigned cache_slot(cache_index_t *idx, unsigned hash)
+{
+    return (hash / CACHE_SHARDS) & idx->mask;
+}
+
+/*
+ * cache_find - Return the object in idx cached under key, or NULL.
+ *     Readers call it inside an epoch, writers with the shard lock.
+ */
+static cache_obj_t *cache_find(cache_index_t *idx, char *key, unsigned hash)
+{
+    unsigned i;
+    cache_obj_t *obj;
+
+    for (i = cache_slot(idx, hash);
+            (obj = __atomic_load_n(&idx->slot[i], __ATOMIC_ACQUIRE));
+            i = (i + 1) & idx->mask)
+        if (obj != CACHE_TOMBSTONE && obj->hash == hash
+                && !strcmp(obj->key, key))
+            return obj;
+    return NULL;
+}
+
+/*
+ * cache_reindex - Rebuild the index, dropping tombstones and doubling
+ *     its size when more than half of it is live. Readers may still be
+ *     probing the old one, so it is retired. Shard lock held.
+ */
+static void cache_reindex(cache_shard_t *sp)
+{
+    unsigned i, j, nslots = sp->index->mask + 1;
+    cache_index_t *old = sp->index, *idx;
+    cache_obj_t *obj;
+
+    if (sp->count * 2 >= nslots)
+        nslots *= 2;
+    idx = cache_index_new(nslots);
+    for (i = 0; i <= old->mask; i++) {
+        if (!(obj = old->slot[i]) || obj == CACHE_TOMBSTONE)
+            continue;
+        for (j = cache_slot(idx, obj->hash); idx->slot[j]; j = (j + 1) & idx->mask)
+            ;
+        idx->slot[j] = obj;
+    }
+    __atomic_store_n(&sp->index, idx, __ATOMIC_RELEASE);
+    sp->used = sp->count;
+    epoch_retire(Free, old);
+}
+
+/*
+ * cache_key - Build the key for host, port and path. Host names are
+ *     case-insensitive, so they are lowercased; paths are kept as is.
+ */
+void cache_key(char *key, size_t maxlen, char *host, char *port, char *path)
+{
+    char *p;
+
+    snprintf(key, maxlen, "%s:%s%s", host, port, path);
+    for (p = key; *p && *p != ':'; p++)
+        *p = tolower((unsigned char)*p);
+}
+
+/* cache_stale - Whether obj has outlived its lifetime */
+static int cache_stale(cache_obj_t *obj)
+{
+    return obj->expires && obj->expires <= time(NULL);
+}
+
+/*
+ * cache_get - cache_lookup within a known shard. Until the epoch ends,
+ *     obj cannot be retired, so it still holds the cache's reference.
+ *     A stale object is a miss; it stays until it is evicted or the
+ *     next insert of its key replaces it.
+ */
+static cache_obj_t *cache_get(cache_shard_t *sp, char *key, unsigned hash)
+{
+    cache_obj_t *obj;
+
+    epoch_enter();
+    if ((obj = cache_find(__atomic_load_n(&sp->index, __ATOMIC_ACQUIRE),
+                    key, hash)) && cache_stale(obj))
+        obj = NULL;
+    if (obj) {
+        sp->ev.policy->on_hit(&sp->ev, obj);
+        __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL);
+    }
+    epoch_exit();
+    return obj;
+}
+
+/*
+ * cache_lookup - Return the object cached under key with a reference
+ *     held for the caller, or NULL. Release it with cache_release.
+ */
+cache_obj_t *cache_lookup(char *key)
+{
+    unsigned hash = cache_hash(key);
+
+    return cache_get(cache_shard(hash), key, hash);
+}
+
+/* cache_release - Drop a reference; the last one frees the object */
+void cache_release(cache_obj_t *obj)
+{
+    if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        Free(obj->key);
+        iobuf_put_chain(obj->bufs);
+        Free(obj);
+    }
+}
+
+/* cache_retire - Drop the cache's reference to an unlinked object */
+static void cache_retire(void *obj)
+{
+    cache_release(obj);
+}
+
+/*
+ * cache_remove - Unlink victim from the shard and its policy, and
+ *     retire it. Caller holds the shard lock.
+ */
+static void cache_remove(cache_shard_t *sp, cache_obj_t *victim)
+{
+    cache_index_t *idx = sp->index;
+    unsigned i;
+
+    for (i = cache_slot(idx, victim->hash); idx->slot[i] != victim;
+            i = (i + 1) & idx->mask)
+        ;
+    __atomic_store_n(&idx->slot[i], CACHE_TOMBSTONE, __ATOMIC_RELEASE);
+    sp->count--;
+    evict_remove(&sp->ev, victim);
+    sp->size -= victim->size;
+    epoch_retire(cache_retire, victim);
+}
+
+/*
+ * cache_evict - Remove the object the shard's policy picks. Caller
+ *     holds the shard lock.
+ */
+static void cache_evict(cache_shard_t *sp)
+{
+    cache_remove(sp, sp->ev.policy->choose_victim(&sp->ev));
+}
+
+/*
+ * cache_insert - Cache the size bytes in the buffer chain bufs under
+ *     key until expires (0: for good). The cache takes over the
+ *     caller's references to bufs. If another thread cached the same
+ *     key first, and it is still fresh, or the eviction policy does
+ *     not admit it, the new copy is simply dropped. A stale copy is
+ *     replaced.
+ */
+void cache_insert(char *key, iobuf_t *bufs, size_t size, time_t expires)
+{
+    unsigned hash = cache_hash(key);
+    cache_shard_t *sp = cache_shard(hash);
+    cache_obj_t *obj, *old;
+    cache_index_t *idx;
+    unsigned i;
+
+    if (size > MAX_OBJECT_SIZE) {
+        iobuf_put_chain(bufs);
+        return;
+    }
+    obj = Malloc(sizeof(cache_obj_t));
+    obj->key = Malloc(strlen(key) + 1);
+    strcpy(obj->key, key);
+    obj->hash = hash;
+    obj->bufs = bufs;
+    obj->size = size;
+    obj->expires = expires;
+    obj->refcnt = 1;
+
+    pthread_mutex_lock(&sp->lock);
+    if (((old = cache_find(sp->index, key, hash)) && !cache_stale(old))
+            || !sp->ev.policy->admit(&sp->ev, hash, size)) {
+        pthread_mutex_unlock(&sp->lock);
+        cache_release(obj);
+        return;
+    }
+    if (old)
+        cache_remove(sp, old);
+    while (sp->count && sp->size + size > sp->ev.capacity)
+        cache_evict(sp);
+    if ((sp->used + 1) * 4 > (sp->index->mask + 1) * 3)
+        cache_reindex(sp);
+
+    /* Reuse the first tombstone on the probe path, if any */
+    idx = sp->index;
+    for (i = cache_slot(idx, hash);
+            (old = idx->slot[i]) && old != CACHE_TOMBSTONE;
+            i = (i + 1) & idx->mask)
+        ;
+    if (!old)
+        sp->used++;
+    sp->count++;
+    sp->ev.policy->on_insert(&sp->ev, obj);
+    sp->size += size;
+
+    /* Published last, so readers only ever see it whole */
+    __atomic_store_n(&idx->slot[i], obj, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+/*
+ * cache_start - Look key up, joining or starting a fetch on a miss:
+ *
+ *   CACHE_HIT    *objp is the cached object; cache_release it when done.
+ *   CACHE_FOLLOW *flp is another thread's fetch of key. Read it with
+ *                cache_flight_next, then cache_flight_leave it.
+ *   CACHE_LEAD   The caller fetches key, passing the response through
+ *                cache_flight_add and then cache_flight_finish on *flp.
+ *
+ * A follower that cannot block passes an eventfd as wakefd, which is
+ * written whenever the flight makes progress; others pass -1.
+ */
+int cache_start(char *key, cache_obj_t **objp, cache_flight_t **flp,
+        int wakefd)
+{
+    int i;
+    unsigned hash = cache_hash(key);
+    cache_shard_t *sp = cache_shard(hash);
+    cache_flight_t *fl;
+
+    *flp = NULL;
+    if ((*objp = cache_get(sp, key, hash))) {
+        stats_add(STATS_CACHE_HITS, 1);
+        return CACHE_HIT;
+    }
+
+    pthread_mutex_lock(&sp->flight_lock);
+    for (fl = sp->flights; fl; fl = fl->next)
+        if (fl->hash == hash && !strcmp(fl->key, key))
+            break;
+    if (fl) {
+        __atomic_add_fetch(&fl->refcnt, 1, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch(&fl->followers, 1, __ATOMIC_ACQ_REL);
+        if (wakefd >= 0) {
+            pthread_mutex_lock(&fl->lock);
+            for (i = 0; i < fl->nwakefds && fl->wakefds[i] != wakefd; i++)
+                ;
+            if (i == fl->nwakefds) {
+                if (fl->nwakefds == fl->wakecap) {
+                    fl->wakecap = fl->wakecap ? 2 * fl->wakecap : 4;
+                    fl->wakefds = Realloc(fl->wakefds,
+                            fl->wakecap * sizeof(int));
+                }
+                fl->wakefds[fl->nwakefds++] = wakefd;
+            }
+            pthread_mutex_unlock(&fl->lock);
+        }
+        pthread_mutex_unlock(&sp->flight_lock);
+        stats_add(STATS_CACHE_FOLLOWS, 1);
+        *flp = fl;
+        return CACHE_FOLLOW;
+    }
+
+    /* The previous leader may have just cached it and left */
+    if ((*objp = cache_get(sp, key, hash))) {
+        pthread_mutex_unlock(&sp->flight_lock);
+        stats_add(STATS_CACHE_HITS, 1);
+        return CACHE_HIT;
+    }
+
+    fl = Calloc(1, sizeof(cache_flight_t));
+    fl->key = Malloc(strlen(key) + 1);
+    strcpy(fl->key, key);
+    fl->hash = hash;
+    pthread_mutex_init(&fl->lock, NULL);
+    pthread_cond_init(&fl->cond, NULL);
+    fl->state = FLIGHT_RUNNING;
+    fl->buffering = 1;
+    fl->published = 1;
+    fl->refcnt = 1;
+    fl->next = sp->flights;
+    sp->flights = fl;
+    pthread_mutex_unlock(&sp->flight_lock);
+    stats_add(STATS_CACHE_MISSES, 1);
+    *flp = fl;
+    return CACHE_LEAD;
+}
+
+/* cache_unpublish - Stop new followers from joining fl. Leader only */
+static void cache_unpublish(cache_flight_t *fl)
+{
+    cache_shard_t *sp = cache_shard(fl->hash);
+    cache_flight_t **pp;
+
+    if (!fl->published)
+        return;
+    pthread_mutex_lock(&sp->flight_lock);
+    for (pp = &sp->flights; *pp != fl; pp = &(*pp)->next)
+        ;
+    *pp = fl->next;
+    fl->published = 0;
+    pthread_mutex_unlock(&sp->flight_lock);
+}
+
+/* cache_flight_free_chunks - Drop fl's buffered response */
+static void cache_flight_free_chunks(cache_flight_t *fl)
+{
+    iobuf_put_chain(fl->head);
+    fl->head = fl->tail = NULL;
+}
+
+/* cache_flight_release - Drop a reference; the last one frees fl */
+void cache_flight_release(cache_flight_t *fl)
+{
+    if (__atomic_sub_fetch(&fl->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        cache_flight_free_chunks(fl);
+        pthread_mutex_destroy(&fl->lock);
+        pthread_cond_destroy(&fl->cond);
+        Free(fl->wakefds);
+        Free(fl->key);
+        Free(fl);
+    }
+}
+
+/* cache_flight_wake - Tell followers fl has moved on. Call with fl->lock */
+static void cache_flight_wake(cache_flight_t *fl)
+{
+    int i;
+    uint64_t one = 1;
+
+    pthread_cond_broadcast(&fl->cond);
+    for (i = 0; i < fl->nwakefds; i++)
+        if (write(fl->wakefds[i], &one, sizeof(one)) < 0)
+            ;   /* Counter saturated, so the loop is already awake */
+}
+
+/* cache_flight_wants - Whether fl still keeps the response bytes */
+int cache_flight_wants(cache_flight_t *fl)
+{
+    return fl && fl->buffering;
+}
+
+/* cache_flight_followers - Number of threads still reading fl */
+int cache_flight_followers(cache_flight_t *fl)
+{
+    return fl ? __atomic_load_n(&fl->followers, __ATOMIC_ACQUIRE) : 0;
+}
+
+/*
+ * cache_flight_trim - Drop the chunks at the head of a streaming fl
+ *     that every cursor has moved past. The tail always stays, as the
+ *     leader appends to it. Call with fl->lock.
+ */
+static void cache_flight_trim(cache_flight_t *fl)
+{
+    iobuf_t *b;
+    cache_cursor_t *cur;
+
+    while ((b = fl->head) && b != fl->tail) {
+        /* A cursor is past b once it is on any other chunk */
+        for (cur = fl->cursors; cur && cur->chunk && cur->chunk != b;
+                cur = cur->next)
+            ;
+        if (cur)
+            return;
+        fl->head = b->next;
+        fl->trimmed = 1;
+        iobuf_put(b);
+    }
+}
+
+/*
+ * cache_flight_keeps - Whether fl keeps n more response bytes. Once the
+ *     response outgrows MAX_OBJECT_SIZE no one new may join, and unless
+ *     someone already follows, the bytes are dropped rather than kept.
+ *     If someone does, fl only keeps what its followers have yet to
+ *     read, until the last of them leaves.
+ */
+static int cache_flight_keeps(cache_flight_t *fl, size_t n)
+{
+    if (!fl || !fl->buffering)
+        return 0;
+    if (fl->len + n > MAX_OBJECT_SIZE && !fl->streaming) {
+        cache_unpublish(fl);
+        pthread_mutex_lock(&fl->lock);
+        fl->streaming = 1;
+        cache_flight_trim(fl);
+        pthread_mutex_unlock(&fl->lock);
+    }
+    if (fl->streaming && !cache_flight_followers(fl)) {
+        fl->buffering = 0;
+        cache_flight_free_chunks(fl);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * cache_flight_add - Leader appends a copy of n response bytes for its
+ *     followers and the cache.
+ */
+void cache_flight_add(cache_flight_t *fl, char *data, size_t n)
+{
+    size_t m;
+    iobuf_t *ch;
+
+    if (!cache_flight_keeps(fl, n))
+        return;
+    while (n > 0) {
+        if (!(ch = fl->tail) || ch->len == IOBUF_SIZE)
+            ch = iobuf_get();
+        m = IOBUF_SIZE - ch->len;
+        if (m > n)
+            m = n;
+        memcpy(ch->data + ch->len, data, m);
+
+        /* Followers only look at bytes below ch->len */
+        pthread_mutex_lock(&fl->lock);
+        if (ch != fl->tail) {
+            if (fl->tail)
+                fl->tail->next = ch;
+            else
+                fl->head = ch;
+            fl->tail = ch;
+        }
+        ch->len += m;
+        fl->len += m;
+        pthread_mutex_unlock(&fl->lock);
+        data += m;
+        n -= m;
+    }
+    if (cache_flight_followers(fl)) {
+        pthread_mutex_lock(&fl->lock);
+        cache_flight_wake(fl);
+        pthread_mutex_unlock(&fl->lock);
+    }
+}
+
+/*
+ * cache_flight_append - Leader has read n response bytes into b, at
+ *     b->data + b->len. Rather than copying them, fl takes a reference
+ *     to b and appends it to the response, unless b is already its
+ *     last buffer. b must be fl's last buffer or in no chain at all,
+ *     and the leader may only write past b->len from then on.
+ */
+void cache_flight_append(cache_flight_t *fl, iobuf_t *b, size_t n)
+{
+    if (n == 0 || !cache_flight_keeps(fl, n))
+        return;
+    pthread_mutex_lock(&fl->lock);
+    if (b != fl->tail) {
+        iobuf_ref(b);
+        if (fl->tail)
+            fl->tail->next = b;
+        else
+            fl->head = b;
+        fl->tail = b;
+    }
+    b->len += n;
+    fl->len += n;
+    if (cache_flight_followers(fl))
+        cache_flight_wake(fl);
+    pthread_mutex_unlock(&fl->lock);
+}
+
+/*
+ * cache_flight_finish - Leader is done with fl; ok says whether the
+ *     whole response arrived. A complete "200" response that fits in
+ *     MAX_OBJECT_SIZE, and whose headers let a shared cache keep it
+ *     (see http_resp_ttl), is inserted into the cache, which shares
+ *     fl's buffers, before followers are told the flight is over.
+ */
+void cache_flight_finish(cache_flight_t *fl, int ok)
+{
+    iobuf_t *b;
+    long ttl;
+
+    if (!fl)
+        return;
+    if (ok && fl->buffering && fl->len <= MAX_OBJECT_SIZE
+            && http_resp_status(fl->head->data, fl->head->len) == 200
+            && (ttl = http_resp_ttl(fl->head->data, fl->head->len,
+                    CACHE_DEFAULT_TTL)) > 0) {
+        for (b = fl->head; b; b = b->next)
+            iobuf_ref(b);
+        cache_insert(fl->key, fl->head, fl->len, time(NULL) + ttl);
+    }
+    cache_unpublish(fl);
+
+    pthread_mutex_lock(&fl->lock);
+    fl->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+    cache_flight_wake(fl);
+    pthread_mutex_unlock(&fl->lock);
+    cache_flight_release(fl);
+}
+
+/*
+ * cache_flight_next - Follower waits for bytes past its cursor. Returns
+ *     how many are readable at *datap, 0 once the whole response has
+ *     been read, or -1 if the leader's fetch failed, or if the start of
+ *     the response was dropped before the follower first read (its
+ *     cursor's chunk is still NULL then). Unless wait is set it returns
+ *     CACHE_AGAIN instead of waiting.
+ */
+ssize_t cache_flight_next(cache_flight_t *fl, cache_cursor_t *cur,
+        char **datap, int wait)
+{
+    ssize_t n;
+
+    pthread_mutex_lock(&fl->lock);
+    if (!cur->joined) {
+        if (fl->trimmed) {
+            pthread_mutex_unlock(&fl->lock);
+            return -1;
+        }
+        cur->next = fl->cursors;
+        fl->cursors = cur;
+        cur->joined = 1;
+    }
+    while (1) {
+        if (!cur->chunk && fl->head) {
+            cur->chunk = fl->head;
+            cur->off = 0;
+        }
+        if (cur->chunk && cur->off == cur->chunk->len && cur->chunk->next) {
+            cur->chunk = cur->chunk->next;
+            cur->off = 0;
+            if (fl->streaming)
+                cache_flight_trim(fl);
+        }
+        if (cur->chunk && cur->off < cur->chunk->len)
+            break;
+        if (fl->state != FLIGHT_RUNNING) {
+            n = (fl->state == FLIGHT_DONE) ? 0 : -1;
+            pthread_mutex_unlock(&fl->lock);
+            return n;
+        }
+        if (!wait) {
+            pthread_mutex_unlock(&fl->lock);
+            return CACHE_AGAIN;
+        }
+        pthread_cond_wait(&fl->cond, &fl->lock);
+    }
+    *datap = cur->chunk->data + cur->off;
+    n = cur->chunk->len - cur->off;
+    cur->off += n;
+    pthread_mutex_unlock(&fl->lock);
+    return n;
+}
+
+/* cache_flight_leave - Follower is done reading fl at cur */
+void cache_flight_leave(cache_flight_t *fl, cache_cursor_t *cur)
+{
+    cache_cursor_t **pp;
+
+    if (cur->joined) {
+        pthread_mutex_lock(&fl->lock);
+        for (pp = &fl->cursors; *pp != cur; pp = &(*pp)->next)
+            ;
+        *pp = cur->next;
+        cur->joined = 0;
+        if (fl->streaming)
+            cache_flight_trim(fl);
+        pthread_mutex_unlock(&fl->lock);
+    }
+    __atomic_sub_fetch(&fl->followers, 1, __ATOMIC_ACQ_REL);
+    cache_flight_release(fl);
+}
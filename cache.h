@@ -0,0 +1,76 @@
+/*
+ * cache.h - Thread-safe in-memory cache of web objects
+ *
+ * Objects are whole responses (status line, headers and body) of at
+ * most MAX_OBJECT_SIZE bytes, keyed by normalized host:port/path, that
+ * are only served until they go stale. The
+ * cache holds at most the capacity given to cache_init, MAX_CACHE_SIZE
+ * in the proxy, of object data, split over CACHE_SHARDS shards. Which
+ * objects it keeps is up to its eviction policy (see evict.h).
+ * Concurrent misses on one key share a single origin fetch (see
+ * cache_start).
+ *
+ * Object data is a chain of pool buffers (see iobuf.h) shared with the
+ * fetch that filled it. The first buffer holds the whole response head.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include "iobuf.h"
+
+#define CACHE_SHARDS 8              /* Must be a power of two */
+#define CACHE_DEFAULT_TTL 300       /* Seconds a response that gives no
+                                       lifetime of its own stays fresh */
+
+struct evict_policy;
+
+typedef struct cache_obj {
+    char *key;
+    unsigned hash;              /* cache_hash(key), picks shard and slot */
+    iobuf_t *bufs;              /* Complete response as sent by origin */
+    size_t size;
+    time_t expires;             /* When it goes stale; 0 for never */
+    unsigned long stamp;        /* Last use, or priority, per policy */
+    unsigned freq;              /* Hits, as the policy counts them */
+    int queue;                  /* Policy queue the object is in */
+    int refcnt;                 /* One for the cache, one per reader */
+    struct cache_obj *prev, *next;      /* In its policy queue */
+} cache_obj_t;
+
+/* A fetch in progress that other misses on the same key can follow */
+typedef struct cache_flight cache_flight_t;
+
+/* A follower's read position in a flight; starts out all zero */
+typedef struct cache_cursor {
+    iobuf_t *chunk;
+    size_t off;
+    int joined;                 /* In the flight's list of cursors */
+    struct cache_cursor *next;
+} cache_cursor_t;
+
+#define CACHE_HIT    0          /* cache_start results */
+#define CACHE_FOLLOW 1
+#define CACHE_LEAD   2
+
+#define CACHE_AGAIN  (-2)       /* cache_flight_next would have to wait */
+
+void cache_init(struct evict_policy *policy, size_t capacity);
+void cache_key(char *key, size_t maxlen, char *host, char *port, char *path);
+cache_obj_t *cache_lookup(char *key);
+void cache_release(cache_obj_t *obj);
+void cache_insert(char *key, iobuf_t *bufs, size_t size, time_t expires);
+
+int cache_start(char *key, cache_obj_t **objp, cache_flight_t **flp,
+        int wakefd);
+void cache_flight_add(cache_flight_t *fl, char *data, size_t n);
+void cache_flight_append(cache_flight_t *fl, iobuf_t *b, size_t n);
+void cache_flight_finish(cache_flight_t *fl, int ok);
+int cache_flight_wants(cache_flight_t *fl);
+int cache_flight_followers(cache_flight_t *fl);
+ssize_t cache_flight_next(cache_flight_t *fl, cache_cursor_t *cur,
+        char **datap, int wait);
+void cache_flight_leave(cache_flight_t *fl, cache_cursor_t *cur);
+void cache_flight_release(cache_flight_t *fl);
+
+#endif /* __CACHE_H__ */
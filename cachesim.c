@@ -0,0 +1,304 @@
+/*
+ * cachesim.c - Replay access logs through the proxy's cache
+ *
+ * usage: cachesim [-p policy,...] [-s size,...] [-w secs] [-j jobs]
+ *                 [log ...]
+ *
+ * Reads access logs as the proxy writes them (see alog.h), or standard
+ * input, and replays their GET requests in order through cache.c and
+ * evict.c, as linked into the proxy, once for each eviction policy and
+ * cache size. A request hits if its key is cached. On a miss the proxy
+ * answered with a 200, a response of the logged size is inserted, so
+ * objects larger than MAX_OBJECT_SIZE are never cached, just as in the
+ * proxy. Requests for the proxy's own pages are skipped.
+ *
+ * For each policy and size it prints the share of requests that hit
+ * (object hit ratio) and of the bytes sent that came from the cache
+ * (byte hit ratio): one point on each policy's hit ratio curves. Sizes
+ * take a K, M or G suffix and must give each of the CACHE_SHARDS shards
+ * room for a MAX_OBJECT_SIZE object. By default they double from
+ * MAX_CACHE_SIZE to 64 times that, and every policy is run. Requests
+ * in the first secs of the log (-w) warm the cache but are not counted.
+ *
+ * Each replay runs in a child process of its own, up to jobs (default:
+ * one per CPU) at a time, so each starts from an empty cache.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "evict.h"
+#include "stats.h"
+
+#define CS_FIELDS 9                 /* Fields of an access log line */
+#define CS_MAXRUNS 256
+#define CS_SIZES 7                  /* Default sizes, doubling */
+
+/* One GET from the log */
+typedef struct {
+    double time;                    /* Seconds since the epoch */
+    char *key;                      /* Cache key, as the proxy builds it */
+    size_t size;                    /* Bytes sent to the client */
+    int ok;                         /* Answered with a 200 */
+} cs_req_t;
+
+/* A replay's counts, sent back from its child */
+typedef struct {
+    unsigned long reqs, hits;
+    unsigned long long bytes, hitbytes;
+} cs_result_t;
+
+typedef struct {
+    evict_policy_t *policy;
+    size_t size;
+    pid_t pid;
+    int fd;                         /* Read end of the child's pipe */
+} cs_run_t;
+
+static char cs_policies[] = "lru,tinylfu,s3fifo,gdsf";
+
+static cs_req_t *cs_reqs;
+static unsigned long cs_nreqs, cs_reqcap;
+static double cs_first, cs_last;    /* Log's earliest and latest times */
+
+/*
+ * cs_parse - Add the request logged in line, if it is a GET the cache
+ *     would see
+ */
+static void cs_parse(char *line)
+{
+    char *f[CS_FIELDS], *p = line, *uri, *host, *port, *path;
+    cs_req_t *rq;
+    size_t len;
+    int n;
+
+    for (n = 0; n < CS_FIELDS && p; n++)
+        f[n] = strsep(&p, "\t\n");
+    if (n < CS_FIELDS || strcmp(f[3], "GET"))
+        return;
+
+    /* Same buffer sizes and key as build_request */
+    uri = f[4];
+    len = strlen(uri);
+    host = Malloc(len + 1);
+    port = Malloc(len + 3);
+    path = Malloc(len + 2);
+    parse_uri(uri, host, port, path);
+    if (!stats_wanted(host, path)) {
+        if (cs_nreqs == cs_reqcap) {
+            cs_reqcap = cs_reqcap ? 2 * cs_reqcap : 1024;
+            cs_reqs = Realloc(cs_reqs, cs_reqcap * sizeof(cs_req_t));
+        }
+        rq = &cs_reqs[cs_nreqs++];
+        rq->time = strtod(f[0], NULL);
+        /* Threads' records reach the log only roughly in time order */
+        if (cs_nreqs == 1 || rq->time < cs_first)
+            cs_first = rq->time;
+        if (rq->time > cs_last)
+            cs_last = rq->time;
+        len = strlen(host) + strlen(port) + strlen(path) + 2;
+        rq->key = Malloc(len);
+        cache_key(rq->key, len, host, port, path);
+        rq->size = strtoul(f[6], NULL, 10);
+        rq->ok = (atoi(f[5]) == 200);
+    }
+    Free(host);
+    Free(port);
+    Free(path);
+}
+
+/* cs_read_log - Add the requests in the log on fp */
+static void cs_read_log(FILE *fp)
+{
+    char line[MAXLINE];
+
+    while (Fgets(line, sizeof(line), fp))
+        cs_parse(line);
+}
+
+/* cs_response - A chain of pool buffers standing in for size bytes */
+static iobuf_t *cs_response(size_t size)
+{
+    iobuf_t *head = NULL, **tailp = &head;
+
+    do {
+        *tailp = iobuf_get();
+        (*tailp)->len = (size < IOBUF_SIZE) ? size : IOBUF_SIZE;
+        size -= (*tailp)->len;
+        tailp = &(*tailp)->next;
+    } while (size > 0);
+    return head;
+}
+
+/*
+ * cs_replay - Run every request through a fresh cache of size bytes
+ *     evicting by policy, counting those after the warm-up
+ */
+static void cs_replay(evict_policy_t *policy, size_t size, double warmup,
+        cs_result_t *res)
+{
+    unsigned long i;
+    double start = cs_first + warmup;
+    cs_req_t *rq;
+    cache_obj_t *obj;
+    int hit;
+
+    cache_init(policy, size);
+    memset(res, 0, sizeof(*res));
+    for (i = 0; i < cs_nreqs; i++) {
+        rq = &cs_reqs[i];
+        if ((hit = ((obj = cache_lookup(rq->key)) != NULL)))
+            cache_release(obj);
+        else if (rq->ok)
+            cache_insert(rq->key, cs_response(rq->size), rq->size, 0);
+        if (rq->time < start)
+            continue;
+        res->reqs++;
+        res->bytes += rq->size;
+        if (hit) {
+            res->hits++;
+            res->hitbytes += rq->size;
+        }
+    }
+}
+
+/* cs_start - Fork a child to replay run, its result coming down a pipe */
+static void cs_start(cs_run_t *run, double warmup)
+{
+    int fds[2];
+    cs_result_t res;
+
+    if (pipe(fds) < 0)
+        unix_error("cachesim: pipe");
+    fflush(stdout);
+    if ((run->pid = Fork()) == 0) {
+        Close(fds[0]);
+        cs_replay(run->policy, run->size, warmup, &res);
+        Rio_writen(fds[1], &res, sizeof(res));
+        exit(0);
+    }
+    Close(fds[1]);
+    run->fd = fds[0];
+}
+
+/* cs_finish - Wait for run's child and print its result */
+static void cs_finish(cs_run_t *run)
+{
+    cs_result_t res;
+    int status;
+
+    if (Rio_readn(run->fd, &res, sizeof(res)) != sizeof(res))
+        app_error("cachesim: replay failed");
+    Close(run->fd);
+    Waitpid(run->pid, &status, 0);
+    printf("%-10s %12zu %10lu %10.2f %10.2f\n", run->policy->name,
+            run->size, res.reqs,
+            res.reqs ? 100.0 * res.hits / res.reqs : 0.0,
+            res.bytes ? 100.0 * res.hitbytes / res.bytes : 0.0);
+    fflush(stdout);
+}
+
+/* cs_size - Parse a size with an optional K, M or G suffix; 0 if bad */
+static size_t cs_size(char *s)
+{
+    char *end;
+    double n = strtod(s, &end);
+
+    switch (*end) {
+    case 'K': case 'k':
+        n *= 1024;
+        end++;
+        break;
+    case 'M': case 'm':
+        n *= 1024 * 1024;
+        end++;
+        break;
+    case 'G': case 'g':
+        n *= 1024 * 1024 * 1024;
+        end++;
+        break;
+    }
+    if (*end || n < (double)CACHE_SHARDS * MAX_OBJECT_SIZE)
+        return 0;
+    return (size_t)n;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-p policy,...] [-s size,...] [-w secs] "
+            "[-j jobs]\n       [log ...]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int i, j, opt, nsizes = 0, jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int nruns = 0, next = 0;
+    char *policies = cs_policies, *sizelist = NULL, *name;
+    size_t sizes[CS_MAXRUNS];
+    double warmup = 0;
+    evict_policy_t *policy;
+    cs_run_t runs[CS_MAXRUNS];
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "p:s:w:j:")) != -1) {
+        switch (opt) {
+        case 'p':
+            policies = optarg;
+            break;
+        case 's':
+            sizelist = optarg;
+            break;
+        case 'w':
+            warmup = atof(optarg);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (jobs <= 0 || warmup < 0)
+        usage(argv[0]);
+    if (sizelist) {
+        while ((name = strsep(&sizelist, ",")))
+            if (nsizes == CS_MAXRUNS || !(sizes[nsizes++] = cs_size(name)))
+                usage(argv[0]);
+    } else
+        for (nsizes = 0; nsizes < CS_SIZES; nsizes++)
+            sizes[nsizes] = (size_t)MAX_CACHE_SIZE << nsizes;
+    while ((name = strsep(&policies, ","))) {
+        if (!(policy = evict_policy(name)))
+            usage(argv[0]);
+        for (j = 0; j < nsizes; j++) {
+            if (nruns == CS_MAXRUNS)
+                usage(argv[0]);
+            runs[nruns].policy = policy;
+            runs[nruns++].size = sizes[j];
+        }
+    }
+
+    if (optind == argc)
+        cs_read_log(stdin);
+    for (i = optind; i < argc; i++) {
+        if (!(fp = fopen(argv[i], "r")))
+            unix_error("cachesim: cannot open log");
+        cs_read_log(fp);
+        fclose(fp);
+    }
+    if (cs_nreqs == 0)
+        app_error("cachesim: no GET requests in the log");
+
+    printf("%lu requests over %.1f s, first %.1f s warming up\n", cs_nreqs,
+            cs_last - cs_first, warmup);
+    printf("%-10s %12s %10s %10s %10s\n", "policy", "size", "requests",
+            "hit %", "byte hit %");
+    for (i = 0; i < nruns; i++) {
+        if (i - next == jobs)
+            cs_finish(&runs[next++]);
+        cs_start(&runs[i], warmup);
+    }
+    while (next < nruns)
+        cs_finish(&runs[next++]);
+    exit(0);
+}
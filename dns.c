@@ -0,0 +1,848 @@
+/*
+ * dns.c - Caching resolver for origin host names
+ *
+ * Names live in a hash table under one mutex. An entry is either
+ * pending, while the resolver thread has queries out for it, or done,
+ * holding its addresses (none for a name that does not exist) until
+ * it expires. A lookup that finds an entry pending waits for it rather
+ * than asking again: threads on dns_cond, event loops on their eventfd.
+ *
+ * The resolver thread owns a UDP socket connected to the nameserver,
+ * so replies from anywhere else never reach it, and matches replies to
+ * queries by ID and question. A and AAAA are asked in parallel. An
+ * unanswered query is sent again every DNS_TIMEOUT ms, DNS_TRIES times
+ * in all; a name that still has no answer, or that the nameserver
+ * failed on, is handed to getaddrinfo instead.
+ *
+ * Connections to a name's addresses are raced ("happy eyeballs", RFC
+ * 8305): the addresses are interleaved by family, a new attempt starts
+ * every DNS_CONNECT_DELAY ms while the earlier ones are still pending,
+ * and the first to connect wins. The family that won is remembered in
+ * the name's entry and tried first next time, so a host whose IPv6 is
+ * broken costs one delay once rather than a connect timeout each time.
+ */
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "dns.h"
+#include "stats.h"
+
+#define DNS_BUCKETS 256          /* Must be a power of two */
+#define DNS_MAX_NAMES 4096       /* Expired names are swept beyond this */
+#define DNS_MAXQUERIES 64        /* Queries out at once */
+#define DNS_TIMEOUT 1000         /* ms before a query is sent again */
+#define DNS_TRIES 3
+#define DNS_MIN_TTL 1            /* Seconds an answer is kept, at least */
+#define DNS_MAX_TTL 3600         /*   and at most */
+#define DNS_NEG_TTL 30           /* At most, for a name that is missing */
+#define DNS_FALLBACK_TTL 60      /* For getaddrinfo's answers */
+#define DNS_MSGSIZE 1232         /* Largest UDP reply we take */
+
+#define DNS_T_A 1                /* Record types */
+#define DNS_T_SOA 6
+#define DNS_T_AAAA 28
+
+#define DNS_PENDING 0            /* Entry states */
+#define DNS_DONE 1
+
+typedef struct dns_entry {
+    char *name;
+    unsigned hash;
+    int state;
+    int fixed;                   /* From the hosts file, never expires */
+    time_t expires;
+    dns_result_t res;
+    int queries;                 /* Queries out for it */
+    int failed;                  /* One of them got no usable answer */
+    unsigned ttl;                /* Least TTL in the answers so far */
+    int family;                  /* Won the last connect race, or 0 */
+    int waiters;                 /* Threads waiting in dns_lookup */
+    int *wakefds;                /* Event loops waiting on it */
+    int nwakefds, wakecap;
+    struct dns_entry *next;      /* In its bucket */
+    struct dns_entry *qnext;     /* In dns_queue */
+} dns_entry_t;
+
+/* A query out with the nameserver, owned by the resolver thread */
+typedef struct {
+    dns_entry_t *e;              /* NULL while the slot is free */
+    unsigned short id;
+    int type;
+    int tries;
+    long long sent;              /* ms */
+} dns_query_t;
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond = PTHREAD_COND_INITIALIZER;
+static dns_entry_t *dns_buckets[DNS_BUCKETS];
+static int dns_nnames;
+static dns_entry_t *dns_queue, *dns_queue_tail; /* Names to ask about */
+static int dns_kick = -1;        /* eventfd: dns_queue has grown */
+static int dns_sock = -1;        /* Connected to the nameserver, or -1 */
+static dns_query_t dns_queries[DNS_MAXQUERIES];
+static unsigned dns_seed;
+
+static void dns_fallback(dns_entry_t *e);
+
+/* dns_hash - FNV-1a hash of a host name, ignoring case */
+static unsigned dns_hash(char *name)
+{
+    unsigned h = 2166136261u;
+
+    for (; *name; name++)
+        h = (h ^ (unsigned char)tolower((unsigned char)*name)) * 16777619u;
+    return h;
+}
+
+/* dns_now - Monotonic clock in ms */
+static long long dns_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* dns_sweep - Free expired entries no one is waiting on. Call with lock */
+static void dns_sweep(time_t now)
+{
+    int i;
+    dns_entry_t *e, **ep;
+
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        for (ep = &dns_buckets[i]; (e = *ep) != NULL; ) {
+            if (e->state == DNS_DONE && !e->fixed && e->expires <= now
+                    && e->waiters == 0) {
+                *ep = e->next;
+                Free(e->name);
+                Free(e->wakefds);
+                Free(e);
+                dns_nnames--;
+            }
+            else
+                ep = &e->next;
+        }
+    }
+}
+
+/*
+ * dns_find - Look up the entry for name, creating it if create is set.
+ *     A new entry is done but already expired. Call with the lock.
+ */
+static dns_entry_t *dns_find(char *name, unsigned hash, int create)
+{
+    dns_entry_t *e, **bp = &dns_buckets[hash & (DNS_BUCKETS - 1)];
+
+    for (e = *bp; e; e = e->next)
+        if (e->hash == hash && !strcasecmp(e->name, name))
+            return e;
+    if (!create)
+        return NULL;
+    if (dns_nnames >= DNS_MAX_NAMES)
+        dns_sweep(time(NULL));
+    e = Calloc(1, sizeof(dns_entry_t));
+    e->name = Malloc(strlen(name) + 1);
+    strcpy(e->name, name);
+    e->hash = hash;
+    e->state = DNS_DONE;
+    e->next = *bp;
+    *bp = e;
+    dns_nnames++;
+    return e;
+}
+
+/* dns_add - Add address a to res, if there is room */
+static void dns_add(dns_result_t *res, dns_addr_t *a)
+{
+    if (res->naddrs < DNS_MAXADDRS)
+        res->addrs[res->naddrs++] = *a;
+}
+
+/* dns_numeric - If host is an address literal, put it in res */
+static int dns_numeric(char *host, dns_result_t *res)
+{
+    dns_addr_t a;
+
+    if (inet_pton(AF_INET, host, a.addr) == 1)
+        a.family = AF_INET;
+    else if (inet_pton(AF_INET6, host, a.addr) == 1)
+        a.family = AF_INET6;
+    else
+        return 0;
+    res->naddrs = 0;
+    dns_add(res, &a);
+    return 1;
+}
+
+/* dns_hosts - Load the static table from an /etc/hosts style file */
+static void dns_hosts(char *path)
+{
+    FILE *fp;
+    char line[MAXLINE], *tok, *save;
+    dns_addr_t a;
+    dns_entry_t *e;
+
+    if (!(fp = fopen(path, "r"))) {
+        fprintf(stderr, "dns: cannot read %s: %s\n", path, strerror(errno));
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if ((tok = strchr(line, '#')))
+            *tok = '\0';
+        if (!(tok = strtok_r(line, " \t\r\n", &save)))
+            continue;
+        if (inet_pton(AF_INET, tok, a.addr) == 1)
+            a.family = AF_INET;
+        else if (inet_pton(AF_INET6, tok, a.addr) == 1)
+            a.family = AF_INET6;
+        else
+            continue;
+        while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+            e = dns_find(tok, dns_hash(tok), 1);
+            e->fixed = 1;
+            dns_add(&e->res, &a);
+        }
+    }
+    fclose(fp);
+}
+
+/* dns_done - Publish e's answer and wake everyone waiting for it */
+static void dns_done(dns_entry_t *e)
+{
+    int i;
+    uint64_t one = 1;
+
+    if (e->ttl < DNS_MIN_TTL)
+        e->ttl = DNS_MIN_TTL;
+    e->expires = time(NULL) + e->ttl;
+    e->state = DNS_DONE;
+    pthread_cond_broadcast(&dns_cond);
+    for (i = 0; i < e->nwakefds; i++)
+        if (write(e->wakefds[i], &one, sizeof(one)) < 0)
+            ;   /* The counter is saturated, so it is readable anyway */
+    e->nwakefds = 0;
+}
+
+/*
+ * dns_lookup - Find the addresses of host. Returns DNS_OK with them in
+ *     res, or DNS_NOTFOUND. If they have to be asked for and wakefd is
+ *     not -1, returns DNS_AGAIN at once instead of waiting, and writes
+ *     to wakefd once a second call will get an answer.
+ */
+int dns_lookup(char *host, dns_result_t *res, int wakefd)
+{
+    int i;
+    uint64_t one = 1;
+    dns_entry_t *e;
+
+    if (dns_numeric(host, res))
+        return DNS_OK;
+
+    pthread_mutex_lock(&dns_lock);
+    e = dns_find(host, dns_hash(host), 1);
+    if (e->state == DNS_DONE && !e->fixed && e->expires <= time(NULL)) {
+        /* Never asked, or the answer is stale: queue it for the
+           resolver thread */
+        e->state = DNS_PENDING;
+        e->failed = 0;
+        e->ttl = DNS_MAX_TTL;
+        e->res.naddrs = 0;
+        e->qnext = NULL;
+        if (dns_queue_tail)
+            dns_queue_tail->qnext = e;
+        else
+            dns_queue = e;
+        dns_queue_tail = e;
+        if (write(dns_kick, &one, sizeof(one)) < 0)
+            ;   /* Already kicked */
+    }
+    if (e->state == DNS_PENDING && wakefd >= 0) {
+        for (i = 0; i < e->nwakefds && e->wakefds[i] != wakefd; i++)
+            ;
+        if (i == e->nwakefds) {
+            if (e->nwakefds == e->wakecap) {
+                e->wakecap = e->wakecap ? 2 * e->wakecap : 4;
+                e->wakefds = Realloc(e->wakefds, e->wakecap * sizeof(int));
+            }
+            e->wakefds[e->nwakefds++] = wakefd;
+        }
+        pthread_mutex_unlock(&dns_lock);
+        return DNS_AGAIN;
+    }
+    e->waiters++;
+    while (e->state == DNS_PENDING)
+        pthread_cond_wait(&dns_cond, &dns_lock);
+    e->waiters--;
+    *res = e->res;
+    pthread_mutex_unlock(&dns_lock);
+    return res->naddrs ? DNS_OK : DNS_NOTFOUND;
+}
+
+/*
+ * dns_finish - Query q is over, with the addresses in res and their
+ *     TTL, or, if res is NULL, without a usable answer. Once all of its
+ *     entry's queries are over, publish the entry or fall back.
+ */
+static void dns_finish(dns_query_t *q, dns_result_t *res, unsigned ttl)
+{
+    int i, done, fallback;
+    dns_entry_t *e = q->e;
+
+    q->e = NULL;
+    pthread_mutex_lock(&dns_lock);
+    if (!res)
+        e->failed = 1;
+    else {
+        for (i = 0; i < res->naddrs; i++)
+            dns_add(&e->res, &res->addrs[i]);
+        if (ttl < e->ttl)
+            e->ttl = ttl;
+    }
+    done = (--e->queries == 0);
+    fallback = done && e->failed && e->res.naddrs == 0;
+    if (done && !fallback)
+        dns_done(e);
+    pthread_mutex_unlock(&dns_lock);
+    if (fallback)
+        dns_fallback(e);
+}
+
+/*
+ * dns_fallback - Look e up with getaddrinfo, for when the nameserver
+ *     is unusable. Blocks the resolver thread, so only ever a last
+ *     resort.
+ */
+static void dns_fallback(dns_entry_t *e)
+{
+    int rc;
+    struct addrinfo hints, *listp, *p;
+    dns_result_t res;
+    dns_addr_t a;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    res.naddrs = 0;
+    if ((rc = getaddrinfo(e->name, NULL, &hints, &listp)) == 0) {
+        for (p = listp; p; p = p->ai_next) {
+            a.family = p->ai_family;
+            if (p->ai_family == AF_INET)
+                memcpy(a.addr, &((struct sockaddr_in *)p->ai_addr)->sin_addr, 4);
+            else if (p->ai_family == AF_INET6)
+                memcpy(a.addr,
+                        &((struct sockaddr_in6 *)p->ai_addr)->sin6_addr, 16);
+            else
+                continue;
+            dns_add(&res, &a);
+        }
+        freeaddrinfo(listp);
+    }
+
+    pthread_mutex_lock(&dns_lock);
+    e->res = res;
+    if (res.naddrs)
+        e->ttl = DNS_FALLBACK_TTL;
+    else
+        e->ttl = (rc == EAI_NONAME) ? DNS_NEG_TTL : DNS_MIN_TTL;
+    dns_done(e);
+    pthread_mutex_unlock(&dns_lock);
+}
+
+/*
+ * dns_send - (Re)send query q. Returns -1 if the name cannot be put in
+ *     a query or the nameserver refuses it.
+ */
+static int dns_send(dns_query_t *q)
+{
+    unsigned char msg[DNS_MSGSIZE], *p = msg + 12;
+    char *label = q->e->name, *dot;
+    size_t n;
+
+    memset(msg, 0, 12);
+    msg[0] = q->id >> 8;
+    msg[1] = q->id & 0xff;
+    msg[2] = 0x01;              /* RD: recursion desired */
+    msg[5] = 1;                 /* One question */
+    while (*label) {
+        dot = strchr(label, '.');
+        n = dot ? (size_t)(dot - label) : strlen(label);
+        if (n == 0 || n > 63 || p + n + 6 > msg + 12 + 255)
+            return -1;
+        *p++ = n;
+        memcpy(p, label, n);
+        p += n;
+        label += n + (dot != NULL);
+    }
+    *p++ = 0;
+    *p++ = q->type >> 8;
+    *p++ = q->type & 0xff;
+    *p++ = 0;
+    *p++ = 1;                   /* Class IN */
+
+    q->sent = dns_now();
+    q->tries++;
+    if (send(dns_sock, msg, p - msg, 0) < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+/* dns_start - Put queries for e's A and AAAA records in free slots */
+static void dns_start(dns_entry_t *e)
+{
+    int i, j, k, types[2] = { DNS_T_A, DNS_T_AAAA };
+    unsigned short id;
+
+    e->queries = 2;
+    for (k = 0, i = 0; k < 2; k++) {
+        while (dns_queries[i].e)
+            i++;
+        do {        /* IDs of queries out must differ */
+            dns_seed ^= dns_seed << 13;
+            dns_seed ^= dns_seed >> 17;
+            dns_seed ^= dns_seed << 5;
+            id = dns_seed;
+            for (j = 0; j < DNS_MAXQUERIES
+                    && !(dns_queries[j].e && dns_queries[j].id == id); j++)
+                ;
+        } while (j < DNS_MAXQUERIES);
+        dns_queries[i].e = e;
+        dns_queries[i].id = id;
+        dns_queries[i].type = types[k];
+        dns_queries[i].tries = 0;
+    }
+    for (i = 0; i < DNS_MAXQUERIES; i++)
+        if (dns_queries[i].e == e && dns_send(&dns_queries[i]) < 0)
+            dns_finish(&dns_queries[i], NULL, 0);
+}
+
+/* dns_send_queued - Start on as many queued names as there is room for */
+static void dns_send_queued(void)
+{
+    int i, nfree = 0;
+    dns_entry_t *e, *list = NULL, **tail = &list;
+
+    for (i = 0; i < DNS_MAXQUERIES; i++)
+        nfree += (dns_queries[i].e == NULL);
+    pthread_mutex_lock(&dns_lock);
+    while ((e = dns_queue) && (dns_sock < 0 || nfree >= 2)) {
+        if (!(dns_queue = e->qnext))
+            dns_queue_tail = NULL;
+        e->qnext = NULL;
+        *tail = e;
+        tail = &e->qnext;
+        nfree -= 2;
+    }
+    pthread_mutex_unlock(&dns_lock);
+
+    while ((e = list)) {
+        list = e->qnext;
+        if (dns_sock < 0)
+            dns_fallback(e);
+        else
+            dns_start(e);
+    }
+}
+
+/* dns_skip - Skip the (possibly compressed) name at msg[off], or -1 */
+static int dns_skip(unsigned char *msg, int len, int off)
+{
+    while (off < len) {
+        if (msg[off] == 0)
+            return off + 1;
+        if ((msg[off] & 0xc0) == 0xc0)
+            return (off + 2 <= len) ? off + 2 : -1;
+        off += msg[off] + 1;
+    }
+    return -1;
+}
+
+/* dns_get16, dns_get32 - Big-endian integers in a message */
+static unsigned dns_get16(unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned dns_get32(unsigned char *p)
+{
+    return ((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * dns_parse - If msg[0..len) is the reply to query q, put the addresses
+ *     it gives in res and how long they hold in *ttl: the least of their
+ *     TTLs, or for a missing name or type the SOA's TTL, at most
+ *     DNS_NEG_TTL. Returns 0 then, 1 if the reply is a failure, or -1 if
+ *     msg does not answer q at all.
+ */
+static int dns_parse(unsigned char *msg, int len, dns_query_t *q,
+        dns_result_t *res, unsigned *ttl)
+{
+    int i, off, nrr, nans, rcode, type, rdlen;
+    unsigned rttl, negttl = DNS_NEG_TTL;
+    char *name = q->e->name;
+    dns_addr_t a;
+
+    if (len < 12 || dns_get16(msg) != q->id || !(msg[2] & 0x80)
+            || dns_get16(msg + 4) != 1)
+        return -1;
+
+    /* The question must be ours: uncompressed, labels matching name */
+    for (off = 12; off < len && msg[off] != 0; off += msg[off] + 1) {
+        if ((msg[off] & 0xc0) || off + 1 + msg[off] > len
+                || strncasecmp((char *)msg + off + 1, name, msg[off]))
+            return -1;
+        name += msg[off];
+        if (*name == '.')
+            name++;
+        else if (*name)
+            return -1;
+    }
+    if (*name || off + 5 > len || (int)dns_get16(msg + off + 1) != q->type)
+        return -1;
+    off += 5;
+
+    rcode = msg[3] & 0x0f;
+    if ((msg[2] & 0x02) || (rcode != 0 && rcode != 3))
+        return 1;               /* Truncated, or the server failed */
+
+    res->naddrs = 0;
+    *ttl = DNS_MAX_TTL;
+    nans = dns_get16(msg + 6);
+    nrr = nans + dns_get16(msg + 8);
+    for (i = 0; i < nrr; i++) {
+        if ((off = dns_skip(msg, len, off)) < 0 || off + 10 > len)
+            return 1;
+        type = dns_get16(msg + off);
+        rttl = dns_get32(msg + off + 4);
+        rdlen = dns_get16(msg + off + 8);
+        off += 10;
+        if (off + rdlen > len)
+            return 1;
+        if (i < nans && type == q->type && dns_get16(msg + off - 8) == 1
+                && rdlen == (type == DNS_T_A ? 4 : 16)) {
+            a.family = (type == DNS_T_A) ? AF_INET : AF_INET6;
+            memcpy(a.addr, msg + off, rdlen);
+            dns_add(res, &a);
+            if (rttl < *ttl)
+                *ttl = rttl;
+        }
+        else if (i >= nans && type == DNS_T_SOA && rttl < negttl)
+            negttl = rttl;
+        off += rdlen;
+    }
+    if (res->naddrs == 0)
+        *ttl = negttl;
+    return 0;
+}
+
+/* dns_recv - Match every reply waiting on the socket to its query */
+static void dns_recv(void)
+{
+    int i, n, rc;
+    unsigned char msg[DNS_MSGSIZE];
+    unsigned ttl = 0;
+    dns_result_t res;
+
+    while (1) {
+        if ((n = recv(dns_sock, msg, sizeof(msg), 0)) < 0) {
+            if (errno == ECONNREFUSED) {
+                /* Nothing is listening there: fail whatever is out */
+                for (i = 0; i < DNS_MAXQUERIES; i++)
+                    if (dns_queries[i].e)
+                        dns_finish(&dns_queries[i], NULL, 0);
+                continue;
+            }
+            return;
+        }
+        for (i = 0; i < DNS_MAXQUERIES; i++) {
+            if (!dns_queries[i].e)
+                continue;
+            if ((rc = dns_parse(msg, n, &dns_queries[i], &res, &ttl)) >= 0) {
+                dns_finish(&dns_queries[i], rc == 0 ? &res : NULL, ttl);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * dns_retry - Resend queries that have gone unanswered for too long, or
+ *     give up on them. Returns how many ms until the next one is due,
+ *     or -1 if none is out.
+ */
+static int dns_retry(void)
+{
+    int i, wait = -1;
+    long long now = dns_now(), left;
+    dns_query_t *q;
+
+    for (i = 0; i < DNS_MAXQUERIES; i++) {
+        q = &dns_queries[i];
+        if (!q->e)
+            continue;
+        if ((left = q->sent + DNS_TIMEOUT - now) <= 0) {
+            if (q->tries >= DNS_TRIES || dns_send(q) < 0) {
+                dns_finish(q, NULL, 0);
+                continue;
+            }
+            left = DNS_TIMEOUT;
+        }
+        if (wait < 0 || left < wait)
+            wait = left;
+    }
+    return wait;
+}
+
+/* dns_thread - The resolver thread: sends queries and takes replies */
+static void *dns_thread(void *vargp)
+{
+    uint64_t n;
+    struct pollfd pfd[2];
+
+    Pthread_detach(pthread_self());
+    pfd[0].fd = dns_kick;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = dns_sock;       /* poll skips it if it is -1 */
+    pfd[1].events = POLLIN;
+    while (1) {
+        dns_send_queued();
+        if (poll(pfd, 2, dns_retry()) < 0 && errno != EINTR)
+            unix_error("poll error");
+        if (pfd[0].revents & POLLIN)
+            if (read(dns_kick, &n, sizeof(n)) < 0)
+                ;
+        if (pfd[1].revents)
+            dns_recv();
+    }
+    return NULL;
+}
+
+/*
+ * dns_server - Parse "address[:port]" (IPv6 addresses in brackets if a
+ *     port follows) into ss. Returns its length, or 0 if it is invalid.
+ */
+static socklen_t dns_server(char *spec, struct sockaddr_storage *ss)
+{
+    char buf[MAXLINE], *host = buf, *port = "53", *p;
+    struct addrinfo hints, *ai;
+    socklen_t len;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    if (*host == '[' && (p = strchr(host, ']'))) {
+        *p++ = '\0';
+        host++;
+        if (*p == ':')
+            port = p + 1;
+    }
+    else if ((p = strchr(host, ':')) && !strchr(p + 1, ':')) {
+        *p = '\0';
+        port = p + 1;
+    }
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if (getaddrinfo(host, port, &hints, &ai) != 0)
+        return 0;
+    memcpy(ss, ai->ai_addr, ai->ai_addrlen);
+    len = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return len;
+}
+
+/*
+ * dns_init - Load the hosts file (NULL for /etc/hosts), connect to the
+ *     nameserver (NULL for the first in /etc/resolv.conf) and start the
+ *     resolver thread.
+ */
+void dns_init(char *nameserver, char *hostsfile)
+{
+    FILE *fp;
+    char line[MAXLINE], ns[MAXLINE] = "";
+    struct sockaddr_storage ss;
+    socklen_t len;
+    pthread_t tid;
+
+    dns_hosts(hostsfile ? hostsfile : "/etc/hosts");
+
+    if (nameserver)
+        snprintf(ns, sizeof(ns), "%s", nameserver);
+    else if ((fp = fopen("/etc/resolv.conf", "r"))) {
+        while (fgets(line, sizeof(line), fp))
+            if (sscanf(line, "nameserver %s", ns) == 1)
+                break;
+        fclose(fp);
+    }
+    if (*ns && (len = dns_server(ns, &ss))) {
+        dns_sock = socket(ss.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (dns_sock >= 0 && connect(dns_sock, (SA *)&ss, len) < 0) {
+            Close(dns_sock);
+            dns_sock = -1;
+        }
+    }
+    if (dns_sock < 0)
+        fprintf(stderr, "dns: no usable nameserver%s%s, using getaddrinfo\n",
+                *ns ? " " : "", ns);
+
+    dns_seed = time(NULL) ^ (getpid() << 16) ^ 0x9e3779b9u;
+    if ((dns_kick = eventfd(0, EFD_NONBLOCK)) < 0)
+        unix_error("eventfd error");
+    Pthread_create(&tid, NULL, dns_thread, NULL);
+}
+
+/* dns_sockaddr - Build the socket address for a at port in ss */
+socklen_t dns_sockaddr(dns_addr_t *a, char *port, struct sockaddr_storage *ss)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+    memset(ss, 0, sizeof(*ss));
+    if (a->family == AF_INET) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(atoi(port));
+        memcpy(&sin->sin_addr, a->addr, 4);
+        return sizeof(*sin);
+    }
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(atoi(port));
+    memcpy(&sin6->sin6_addr, a->addr, 16);
+    return sizeof(*sin6);
+}
+
+/*
+ * dns_order - Interleave res's addresses by family for a connect race,
+ *     starting with the family that last won one for host, or IPv6 if
+ *     none has.
+ */
+void dns_order(char *host, dns_result_t *res)
+{
+    int i, na = 0, nb = 0, first = AF_INET6;
+    dns_addr_t a[DNS_MAXADDRS], b[DNS_MAXADDRS];
+    dns_entry_t *e;
+
+    pthread_mutex_lock(&dns_lock);
+    if ((e = dns_find(host, dns_hash(host), 0)) && e->family)
+        first = e->family;
+    pthread_mutex_unlock(&dns_lock);
+
+    for (i = 0; i < res->naddrs; i++) {
+        if (res->addrs[i].family == first)
+            a[na++] = res->addrs[i];
+        else
+            b[nb++] = res->addrs[i];
+    }
+    res->naddrs = 0;
+    for (i = 0; i < na || i < nb; i++) {
+        if (i < na)
+            res->addrs[res->naddrs++] = a[i];
+        if (i < nb)
+            res->addrs[res->naddrs++] = b[i];
+    }
+}
+
+/* dns_won - Remember that family won the connect race to host */
+void dns_won(char *host, int family)
+{
+    dns_entry_t *e;
+
+    pthread_mutex_lock(&dns_lock);
+    if ((e = dns_find(host, dns_hash(host), 0)))
+        e->family = family;
+    pthread_mutex_unlock(&dns_lock);
+}
+
+/*
+ * dns_connect_start - Start a non-blocking connect to a at port.
+ *     Returns the socket, with *done set if it connected at once, or
+ *     -1 if the attempt failed outright.
+ */
+int dns_connect_start(dns_addr_t *a, char *port, int *done)
+{
+    int fd;
+    struct sockaddr_storage ss;
+    socklen_t len;
+
+    len = dns_sockaddr(a, port, &ss);
+    if ((fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        return -1;
+    if ((*done = (connect(fd, (SA *)&ss, len) == 0)) || errno == EINPROGRESS)
+        return fd;
+    close(fd);
+    return -1;
+}
+
+/*
+ * dns_open_clientfd - open_clientfd with the lookup done by dns_lookup
+ *     and the connects raced. Gives up after DNS_CONNECT_TIMEOUT ms.
+ *     Returns a connected, blocking descriptor, or -1 with errno set.
+ */
+int dns_open_clientfd(char *host, char *port)
+{
+    int i, fd = -1, s, done, err, next = 0, nfds = 0, family = 0;
+    int fam[DNS_MAXADDRS];
+    long long now, due = 0, deadline, wait, t = stats_now();
+    socklen_t len = sizeof(err);
+    struct pollfd pfd[DNS_MAXADDRS];
+    dns_result_t res;
+
+    if (!*port || port[strspn(port, "0123456789")])
+        return open_clientfd(host, port);   /* A service name */
+    if (dns_lookup(host, &res, -1) != DNS_OK) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    stats_time(STATS_DNS, t);
+    t = stats_now();
+    dns_order(host, &res);
+
+    deadline = dns_now() + DNS_CONNECT_TIMEOUT;
+    while (fd < 0) {
+        /* Start the next attempt when it is due, or at once if all the
+           earlier ones have failed */
+        now = dns_now();
+        if (next < res.naddrs && (now >= due || nfds == 0)) {
+            s = dns_connect_start(&res.addrs[next], port, &done);
+            family = res.addrs[next++].family;
+            due = now + DNS_CONNECT_DELAY;
+            if (s >= 0 && done)
+                fd = s;
+            else if (s >= 0) {
+                pfd[nfds].fd = s;
+                pfd[nfds].events = POLLOUT;
+                fam[nfds++] = family;
+            }
+            continue;
+        }
+        if (nfds == 0 || now >= deadline)
+            break;
+
+        wait = deadline - now;
+        if (next < res.naddrs && due - now < wait)
+            wait = due - now;
+        if (poll(pfd, nfds, wait) < 0 && errno != EINTR)
+            break;
+        for (i = 0; i < nfds && fd < 0; ) {
+            if (!pfd[i].revents) {
+                i++;
+                continue;
+            }
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+                    && err == 0) {
+                fd = pfd[i].fd;
+                family = fam[i];
+            }
+            else
+                close(pfd[i].fd);
+            pfd[i] = pfd[--nfds];
+            fam[i] = fam[nfds];
+        }
+    }
+    for (i = 0; i < nfds; i++)
+        close(pfd[i].fd);
+    if (fd < 0) {
+        errno = (nfds > 0) ? ETIMEDOUT : ECONNREFUSED;
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    dns_won(host, family);
+    stats_time(STATS_CONNECT, t);
+    return fd;
+}
@@ -0,0 +1,52 @@
+/*
+ * dns.h - Caching resolver for origin host names
+ *
+ * Lookups are answered from a shared cache that keeps each name for as
+ * long as its records' TTL allows, and remembers names that do not
+ * exist for as long as their SOA says. On a miss, a resolver thread
+ * asks the nameserver (-D, else the first one in /etc/resolv.conf) for
+ * A and AAAA records over UDP; concurrent misses on one name wait for
+ * the same query. Names in the hosts file (-H, else /etc/hosts) never
+ * expire. If the nameserver cannot be reached, the resolver thread
+ * falls back to getaddrinfo.
+ *
+ * dns_lookup either blocks until the answer is in, or, given an
+ * eventfd, returns DNS_AGAIN and writes to the eventfd when it is worth
+ * asking again, so event loops need never block on a lookup.
+ *
+ * Connects to the addresses found are raced rather than tried one by
+ * one (dns_open_clientfd, and EV_CONNECT in event.c): see dns_order.
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+#define DNS_MAXADDRS 8          /* Addresses kept per name */
+#define DNS_CONNECT_DELAY 250   /* ms between starting connect attempts */
+#define DNS_CONNECT_TIMEOUT 10000 /* ms for a connect race as a whole */
+
+#define DNS_OK 0                /* dns_lookup results */
+#define DNS_NOTFOUND (-1)
+#define DNS_AGAIN (-2)
+
+typedef struct {
+    int family;                 /* AF_INET or AF_INET6 */
+    unsigned char addr[16];     /* In network byte order */
+} dns_addr_t;
+
+typedef struct {
+    int naddrs;
+    dns_addr_t addrs[DNS_MAXADDRS];
+} dns_result_t;
+
+void dns_init(char *nameserver, char *hostsfile);
+int dns_lookup(char *host, dns_result_t *res, int wakefd);
+socklen_t dns_sockaddr(dns_addr_t *a, char *port,
+        struct sockaddr_storage *ss);
+void dns_order(char *host, dns_result_t *res);
+void dns_won(char *host, int family);
+int dns_connect_start(dns_addr_t *a, char *port, int *done);
+int dns_open_clientfd(char *host, char *port);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,103 @@
+/*
+ * epoch.c - Epoch-based reclamation for lock-free readers (see epoch.h)
+ *
+ * Each thread gets its own epoch_thread_t the first time it enters, and
+ * links it into a list for epoch_retire to walk. A thread announces the
+ * epoch it saw on the way in, and clears it on the way out; retired
+ * objects wait on a single list, newest first, under epoch_lock.
+ */
+#include "epoch.h"
+
+typedef struct epoch_thread {
+    unsigned long epoch;            /* Epoch seen * 2 + 1 inside, else 0 */
+    struct epoch_thread *next;
+    char pad[48];                   /* Other threads' off its cache line */
+} epoch_thread_t;
+
+typedef struct epoch_garbage {
+    void (*fn)(void *);
+    void *p;
+    unsigned long epoch;            /* Global epoch when retired */
+    struct epoch_garbage *next;
+} epoch_garbage_t;
+
+static __thread epoch_thread_t *epoch_mine;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static epoch_thread_t *epoch_threads;   /* Every thread's, newest first */
+static epoch_garbage_t *epoch_limbo;    /* Retired, newest first */
+static unsigned long epoch_global = 1;  /* Advanced under epoch_lock */
+
+/* epoch_self - This thread's record, created on first use */
+static epoch_thread_t *epoch_self(void)
+{
+    epoch_thread_t *et;
+
+    if ((et = epoch_mine))
+        return et;
+    et = epoch_mine = Calloc(1, sizeof(epoch_thread_t));
+    pthread_mutex_lock(&epoch_lock);
+    et->next = epoch_threads;
+    epoch_threads = et;
+    pthread_mutex_unlock(&epoch_lock);
+    return et;
+}
+
+/* epoch_enter - Start reading; nothing retired from now on is freed */
+void epoch_enter(void)
+{
+    epoch_thread_t *et = epoch_self();
+
+    __atomic_store_n(&et->epoch,
+            __atomic_load_n(&epoch_global, __ATOMIC_RELAXED) * 2 + 1,
+            __ATOMIC_RELAXED);
+    /* Announced before any of the reader's loads */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* epoch_exit - Done reading; drop every pointer found since entering */
+void epoch_exit(void)
+{
+    __atomic_store_n(&epoch_mine->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * epoch_retire - Call fn(p) once no reader can still reach p, which the
+ *     caller has already unlinked. Advances the epoch if every thread
+ *     inside has seen it, and frees what is two epochs old.
+ */
+void epoch_retire(void (*fn)(void *), void *p)
+{
+    epoch_garbage_t *g = Malloc(sizeof(epoch_garbage_t)), **gp, *next;
+    epoch_thread_t *et;
+    unsigned long e, seen;
+
+    g->fn = fn;
+    g->p = p;
+    /* Unlinked before the epoch is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&epoch_lock);
+    e = epoch_global;
+    g->epoch = e;
+    g->next = epoch_limbo;
+    epoch_limbo = g;
+    for (et = epoch_threads; et; et = et->next)
+        if ((seen = __atomic_load_n(&et->epoch, __ATOMIC_SEQ_CST))
+                && seen != e * 2 + 1)
+            break;
+    if (!et)
+        __atomic_store_n(&epoch_global, ++e, __ATOMIC_SEQ_CST);
+
+    /* The list is newest first, so the rest is as old or older */
+    for (gp = &epoch_limbo; *gp && (*gp)->epoch + 2 > e; gp = &(*gp)->next)
+        ;
+    g = *gp;
+    *gp = NULL;
+    pthread_mutex_unlock(&epoch_lock);
+
+    for (; g; g = next) {
+        next = g->next;
+        g->fn(g->p);
+        Free(g);
+    }
+}
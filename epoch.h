@@ -0,0 +1,25 @@
+/*
+ * epoch.h - Epoch-based reclamation for lock-free readers
+ *
+ * Readers bracket their accesses to a shared structure with
+ * epoch_enter and epoch_exit, which only write the calling thread's own
+ * record. A writer that unlinks something readers may still be looking
+ * at hands it to epoch_retire instead of freeing it, and it is freed
+ * once every thread that was inside an epoch at the time has left.
+ *
+ * The global epoch only advances once every thread inside has seen the
+ * current one, so what was retired in epoch e is safe to free when the
+ * epoch reaches e + 2. That work is done in epoch_retire, by writers,
+ * so readers never wait. Sections must not nest, and should be short:
+ * a thread that stays inside holds up every free.
+ */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include "csapp.h"
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void (*fn)(void *), void *p);
+
+#endif /* __EPOCH_H__ */
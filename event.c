@@ -0,0 +1,1224 @@
+/*
+ * event.c - epoll-driven event loop mode for the proxy
+ *
+ * Selected with "-e <loops>" instead of the worker pool. Each loop
+ * thread owns an epoll instance and drives every connection it accepts
+ * through a small non-blocking state machine in place of the blocking
+ * doit()/read_n_send() pair:
+ *
+ *    EV_READ_REQ  - read the request line and headers from the client
+ *    EV_RESOLVE   - wait for the resolver (dns.c) to find the origin
+ *    EV_CONNECT   - race non-blocking connects to the origin's addresses
+ *    EV_WRITE_REQ - write the rewritten request to the origin
+ *    EV_READ_HEAD - read the response header block from the origin
+ *    EV_SEND_HEAD - send the rewritten header block to the client
+ *    EV_RELAY     - copy the response body from the origin to the client
+ *    EV_HIT       - send a cached object to the client
+ *    EV_FOLLOW    - relay another connection's fetch of the same object
+ *
+ * A slow or silent origin (see nop-server.py) then costs one conn_t
+ * rather than a whole thread.
+ *
+ * Client connections persist as in the threaded mode: when a response
+ * is over, the conn_t goes back to EV_READ_REQ, starting on whatever
+ * the client pipelined behind the request it just had answered. Each
+ * loop keeps its connections in EV_READ_REQ on a list in the order
+ * they got there, and wakes once a second to close the ones that have
+ * waited longer than client_idle_timeout. A response is read through a
+ * pool buffer taken for just as long, and the request head into the
+ * connection's arena, whose chunk is kept for the next request unless
+ * the connection waits more than EV_TRIM secs: an idle connection then
+ * holds nothing but its conn_t.
+ *
+ * Origin connections come from and go back to the keep-alive pool
+ * (pool.c), as in the threaded mode: the body is followed with an
+ * http_body_t so the loop knows when the response is over.
+ *
+ * A follower cannot block in cache_flight_next, nor a lookup in
+ * dns_lookup, so each loop has an eventfd that the fetch it follows
+ * writes to as it makes progress, and the resolver once an answer is
+ * in. The loop then gives each of its followers and lookups a turn.
+ *
+ * Connects are raced as in dns_open_clientfd, with the attempts on
+ * their own handles in the conn_t; a loop keeps its racing connections
+ * on a list and times its epoll_wait to the next attempt or deadline.
+ *
+ * Once nothing keeps a copy of a response, EV_RELAY splices the rest
+ * of it origin -> pipe -> client with non-blocking splice(2) calls.
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "proxy.h"
+#include "event.h"
+#include "cache.h"
+#include "iobuf.h"
+#include "splice.h"
+#include "http.h"
+#include "pool.h"
+#include "dns.h"
+#include "stats.h"
+
+#define EV_MAXEVENTS 256
+#define EV_RELAY_BATCH 16            /* Max reads per relay wakeup */
+#define EV_TICK 1000                 /* Idle sweep interval, in ms */
+#define EV_TRIM 1                    /* Idle secs before the arena goes */
+
+/* A head at most doubles when rewritten (see cache.c), so it and the
+   body bytes read with it fit in one pool buffer */
+#if IOBUF_SIZE < 2 * MAXBUF
+#error "A rewritten response head and the bytes after it must fit a buffer"
+#endif
+
+typedef enum {
+    EV_READ_REQ, EV_RESOLVE, EV_CONNECT, EV_WRITE_REQ, EV_READ_HEAD,
+    EV_SEND_HEAD, EV_RELAY, EV_HIT, EV_FOLLOW
+} ev_state_t;
+
+struct conn;
+
+/* One epoll registration: a descriptor and the connection it serves */
+typedef struct {
+    int fd;
+    unsigned events;         /* Interest set currently registered */
+    struct conn *c;          /* NULL for the listener and wake handles */
+} ev_handle_t;
+
+typedef struct conn {
+    ev_state_t state;
+    int closed;              /* Freed once the current batch is done */
+    struct conn *next_dead;
+    ev_handle_t cli, srv;
+    dns_result_t addrs;      /* Origin addresses */
+    int next;                /* Next of them to try in EV_CONNECT */
+    ev_handle_t race[DNS_MAXADDRS]; /* Connect attempts, fd -1 if unused */
+    int racefam[DNS_MAXADDRS];
+    int nrace;               /* Attempts pending */
+    long long due;           /* When the next attempt starts, in ms */
+    long long deadline;      /* When the race is lost */
+    long long since;         /* stats_now() when this phase began */
+    char *req;               /* Request line and headers as received,
+                                then any pipelined after them */
+    size_t reqlen, reqcap;
+    size_t reqused;          /* Bytes of req taken by this request, which
+                                r->up points into until it is over */
+    arena_t arena;           /* Holds req, r and all r points to; empty
+                                while idle with nothing pipelined */
+    request_t *r;            /* The request being handled, or NULL */
+    int persist;             /* Client connection outlives the response */
+    int nreq;                /* Requests answered on it so far */
+    time_t idle_since;       /* When it last went back to EV_READ_REQ */
+    struct conn *idle_prev, *idle_next;
+    iobuf_t *hdr;            /* Rewritten response head for the client,
+                                and the body bytes read with it */
+    size_t hdrlen, hdroff;
+    int reused;              /* srv came from the pool */
+    int interim;             /* A 1xx head came before the final one */
+    iobuf_t *rbuf;           /* Response bytes not yet sent to client,
+                                from the pool while a response is read */
+    size_t buflen, bufoff;
+    int keepalive;           /* Origin lets us pool srv afterwards */
+    http_body_t body;        /* Where we are in the response body */
+    int pipe[2];             /* Splice pipe, or -1 while copying */
+    size_t piped;            /* Response bytes waiting in the pipe */
+    cache_flight_t *fl;      /* Fetch we lead, or follow in EV_FOLLOW */
+    cache_cursor_t cur;      /* Our place in fl while following */
+    char *fdata;             /* Bytes of fl at buf{off,len} to send */
+    char *host, *port;       /* Origin, r->host and r->port */
+    struct conn *next_wait;  /* In lp->following, resolving or connecting */
+    cache_obj_t *hit;        /* Cached object being sent in EV_HIT */
+    size_t hitoff;
+    alog_peer_t peer;        /* Client address, for the access log */
+} conn_t;
+
+typedef struct {
+    int epfd;
+    int cpu;                 /* Core to pin the loop thread to, or -1 */
+    ev_handle_t listen;
+    int spare;               /* Descriptor kept for accept_shed, or -1 */
+    int paused;              /* Listener off: out of descriptors */
+    ev_handle_t wake;        /* eventfd written by fetches we follow */
+    conn_t *following;       /* Connections in EV_FOLLOW */
+    conn_t *resolving;       /* Connections in EV_RESOLVE */
+    conn_t *connecting;      /* Connections in EV_CONNECT */
+    conn_t *idle, *idle_tail; /* Connections in EV_READ_REQ, oldest first */
+    conn_t *trim;            /* First of them that may hold arena memory */
+    conn_t *dead;            /* Connections closed during this batch */
+} ev_loop_t;
+
+static void ev_connect(ev_loop_t *lp, conn_t *c);
+static void ev_attempt(ev_loop_t *lp, conn_t *c);
+static void ev_write_req(ev_loop_t *lp, conn_t *c);
+static void ev_upstream(ev_loop_t *lp, conn_t *c);
+static void ev_follow(ev_loop_t *lp, conn_t *c);
+static void ev_request(ev_loop_t *lp, conn_t *c);
+static void ev_finish(ev_loop_t *lp, conn_t *c);
+
+/*
+ * ev_ctl - Add handle h to the loop's epoll set, or change its
+ *     interest set. Redundant changes are skipped to save a syscall.
+ */
+static void ev_ctl(ev_loop_t *lp, ev_handle_t *h, int op, unsigned events)
+{
+    struct epoll_event ev;
+
+    if (op == EPOLL_CTL_MOD && h->events == events)
+        return;
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(lp->epfd, op, h->fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    h->events = events;
+}
+
+/* ev_unwait - Take c off one of the loop's lists, if it is on it */
+static void ev_unwait(conn_t **list, conn_t *c)
+{
+    conn_t **pp;
+
+    for (pp = list; *pp && *pp != c; pp = &(*pp)->next_wait)
+        ;
+    if (*pp)
+        *pp = c->next_wait;
+}
+
+/* ev_now - Monotonic clock in ms */
+static long long ev_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* ev_unrace - Abandon every connect attempt of c but keep, if any */
+static void ev_unrace(ev_loop_t *lp, conn_t *c, ev_handle_t *keep)
+{
+    int i;
+
+    for (i = 0; i < DNS_MAXADDRS; i++)
+        if (c->race[i].fd >= 0 && &c->race[i] != keep) {
+            Close(c->race[i].fd);
+            c->race[i].fd = -1;
+        }
+    c->nrace = 0;
+    ev_unwait(&lp->connecting, c);
+}
+
+/* ev_unfollow - Take c off the loop's follower list and leave its flight */
+static void ev_unfollow(ev_loop_t *lp, conn_t *c)
+{
+    ev_unwait(&lp->following, c);
+    cache_flight_leave(c->fl, &c->cur);
+    c->fl = NULL;
+}
+
+/* ev_idle - c is waiting for a request: put it at the end of the idle list */
+static void ev_idle(ev_loop_t *lp, conn_t *c)
+{
+    c->idle_since = time(NULL);
+    c->idle_next = NULL;
+    c->idle_prev = lp->idle_tail;
+    if (lp->idle_tail)
+        lp->idle_tail->idle_next = c;
+    else
+        lp->idle = c;
+    lp->idle_tail = c;
+    if (!lp->trim)
+        lp->trim = c;
+}
+
+/* ev_busy - Take c off the idle list, if it is on it */
+static void ev_busy(ev_loop_t *lp, conn_t *c)
+{
+    if (!c->idle_prev && lp->idle != c)
+        return;
+    if (lp->trim == c)
+        lp->trim = c->idle_next;
+    if (c->idle_prev)
+        c->idle_prev->idle_next = c->idle_next;
+    else
+        lp->idle = c->idle_next;
+    if (c->idle_next)
+        c->idle_next->idle_prev = c->idle_prev;
+    else
+        lp->idle_tail = c->idle_prev;
+    c->idle_prev = c->idle_next = NULL;
+}
+
+/* ev_error - Send c's client an error page, noting its status for the log */
+static void ev_error(conn_t *c, char *errnum, char *shortmsg, char *longmsg)
+{
+    if (c->r)
+        request_error(c->r, c->cli.fd, "GET", errnum, shortmsg, longmsg);
+    else
+        clienterror(c->cli.fd, "GET", errnum, shortmsg, longmsg);
+}
+
+/*
+ * conn_release - Log c's current request, then let go of everything it
+ *     holds: the origin side, the splice pipe, the flight or cached
+ *     object.
+ */
+static void conn_release(ev_loop_t *lp, conn_t *c)
+{
+    if (c->r)
+        access_log(&c->peer, c->r);
+    if (c->srv.fd >= 0)
+        Close(c->srv.fd);
+    c->srv.fd = -1;
+    if (c->pipe[0] >= 0) {
+        Close(c->pipe[0]);
+        Close(c->pipe[1]);
+    }
+    c->pipe[0] = c->pipe[1] = -1;
+    if (c->state == EV_RESOLVE)
+        ev_unwait(&lp->resolving, c);
+    if (c->state == EV_CONNECT)
+        ev_unrace(lp, c, NULL);
+    if (c->hdr)
+        iobuf_put(c->hdr);
+    c->hdr = NULL;
+    if (c->rbuf)
+        iobuf_put(c->rbuf);
+    c->rbuf = NULL;
+    c->host = c->port = NULL;
+    arena_reset(&c->arena);
+    c->r = NULL;
+    if (c->state == EV_FOLLOW)
+        ev_unfollow(lp, c);
+    else
+        cache_flight_finish(c->fl, 0);
+    c->fl = NULL;
+    if (c->hit)
+        cache_release(c->hit);
+    c->hit = NULL;
+}
+
+/*
+ * conn_close - Close both sides of c. The conn_t itself is only freed
+ *     after the current batch of events, which may still refer to it.
+ */
+static void conn_close(ev_loop_t *lp, conn_t *c)
+{
+    if (c->cli.fd >= 0)
+        Close(c->cli.fd);
+    ev_busy(lp, c);
+    conn_release(lp, c);
+    arena_free(&c->arena);
+    c->closed = 1;
+    c->next_dead = lp->dead;
+    lp->dead = c;
+}
+
+/*
+ * ev_client_gone - The client of c hung up or failed. A leader with
+ *     followers finishes the fetch for their sake, at once if the whole
+ *     body is already in; otherwise close c.
+ */
+static void ev_client_gone(ev_loop_t *lp, conn_t *c)
+{
+    if (c->cli.fd < 0)
+        return;     /* Already gone, from an event earlier in the batch */
+    if ((c->state != EV_SEND_HEAD && c->state != EV_RELAY)
+            || cache_flight_followers(c->fl) == 0) {
+        conn_close(lp, c);
+        return;
+    }
+    Close(c->cli.fd);
+    c->cli.fd = -1;
+    c->state = EV_RELAY;
+    c->bufoff = c->buflen;
+    if (c->body.done)
+        ev_finish(lp, c);       /* The origin has nothing more to send */
+    else
+        ev_ctl(lp, &c->srv, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/*
+ * ev_accept - Accept every pending connection on the listening socket.
+ *     Out of descriptors, the pending connections are shed; if even
+ *     that fails, the listener is left alone until a connection on this
+ *     loop closes or EV_TICK passes, rather than have the level
+ *     triggered listener spin the loop.
+ */
+static void ev_accept(ev_loop_t *lp)
+{
+    int i, connfd;
+    conn_t *c;
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+
+    while (1) {
+        if ((connfd = accept(lp->listen.fd, (SA *)&ss, &sslen)) < 0) {
+            if (accept_shed(lp->listen.fd, &lp->spare))
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                /* EPOLLEXCLUSIVE registrations cannot be modified */
+                ev_ctl(lp, &lp->listen, EPOLL_CTL_DEL, 0);
+                lp->paused = 1;
+            }
+            return;
+        }
+        if (fcntl(connfd, F_SETFL, O_NONBLOCK) < 0) {
+            Close(connfd);
+            continue;
+        }
+        client_nodelay(connfd);
+        c = Calloc(1, sizeof(conn_t));
+        alog_peer(&c->peer, (SA *)&ss);
+        sslen = sizeof(ss);
+        c->state = EV_READ_REQ;
+        c->cli.fd = connfd;
+        c->cli.c = c;
+        c->srv.fd = -1;
+        c->srv.c = c;
+        for (i = 0; i < DNS_MAXADDRS; i++) {
+            c->race[i].fd = -1;
+            c->race[i].c = c;
+        }
+        c->pipe[0] = c->pipe[1] = -1;
+        arena_init(&c->arena);
+        ev_idle(lp, c);
+        ev_ctl(lp, &c->cli, EPOLL_CTL_ADD, EPOLLIN);
+    }
+}
+
+/*
+ * ev_done - The response to c's request is over. Close c, or wait for
+ *     the client's next request if its connection persists. Anything
+ *     the client pipelined meanwhile is carried over to the start of
+ *     the arena, which the reset may have freed it from.
+ */
+static void ev_done(ev_loop_t *lp, conn_t *c)
+{
+    char *next = NULL;
+    size_t left = c->reqlen - c->reqused;
+
+    stats_time(STATS_TOTAL, c->r->start);
+    if (!c->persist || c->cli.fd < 0 || ++c->nreq >= client_max_requests) {
+        conn_close(lp, c);
+        return;
+    }
+    if (left > 0) {
+        next = Malloc(left);
+        memcpy(next, c->req + c->reqused, left);
+    }
+    conn_release(lp, c);
+    c->req = NULL;
+    c->reqlen = c->reqcap = c->reqused = 0;
+    if (next) {
+        c->reqcap = (left > MAXBUF) ? left : MAXBUF;
+        c->req = arena_alloc(&c->arena, c->reqcap);
+        memcpy(c->req, next, left);
+        c->reqlen = left;
+        Free(next);
+    }
+    c->state = EV_READ_REQ;
+    c->buflen = c->bufoff = c->piped = c->hitoff = 0;
+    c->cur.chunk = NULL;
+    c->cur.off = 0;
+    ev_idle(lp, c);
+    ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, EPOLLIN);
+    if (c->reqlen > 0)
+        ev_request(lp, c);      /* Pipelined behind the last one */
+}
+
+/*
+ * ev_sweep - Close connections that have waited too long for a request,
+ *     and free the arenas of those that have waited over EV_TRIM secs
+ *     with no part of one in
+ */
+static void ev_sweep(ev_loop_t *lp)
+{
+    time_t now = time(NULL);
+    conn_t *c;
+
+    while (client_idle_timeout > 0 && lp->idle
+            && now - lp->idle->idle_since >= client_idle_timeout)
+        conn_close(lp, lp->idle);
+    while ((c = lp->trim) && now - c->idle_since > EV_TRIM) {
+        if (c->reqlen == 0) {
+            arena_free(&c->arena);
+            c->req = NULL;
+            c->reqcap = 0;
+        }
+        lp->trim = c->idle_next;
+    }
+}
+
+/*
+ * ev_read_req - Collect the request header block in the arena, in room
+ *     that starts at MAXBUF and doubles up to MAXLINE, the longest
+ *     block the threaded mode takes too
+ */
+static void ev_read_req(ev_loop_t *lp, conn_t *c)
+{
+    ssize_t n;
+    size_t cap;
+
+    if (c->reqlen == c->reqcap) {
+        cap = c->reqcap ? 2 * c->reqcap : MAXBUF;
+        cap = (cap < MAXLINE) ? cap : MAXLINE;
+        c->req = arena_grow(&c->arena, c->req, c->reqlen, cap);
+        c->reqcap = cap;
+    }
+    n = read(c->cli.fd, c->req + c->reqlen, c->reqcap - c->reqlen);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        conn_close(lp, c);
+        return;
+    }
+    c->reqlen += n;
+    ev_request(lp, c);
+}
+
+/*
+ * ev_request - Once the header block in c->req is complete, parse it
+ *     and build the request through build_request() exactly as doit()
+ *     would. Cache hits are answered from memory, misses that someone
+ *     is already fetching follow that fetch, and other misses resolve
+ *     the origin and start connecting. Bytes after the block are kept
+ *     for the next request.
+ */
+static void ev_request(ev_loop_t *lp, conn_t *c)
+{
+    int rc;
+    ssize_t n;
+    long long t = stats_now();
+
+    if (!c->r) {
+        c->r = arena_alloc(&c->arena, sizeof(request_t));
+        request_init(c->r);
+    }
+    c->r->start = t;
+    if ((n = http_req_parse(c->req, c->reqlen, &c->r->hr)) <= 0) {
+        if (n < 0)
+            ev_error(c, "400", "Bad Request", "Request could not be parsed");
+        else if (c->reqlen == MAXLINE)
+            ev_error(c, "400", "Bad Request", "Request header too large");
+        else
+            return;
+        conn_close(lp, c);
+        return;
+    }
+
+    ev_busy(lp, c);
+    c->reqused = n;
+    if (build_request(c->r, c->cli.fd, &c->arena) < 0) {
+        conn_close(lp, c);
+        return;
+    }
+    stats_time(STATS_PARSE, t);
+    if (stats_wanted(c->r->host, c->r->path)) {
+        c->r->status = 200;
+        if ((n = stats_serve(c->cli.fd)) > 0)
+            c->r->sent = n;
+        conn_close(lp, c);
+        return;
+    }
+    c->persist = c->r->keep;
+    rc = cache_start(c->r->key, &c->hit, &c->fl, lp->wake.fd);
+    if (rc == CACHE_HIT) {
+        c->r->cache = 'H';
+        c->r->status = http_resp_status(c->hit->bufs->data, c->hit->bufs->len);
+        c->persist = c->persist
+            && http_resp_persists(c->hit->bufs->data, c->hit->bufs->len);
+        c->state = EV_HIT;
+        ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, EPOLLOUT);
+        return;
+    }
+    c->host = c->r->host;
+    c->port = c->r->port;
+    if (rc == CACHE_FOLLOW) {
+        c->r->cache = 'F';
+        c->state = EV_FOLLOW;
+        c->next_wait = lp->following;
+        lp->following = c;
+        ev_follow(lp, c);
+        return;
+    }
+    ev_upstream(lp, c);
+}
+
+/*
+ * ev_resolve - Look up the origin and start connecting to it. If the
+ *     resolver has to ask, wait in EV_RESOLVE until ev_wake calls again.
+ */
+static void ev_resolve(ev_loop_t *lp, conn_t *c)
+{
+    int rc;
+
+    rc = dns_lookup(c->host, &c->addrs, lp->wake.fd);
+    if (rc == DNS_AGAIN) {
+        if (c->state != EV_RESOLVE) {
+            c->state = EV_RESOLVE;
+            c->next_wait = lp->resolving;
+            lp->resolving = c;
+            ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, 0);
+        }
+        return;
+    }
+    if (c->state == EV_RESOLVE) {
+        ev_unwait(&lp->resolving, c);
+        c->state = EV_CONNECT;
+    }
+    if (rc != DNS_OK || c->port[strspn(c->port, "0123456789")]) {
+        ev_error(c, "400", "Bad Request", "Malformed URL");
+        conn_close(lp, c);
+        return;
+    }
+    stats_time(STATS_DNS, c->since);
+    c->since = stats_now();
+    ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, 0);
+    ev_connect(lp, c);
+}
+
+/*
+ * ev_upstream - Send the request over a pooled connection to the
+ *     origin if there is one, else over a new one.
+ */
+static void ev_upstream(ev_loop_t *lp, conn_t *c)
+{
+    int fd;
+
+    c->r->cache = 'M';
+    c->hdroff = 0;
+    if ((fd = pool_get(c->host, c->port)) < 0) {
+        c->reused = 0;
+        c->since = stats_now();
+        ev_resolve(lp, c);
+        return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    c->reused = 1;
+    c->state = EV_WRITE_REQ;
+    c->srv.fd = fd;
+    ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, 0);
+    ev_ctl(lp, &c->srv, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+/*
+ * ev_retry - A pooled connection failed before any of the response
+ *     came back, most likely closed by the origin while idle. Try again
+ *     on a new connection.
+ */
+static void ev_retry(ev_loop_t *lp, conn_t *c)
+{
+    Close(c->srv.fd);
+    c->srv.fd = -1;
+    c->hdroff = 0;
+    c->reused = 0;
+    c->since = stats_now();
+    ev_resolve(lp, c);
+}
+
+/*
+ * ev_connect - Start the connect race to the origin's addresses: the
+ *     first attempt now, later ones from ev_timers or as earlier ones
+ *     fail.
+ */
+static void ev_connect(ev_loop_t *lp, conn_t *c)
+{
+    dns_order(c->host, &c->addrs);
+    c->next = 0;
+    c->nrace = 0;
+    c->deadline = ev_now() + DNS_CONNECT_TIMEOUT;
+    c->state = EV_CONNECT;
+    c->next_wait = lp->connecting;
+    lp->connecting = c;
+    ev_attempt(lp, c);
+}
+
+/*
+ * ev_won - Attempt h connected first. Drop the others and send the
+ *     request over it.
+ */
+static void ev_won(ev_loop_t *lp, conn_t *c, ev_handle_t *h)
+{
+    dns_won(c->host, c->racefam[h - c->race]);
+    stats_time(STATS_CONNECT, c->since);
+    ev_unrace(lp, c, h);
+    if (h->events)
+        ev_ctl(lp, h, EPOLL_CTL_DEL, 0);
+    c->srv.fd = h->fd;
+    h->fd = -1;
+    c->state = EV_WRITE_REQ;
+    ev_ctl(lp, &c->srv, EPOLL_CTL_ADD, EPOLLOUT);
+    ev_write_req(lp, c);
+}
+
+/*
+ * ev_attempt - Start a connect to the next address that will take one.
+ *     Once every attempt has failed and no address is left, give up.
+ */
+static void ev_attempt(ev_loop_t *lp, conn_t *c)
+{
+    int i, fd, done;
+    dns_addr_t *a;
+
+    while (c->next < c->addrs.naddrs) {
+        a = &c->addrs.addrs[c->next++];
+        if ((fd = dns_connect_start(a, c->port, &done)) < 0)
+            continue;
+        for (i = 0; c->race[i].fd >= 0; i++)
+            ;
+        c->race[i].fd = fd;
+        c->race[i].events = 0;
+        c->racefam[i] = a->family;
+        c->nrace++;
+        c->due = ev_now() + DNS_CONNECT_DELAY;
+        if (done)
+            ev_won(lp, c, &c->race[i]);
+        else
+            ev_ctl(lp, &c->race[i], EPOLL_CTL_ADD, EPOLLOUT);
+        return;
+    }
+    if (c->nrace == 0) {
+        ev_error(c, "400", "Bad Request", "Malformed URL");
+        conn_close(lp, c);
+    }
+}
+
+/*
+ * ev_timers - Start the connect attempts that are due, and fail the
+ *     races that have run out of time. Returns how many ms until the
+ *     next of either, or -1 if no race is on.
+ */
+static int ev_timers(ev_loop_t *lp)
+{
+    long long now = ev_now(), wait = -1, t;
+    conn_t *c, *next;
+
+    for (c = lp->connecting; c; c = next) {
+        next = c->next_wait;
+        if (now >= c->deadline) {
+            ev_error(c, "504", "Gateway Timeout",
+                    "Origin server did not accept the connection in time");
+            conn_close(lp, c);
+            continue;
+        }
+        if (now >= c->due && c->next < c->addrs.naddrs) {
+            ev_attempt(lp, c);
+            if (c->closed || c->state != EV_CONNECT)
+                continue;
+        }
+        t = (c->next < c->addrs.naddrs && c->due < c->deadline)
+            ? c->due : c->deadline;
+        if (wait < 0 || t - now < wait)
+            wait = (t > now) ? t - now : 0;
+    }
+    return wait;
+}
+
+/* ev_write_req - Send the rewritten request, then wait for the reply */
+static void ev_write_req(ev_loop_t *lp, conn_t *c)
+{
+    ssize_t n;
+
+    n = upreq_write(c->srv.fd, &c->r->up, c->hdroff);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n < 0 && c->reused) {
+        ev_retry(lp, c);
+        return;
+    }
+    if (n < 0) {
+        conn_close(lp, c);
+        return;
+    }
+    if ((c->hdroff += n) < c->r->up.len)
+        return;
+    c->since = stats_now();
+    c->state = EV_READ_HEAD;
+    c->buflen = c->bufoff = 0;
+    c->interim = 0;
+    if (!c->rbuf)
+        c->rbuf = iobuf_get();
+    ev_ctl(lp, &c->srv, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/*
+ * ev_read_head - Collect the response header block, then rewrite it for
+ *     the client, followed by whatever part of the body came with it.
+ */
+static void ev_read_head(ev_loop_t *lp, conn_t *c)
+{
+    ssize_t n;
+    size_t headlen = 0;
+    http_resp_t resp;
+
+    n = read(c->srv.fd, c->rbuf->data + c->buflen, MAXBUF - c->buflen);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0 && c->buflen == 0 && c->reused && !c->interim) {
+        ev_retry(lp, c);
+        return;
+    }
+    if (n > 0) {
+        c->buflen += n;
+        stats_add(STATS_BYTES_IN, n);
+    }
+
+    /* Interim responses are dropped; the final one follows */
+    while ((headlen = http_head_end(c->rbuf->data, c->buflen))
+            && http_resp_interim(c->rbuf->data, headlen)) {
+        c->buflen -= headlen;
+        memmove(c->rbuf->data, c->rbuf->data + headlen, c->buflen);
+        c->interim = 1;
+    }
+    if (n > 0 && !headlen && c->buflen < MAXBUF)
+        return;
+
+    /* Leave room in hdr for the body bytes after the header */
+    if (!c->hdr)
+        c->hdr = iobuf_get();
+    if (n <= 0 || !headlen
+            || (n = http_resp_parse(c->rbuf->data, headlen, &resp,
+                    c->hdr->data, IOBUF_SIZE - (c->buflen - headlen))) < 0) {
+        ev_error(c, "502", "Bad Gateway",
+                "Client not understood due to malformed syntax");
+        conn_close(lp, c);
+        return;
+    }
+    stats_time(STATS_FIRST_BYTE, c->since);
+    c->since = stats_now();
+    c->r->status = resp.status;
+    c->hdrlen = n;
+    c->keepalive = resp.keepalive;
+    c->persist = c->persist && http_resp_persists(c->hdr->data, c->hdrlen);
+    http_body_init(&c->body, &resp);
+    if (c->buflen > headlen) {
+        n = http_body_decode(&c->body, c->rbuf->data + headlen,
+                c->buflen - headlen);
+        if (n < 0) {
+            ev_error(c, "502", "Bad Gateway",
+                    "Client not understood due to malformed syntax");
+            conn_close(lp, c);
+            return;
+        }
+        memcpy(c->hdr->data + c->hdrlen, c->rbuf->data + headlen, n);
+        c->hdrlen += n;
+    }
+    cache_flight_append(c->fl, c->hdr, c->hdrlen);
+    c->buflen = c->bufoff = 0;
+    c->hdroff = 0;
+    c->state = EV_SEND_HEAD;
+    ev_ctl(lp, &c->srv, EPOLL_CTL_MOD, 0);
+    ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, EPOLLOUT);
+}
+
+/*
+ * ev_finish - The whole response has been relayed. Cache it if it
+ *     qualifies, and hand the origin connection back to the pool if it
+ *     can carry another request.
+ */
+static void ev_finish(ev_loop_t *lp, conn_t *c)
+{
+    stats_time(STATS_BODY, c->since);
+    cache_flight_finish(c->fl, 1);
+    c->fl = NULL;
+    if (c->keepalive && !c->body.extra) {
+        ev_ctl(lp, &c->srv, EPOLL_CTL_DEL, 0);
+        pool_put(c->host, c->port, c->srv.fd);
+        c->srv.fd = -1;
+    }
+    ev_done(lp, c);
+}
+
+/* ev_send_head - Send the rewritten header block, then the body */
+static void ev_send_head(ev_loop_t *lp, conn_t *c)
+{
+    ssize_t n;
+
+    n = write(c->cli.fd, c->hdr->data + c->hdroff, c->hdrlen - c->hdroff);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n < 0) {
+        ev_client_gone(lp, c);
+        return;
+    }
+    stats_add(STATS_BYTES_OUT, n);
+    c->r->sent += n;
+    if ((c->hdroff += n) < c->hdrlen)
+        return;
+    if (c->body.done) {
+        ev_finish(lp, c);
+        return;
+    }
+    c->state = EV_RELAY;
+    ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, 0);
+    ev_ctl(lp, &c->srv, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/*
+ * ev_connected - Attempt h finished connecting. The first to succeed
+ *     wins; a failure starts the next attempt without waiting its turn.
+ */
+static void ev_connected(ev_loop_t *lp, conn_t *c, ev_handle_t *h)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (h->fd < 0)
+        return;     /* Closed earlier in this batch */
+    if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        Close(h->fd);
+        h->fd = -1;
+        c->nrace--;
+        ev_attempt(lp, c);
+        return;
+    }
+    ev_won(lp, c, h);
+}
+
+/*
+ * ev_yield - c used up its batch in ev_relay or ev_splice. The rest of
+ *     the response may already be in c->rbuf or the pipe, or the body
+ *     may be done, so waiting for the origin could wait forever: wait
+ *     for the client to take more instead, which it usually can at once.
+ */
+static void ev_yield(ev_loop_t *lp, conn_t *c)
+{
+    if (c->cli.fd >= 0) {
+        ev_ctl(lp, &c->srv, EPOLL_CTL_MOD, 0);
+        ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, EPOLLOUT);
+    }
+    else if (c->body.done)
+        ev_finish(lp, c);       /* Finishing it for followers */
+}
+
+/*
+ * ev_splice - ev_relay once the buffer is drained and nothing keeps a
+ *     copy of the response: splice it through c's pipe instead.
+ */
+static void ev_splice(ev_loop_t *lp, conn_t *c)
+{
+    int i;
+    ssize_t n;
+    size_t want;
+
+    for (i = 0; i < EV_RELAY_BATCH; i++) {
+        if (c->piped == 0) {
+            if (c->body.done) {
+                ev_finish(lp, c);
+                return;
+            }
+            want = http_body_want(&c->body);
+            n = splice_move(c->srv.fd, c->pipe[1],
+                    (want < SPLICE_CHUNK) ? want : SPLICE_CHUNK, 1, 0);
+            if (n < 0 && errno == EAGAIN) {
+                ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, 0);
+                ev_ctl(lp, &c->srv, EPOLL_CTL_MOD, EPOLLIN);
+                return;
+            }
+            if (n < 0 || (n == 0 && c->body.framing != HTTP_BODY_EOF)) {
+                ev_error(c, "502", "Bad Gateway",
+                        "Client not understood due to malformed syntax");
+                conn_close(lp, c);
+                return;
+            }
+            http_body_skip(&c->body, n, n == 0);
+            stats_add(STATS_BYTES_IN, n);
+            c->piped = n;
+            continue;
+        }
+        n = splice_move(c->pipe[0], c->cli.fd, c->piped, 1,
+                !c->body.done);
+        if (n < 0 && errno == EAGAIN) {
+            ev_ctl(lp, &c->srv, EPOLL_CTL_MOD, 0);
+            ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, EPOLLOUT);
+            return;
+        }
+        if (n <= 0) {
+            conn_close(lp, c);
+            return;
+        }
+        c->piped -= n;
+        __atomic_add_fetch(&splice_bytes, n, __ATOMIC_RELAXED);
+        stats_add(STATS_BYTES_OUT, n);
+        c->r->sent += n;
+    }
+    ev_yield(lp, c);
+}
+
+/*
+ * ev_relay - Copy the response body from origin to client. While the
+ *     client cannot keep up, stop reading the origin and wait for the
+ *     client.
+ */
+static void ev_relay(ev_loop_t *lp, conn_t *c)
+{
+    int i;
+    ssize_t n;
+
+    for (i = 0; i < EV_RELAY_BATCH; i++) {
+        if (c->bufoff == c->buflen && c->pipe[0] >= 0) {
+            ev_splice(lp, c);
+            return;
+        }
+        if (c->bufoff == c->buflen) {
+            if (c->body.done) {
+                ev_finish(lp, c);
+                return;
+            }
+            n = read(c->srv.fd, c->rbuf->data,
+                    http_body_room(&c->body, IOBUF_SIZE));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                if (c->cli.fd >= 0)
+                    ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, 0);
+                ev_ctl(lp, &c->srv, EPOLL_CTL_MOD, EPOLLIN);
+                return;
+            }
+            if (n > 0)
+                stats_add(STATS_BYTES_IN, n);
+            if (n < 0
+                    || (n = http_body_decode(&c->body, c->rbuf->data, n)) < 0) {
+                if (c->cli.fd >= 0)
+                    ev_error(c, "502", "Bad Gateway",
+                            "Client not understood due to malformed syntax");
+                conn_close(lp, c);
+                return;
+            }
+            cache_flight_add(c->fl, c->rbuf->data, n);
+            c->buflen = n;
+            c->bufoff = 0;
+            if (c->cli.fd < 0) {
+                c->bufoff = n;
+                continue;
+            }
+            /* Splice from here on, unless we are out of descriptors */
+            if (!cache_flight_wants(c->fl) && !c->body.done
+                    && c->body.framing != HTTP_BODY_CHUNKED
+                    && splice_pipe(c->pipe) < 0)
+                c->pipe[0] = c->pipe[1] = -1;
+            if (n == 0)
+                continue;
+        }
+        n = write(c->cli.fd, c->rbuf->data + c->bufoff,
+                c->buflen - c->bufoff);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            ev_ctl(lp, &c->srv, EPOLL_CTL_MOD, 0);
+            ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, EPOLLOUT);
+            return;
+        }
+        if (n < 0) {
+            ev_client_gone(lp, c);
+            return;
+        }
+        stats_add(STATS_BYTES_OUT, n);
+        c->r->sent += n;
+        c->bufoff += n;
+    }
+    ev_yield(lp, c);
+}
+
+/* ev_send_hit - Send the cached object, then finish the request */
+static void ev_send_hit(ev_loop_t *lp, conn_t *c)
+{
+    ssize_t n;
+
+    n = iobuf_write(c->cli.fd, c->hit->bufs, c->hitoff);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n < 0) {
+        conn_close(lp, c);
+        return;
+    }
+    stats_add(STATS_BYTES_OUT, n);
+    c->r->sent += n;
+    if ((c->hitoff += n) == c->hit->size)
+        ev_done(lp, c);
+}
+
+/*
+ * ev_follow - Relay whatever the followed fetch has produced. If it
+ *     failed before producing anything, fetch the object ourselves.
+ */
+static void ev_follow(ev_loop_t *lp, conn_t *c)
+{
+    ssize_t n;
+
+    while (1) {
+        if (c->bufoff < c->buflen) {
+            n = write(c->cli.fd, c->fdata + c->bufoff,
+                    c->buflen - c->bufoff);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, EPOLLOUT);
+                return;
+            }
+            if (n < 0) {
+                conn_close(lp, c);
+                return;
+            }
+            stats_add(STATS_BYTES_OUT, n);
+            c->r->sent += n;
+            c->bufoff += n;
+            continue;
+        }
+        n = cache_flight_next(c->fl, &c->cur, &c->fdata, 0);
+        if (n == CACHE_AGAIN) {
+            ev_ctl(lp, &c->cli, EPOLL_CTL_MOD, 0);
+            return;
+        }
+        if (n > 0) {
+            if (!c->buflen) {   /* The start of the response */
+                c->persist = c->persist && http_resp_persists(c->fdata, n);
+                c->r->status = http_resp_status(c->fdata, n);
+            }
+            c->buflen = n;
+            c->bufoff = 0;
+            continue;
+        }
+        if (n < 0 && !c->cur.chunk) {
+            ev_unfollow(lp, c);
+            c->state = EV_READ_REQ;
+            ev_upstream(lp, c);
+            return;
+        }
+        if (n == 0)
+            ev_done(lp, c);
+        else
+            conn_close(lp, c);
+        return;
+    }
+}
+
+/* ev_wake - Give every follower and lookup on this loop a turn */
+static void ev_wake(ev_loop_t *lp)
+{
+    uint64_t n;
+    conn_t *c, *next;
+
+    if (read(lp->wake.fd, &n, sizeof(n)) < 0)
+        return;
+    for (c = lp->following; c; c = next) {
+        next = c->next_wait;
+        ev_follow(lp, c);
+    }
+    for (c = lp->resolving; c; c = next) {
+        next = c->next_wait;
+        ev_resolve(lp, c);
+    }
+}
+
+/* ev_dispatch - Advance the connection that owns handle h */
+static void ev_dispatch(ev_loop_t *lp, ev_handle_t *h, unsigned events)
+{
+    conn_t *c = h->c;
+
+    if (h == &lp->wake) {
+        ev_wake(lp);
+        return;
+    }
+    if (!c) {
+        ev_accept(lp);
+        return;
+    }
+    if (c->closed)
+        return;
+    if (h == &c->cli && (events & (EPOLLHUP | EPOLLERR))) {
+        ev_client_gone(lp, c);
+        return;
+    }
+    if (h != &c->cli && h != &c->srv && c->state != EV_CONNECT)
+        return;                 /* A connect attempt that lost the race */
+    switch (c->state) {
+    case EV_READ_REQ:
+        ev_read_req(lp, c);
+        break;
+    case EV_RESOLVE:
+        break;                  /* Only ev_wake moves it on */
+    case EV_CONNECT:
+        ev_connected(lp, c, h);
+        break;
+    case EV_WRITE_REQ:
+        ev_write_req(lp, c);
+        break;
+    case EV_READ_HEAD:
+        ev_read_head(lp, c);
+        break;
+    case EV_SEND_HEAD:
+        ev_send_head(lp, c);
+        break;
+    case EV_RELAY:
+        ev_relay(lp, c);
+        break;
+    case EV_HIT:
+        ev_send_hit(lp, c);
+        break;
+    case EV_FOLLOW:
+        ev_follow(lp, c);
+        break;
+    }
+}
+
+/* ev_loop - thread routine for one event loop */
+static void *ev_loop(void *vargp)
+{
+    int i, n, timeout;
+    conn_t *c;
+    ev_loop_t *lp = vargp;
+    struct epoll_event events[EV_MAXEVENTS];
+
+    pin_thread(lp->cpu);
+    while (1) {
+        timeout = ev_timers(lp);
+        if (((lp->idle && client_idle_timeout > 0) || lp->trim || lp->paused)
+                && (timeout < 0 || timeout > EV_TICK))
+            timeout = EV_TICK;
+        n = epoll_wait(lp->epfd, events, EV_MAXEVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++)
+            ev_dispatch(lp, events[i].data.ptr, events[i].events);
+        ev_sweep(lp);
+        if (lp->paused && (lp->dead || n == 0)) {
+            ev_ctl(lp, &lp->listen, EPOLL_CTL_ADD, EPOLLIN | EPOLLEXCLUSIVE);
+            lp->paused = 0;
+        }
+        while ((c = lp->dead) != NULL) {
+            lp->dead = c->next_dead;
+            Free(c);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * event_run - Start nloops event loop threads serving listenfd, all
+ *     pinned to cpu (unless it is -1).
+ */
+void event_run(int listenfd, int nloops, int cpu)
+{
+    int i;
+    pthread_t tid;
+    struct rlimit rl;
+    ev_loop_t *lp;
+
+    /* Each connection holds up to two descriptors */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) < 0)
+        unix_error("fcntl error");
+
+    for (i = 0; i < nloops; i++) {
+        lp = Calloc(1, sizeof(ev_loop_t));
+        if ((lp->epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+        lp->cpu = cpu;
+        lp->listen.fd = listenfd;
+        lp->spare = open("/dev/null", O_RDONLY);
+        ev_ctl(lp, &lp->listen, EPOLL_CTL_ADD, EPOLLIN | EPOLLEXCLUSIVE);
+        if ((lp->wake.fd = eventfd(0, EFD_NONBLOCK)) < 0)
+            unix_error("eventfd error");
+        ev_ctl(lp, &lp->wake, EPOLL_CTL_ADD, EPOLLIN);
+        Pthread_create(&tid, NULL, ev_loop, lp);
+    }
+}
@@ -0,0 +1,9 @@
+/*
+ * event.h - epoll-driven event loop mode for the proxy
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_run(int listenfd, int nloops, int cpu);
+
+#endif /* __EVENT_H__ */
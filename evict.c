@@ -0,0 +1,410 @@
+/*
+ * evict.c - Cache eviction policies (see evict.h)
+ *
+ * The queues are plain lists that only writers touch. Hits happen with
+ * no lock held, so they never move objects: they set reference bits,
+ * count, or stamp, and writers sweep or scan the queues for a victim; a
+ * shard holds few enough objects for that to be cheap. The fields hits
+ * update, and queue, which tlfu_hit reads, are only ever accessed
+ * atomically once an object is in the cache.
+ */
+#include "evict.h"
+
+/* W-TinyLFU: queues, and the count-min sketch of accesses */
+#define TLFU_WINDOW 0               /* New objects */
+#define TLFU_PROBATION 1            /* Main, not hit since admitted */
+#define TLFU_PROTECTED 2            /* Main, hit since admitted */
+#define TLFU_WINDOW_PCT 1           /* Window's share of the shard */
+#define TLFU_PROTECTED_PCT 80       /* Protected share of main */
+#define TLFU_ROWS 4
+#define TLFU_WIDTH_BITS 10
+#define TLFU_WIDTH (1 << TLFU_WIDTH_BITS)
+#define TLFU_MAXCOUNT 15
+#define TLFU_SAMPLE (10 * TLFU_WIDTH)   /* Accesses between agings */
+
+typedef struct {
+    unsigned char count[TLFU_ROWS][TLFU_WIDTH];
+    unsigned long added;            /* Accesses since the last aging */
+} tlfu_sketch_t;
+
+/* S3-FIFO: queues, and the ghost keys evicted from the small FIFO */
+#define S3_SMALL 0
+#define S3_MAIN 1
+#define S3_SMALL_PCT 10             /* Small FIFO's share of the shard */
+#define S3_MAXFREQ 3
+#define S3_GHOSTS 256               /* Keys remembered per shard */
+
+typedef struct {
+    unsigned hash[S3_GHOSTS];
+    unsigned char live[S3_GHOSTS];
+    int next;                       /* Slot the next key goes in */
+} s3_ghosts_t;
+
+/* GDSF: priorities are fixed point, hits per byte times GDSF_SCALE */
+#define GDSF_SCALE (1UL << 24)
+
+typedef struct {
+    unsigned long inflation;        /* Priority of the last victim */
+} gdsf_state_t;
+
+/* evict_push - Append obj to queue q */
+void evict_push(evict_t *ev, int q, cache_obj_t *obj)
+{
+    evict_queue_t *qp = &ev->q[q];
+
+    __atomic_store_n(&obj->queue, q, __ATOMIC_RELAXED);
+    obj->next = NULL;
+    obj->prev = qp->tail;
+    if (qp->tail)
+        qp->tail->next = obj;
+    else
+        qp->head = obj;
+    qp->tail = obj;
+    qp->size += obj->size;
+}
+
+/* evict_remove - Take obj out of its queue */
+void evict_remove(evict_t *ev, cache_obj_t *obj)
+{
+    evict_queue_t *qp = &ev->q[obj->queue];
+
+    if (obj->prev)
+        obj->prev->next = obj->next;
+    else
+        qp->head = obj->next;
+    if (obj->next)
+        obj->next->prev = obj->prev;
+    else
+        qp->tail = obj->prev;
+    qp->size -= obj->size;
+}
+
+/* evict_move - Move obj to the tail of queue q */
+static void evict_move(evict_t *ev, int q, cache_obj_t *obj)
+{
+    evict_remove(ev, obj);
+    evict_push(ev, q, obj);
+}
+
+/* evict_oldest - The object in queue q used least recently, or NULL */
+static cache_obj_t *evict_oldest(evict_t *ev, int q)
+{
+    cache_obj_t *obj, *min = ev->q[q].head;
+
+    for (obj = min; obj; obj = obj->next)
+        if (__atomic_load_n(&obj->stamp, __ATOMIC_RELAXED)
+                < __atomic_load_n(&min->stamp, __ATOMIC_RELAXED))
+            min = obj;
+    return min;
+}
+
+/* evict_stamp - Mark obj as used now */
+static void evict_stamp(evict_t *ev, cache_obj_t *obj)
+{
+    __atomic_store_n(&obj->stamp,
+            __atomic_add_fetch(&ev->clock, 1, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+}
+
+static void evict_init_none(evict_t *ev)
+{
+}
+
+static int evict_admit_all(evict_t *ev, unsigned hash, size_t size)
+{
+    return 1;
+}
+
+/*
+ * LRU, approximated by CLOCK: a hit sets the object's reference bit
+ * (freq), only if it is clear, and the hand at the head of the queue
+ * clears the bits it finds set and gives those objects another pass
+ */
+static void lru_hit(evict_t *ev, cache_obj_t *obj)
+{
+    if (!__atomic_load_n(&obj->freq, __ATOMIC_RELAXED))
+        __atomic_store_n(&obj->freq, 1, __ATOMIC_RELAXED);
+}
+
+static void lru_insert(evict_t *ev, cache_obj_t *obj)
+{
+    obj->freq = 0;
+    evict_push(ev, 0, obj);
+}
+
+/* lru_victim - Hits may set bits behind the hand; two turns at most */
+static cache_obj_t *lru_victim(evict_t *ev)
+{
+    cache_obj_t *obj;
+    size_t swept = 0;
+
+    while (1) {
+        obj = ev->q[0].head;
+        if (swept >= 2 * ev->q[0].size
+                || !__atomic_exchange_n(&obj->freq, 0, __ATOMIC_RELAXED))
+            return obj;
+        swept += obj->size;
+        evict_move(ev, 0, obj);
+    }
+}
+
+/*
+ * W-TinyLFU
+ */
+
+/* tlfu_counter - hash's counter in one row of the sketch */
+static unsigned char *tlfu_counter(tlfu_sketch_t *sk, unsigned hash, int row)
+{
+    static const unsigned seeds[TLFU_ROWS] = {
+        0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+    };
+
+    return &sk->count[row][(hash * seeds[row]) >> (32 - TLFU_WIDTH_BITS)];
+}
+
+/* tlfu_add - Count an access to hash; safe without the lock */
+static void tlfu_add(tlfu_sketch_t *sk, unsigned hash)
+{
+    int i;
+    unsigned char *c;
+
+    for (i = 0; i < TLFU_ROWS; i++) {
+        c = tlfu_counter(sk, hash, i);
+        if (__atomic_load_n(c, __ATOMIC_RELAXED) < TLFU_MAXCOUNT)
+            __atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&sk->added, 1, __ATOMIC_RELAXED);
+}
+
+/* tlfu_freq - Estimated recent accesses to hash */
+static unsigned tlfu_freq(tlfu_sketch_t *sk, unsigned hash)
+{
+    int i;
+    unsigned c, min = TLFU_MAXCOUNT;
+
+    for (i = 0; i < TLFU_ROWS; i++)
+        if ((c = __atomic_load_n(tlfu_counter(sk, hash, i),
+                        __ATOMIC_RELAXED)) < min)
+            min = c;
+    return min;
+}
+
+static void tlfu_init(evict_t *ev)
+{
+    ev->priv = Calloc(1, sizeof(tlfu_sketch_t));
+}
+
+/*
+ * tlfu_admit - Count the miss. Every TLFU_SAMPLE accesses, halve every
+ *     counter so that the sketch follows what is popular now.
+ */
+static int tlfu_admit(evict_t *ev, unsigned hash, size_t size)
+{
+    int i, j;
+    tlfu_sketch_t *sk = ev->priv;
+
+    tlfu_add(sk, hash);
+    if (__atomic_load_n(&sk->added, __ATOMIC_RELAXED) >= TLFU_SAMPLE) {
+        /* Hits counted meanwhile may be lost; it is only an estimate */
+        for (i = 0; i < TLFU_ROWS; i++)
+            for (j = 0; j < TLFU_WIDTH; j++)
+                __atomic_store_n(&sk->count[i][j],
+                        __atomic_load_n(&sk->count[i][j], __ATOMIC_RELAXED)
+                        >> 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&sk->added, TLFU_SAMPLE / 2, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+/* tlfu_hit - Count the hit; a probation hit earns promotion, later */
+static void tlfu_hit(evict_t *ev, cache_obj_t *obj)
+{
+    tlfu_add(ev->priv, obj->hash);
+    evict_stamp(ev, obj);
+    if (__atomic_load_n(&obj->queue, __ATOMIC_RELAXED) == TLFU_PROBATION)
+        __atomic_store_n(&obj->freq, 1, __ATOMIC_RELAXED);
+}
+
+static void tlfu_insert(evict_t *ev, cache_obj_t *obj)
+{
+    obj->freq = 0;
+    evict_stamp(ev, obj);
+    evict_push(ev, TLFU_WINDOW, obj);
+}
+
+/*
+ * tlfu_victim - Promote the probation objects that were hit, demoting
+ *     protected ones beyond its share. Objects beyond the window's share
+ *     move to probation, and the last to move competes with main's own
+ *     victim: the one the sketch has seen less often is evicted.
+ */
+static cache_obj_t *tlfu_victim(evict_t *ev)
+{
+    tlfu_sketch_t *sk = ev->priv;
+    size_t window = ev->capacity * TLFU_WINDOW_PCT / 100;
+    size_t protect = (ev->capacity - window) * TLFU_PROTECTED_PCT / 100;
+    cache_obj_t *obj, *next, *cand = NULL, *victim = NULL;
+    int q;
+
+    for (obj = ev->q[TLFU_PROBATION].head; obj; obj = next) {
+        next = obj->next;
+        if (__atomic_exchange_n(&obj->freq, 0, __ATOMIC_RELAXED))
+            evict_move(ev, TLFU_PROTECTED, obj);
+    }
+    while (ev->q[TLFU_PROTECTED].size > protect)
+        evict_move(ev, TLFU_PROBATION, evict_oldest(ev, TLFU_PROTECTED));
+    while (ev->q[TLFU_WINDOW].size > window) {
+        cand = evict_oldest(ev, TLFU_WINDOW);
+        evict_move(ev, TLFU_PROBATION, cand);
+    }
+
+    for (q = TLFU_PROBATION; q <= TLFU_PROTECTED && !victim; q++)
+        for (obj = ev->q[q].head; obj; obj = obj->next)
+            if (obj != cand && (!victim
+                    || __atomic_load_n(&obj->stamp, __ATOMIC_RELAXED)
+                    < __atomic_load_n(&victim->stamp, __ATOMIC_RELAXED)))
+                victim = obj;
+    if (!victim)
+        return cand ? cand : evict_oldest(ev, TLFU_WINDOW);
+    if (cand && tlfu_freq(sk, cand->hash) <= tlfu_freq(sk, victim->hash))
+        return cand;
+    return victim;
+}
+
+/*
+ * S3-FIFO
+ */
+static void s3_init(evict_t *ev)
+{
+    ev->priv = Calloc(1, sizeof(s3_ghosts_t));
+}
+
+static void s3_hit(evict_t *ev, cache_obj_t *obj)
+{
+    if (__atomic_load_n(&obj->freq, __ATOMIC_RELAXED) < S3_MAXFREQ)
+        __atomic_add_fetch(&obj->freq, 1, __ATOMIC_RELAXED);
+}
+
+/* s3_insert - Into main if the key was evicted lately, else small */
+static void s3_insert(evict_t *ev, cache_obj_t *obj)
+{
+    int i;
+    s3_ghosts_t *gh = ev->priv;
+
+    obj->freq = 0;
+    for (i = 0; i < S3_GHOSTS; i++)
+        if (gh->live[i] && gh->hash[i] == obj->hash) {
+            gh->live[i] = 0;
+            evict_push(ev, S3_MAIN, obj);
+            return;
+        }
+    evict_push(ev, S3_SMALL, obj);
+}
+
+/*
+ * s3_victim - While the small FIFO is over its share, its oldest object
+ *     moves to main if it was hit more than once, else is evicted and
+ *     remembered. Otherwise main's oldest object goes round again, one
+ *     hit poorer, if it has any, else is evicted.
+ */
+static cache_obj_t *s3_victim(evict_t *ev)
+{
+    s3_ghosts_t *gh = ev->priv;
+    cache_obj_t *obj;
+
+    while (1) {
+        if ((obj = ev->q[S3_SMALL].head) && (!ev->q[S3_MAIN].head
+                || ev->q[S3_SMALL].size > ev->capacity * S3_SMALL_PCT / 100)) {
+            if (__atomic_load_n(&obj->freq, __ATOMIC_RELAXED) > 1) {
+                __atomic_store_n(&obj->freq, 0, __ATOMIC_RELAXED);
+                evict_move(ev, S3_MAIN, obj);
+                continue;
+            }
+            gh->hash[gh->next] = obj->hash;
+            gh->live[gh->next] = 1;
+            gh->next = (gh->next + 1) % S3_GHOSTS;
+            return obj;
+        }
+        obj = ev->q[S3_MAIN].head;
+        if (__atomic_load_n(&obj->freq, __ATOMIC_RELAXED) > 0) {
+            __atomic_sub_fetch(&obj->freq, 1, __ATOMIC_RELAXED);
+            evict_move(ev, S3_MAIN, obj);
+            continue;
+        }
+        return obj;
+    }
+}
+
+/*
+ * GDSF
+ */
+static void gdsf_init(evict_t *ev)
+{
+    ev->priv = Calloc(1, sizeof(gdsf_state_t));
+}
+
+/* gdsf_rank - Priority of obj after freq hits */
+static void gdsf_rank(evict_t *ev, cache_obj_t *obj, unsigned freq)
+{
+    gdsf_state_t *gs = ev->priv;
+
+    __atomic_store_n(&obj->stamp,
+            __atomic_load_n(&gs->inflation, __ATOMIC_RELAXED)
+            + freq * GDSF_SCALE / obj->size, __ATOMIC_RELAXED);
+}
+
+static void gdsf_hit(evict_t *ev, cache_obj_t *obj)
+{
+    gdsf_rank(ev, obj, __atomic_add_fetch(&obj->freq, 1, __ATOMIC_RELAXED));
+}
+
+static void gdsf_insert(evict_t *ev, cache_obj_t *obj)
+{
+    obj->freq = 1;
+    gdsf_rank(ev, obj, 1);
+    evict_push(ev, 0, obj);
+}
+
+static cache_obj_t *gdsf_victim(evict_t *ev)
+{
+    gdsf_state_t *gs = ev->priv;
+    cache_obj_t *victim = evict_oldest(ev, 0);
+
+    __atomic_store_n(&gs->inflation,
+            __atomic_load_n(&victim->stamp, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+    return victim;
+}
+
+static evict_policy_t evict_policies[] = {
+    { "lru", evict_init_none, evict_admit_all, lru_hit, lru_insert,
+        lru_victim },
+    { "tinylfu", tlfu_init, tlfu_admit, tlfu_hit, tlfu_insert,
+        tlfu_victim },
+    { "s3fifo", s3_init, evict_admit_all, s3_hit, s3_insert, s3_victim },
+    { "gdsf", gdsf_init, evict_admit_all, gdsf_hit, gdsf_insert,
+        gdsf_victim },
+};
+
+/* evict_policy - The policy called name, LRU if name is NULL, or NULL */
+evict_policy_t *evict_policy(char *name)
+{
+    int i;
+
+    if (!name)
+        return &evict_policies[0];
+    for (i = 0; i < (int)(sizeof(evict_policies) / sizeof(evict_policies[0]));
+            i++)
+        if (!strcmp(evict_policies[i].name, name))
+            return &evict_policies[i];
+    return NULL;
+}
+
+/* evict_init - Start ev off empty, for a shard of capacity bytes */
+void evict_init(evict_t *ev, evict_policy_t *policy, size_t capacity)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->policy = policy;
+    ev->capacity = capacity;
+    policy->init(ev);
+}
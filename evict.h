@@ -0,0 +1,72 @@
+/*
+ * evict.h - Cache eviction policies
+ *
+ * Each cache shard keeps an evict_t, which its policy uses to decide
+ * what to cache and what to evict. Objects sit in one of the shard's
+ * EVICT_QUEUES queues, each kept in insertion order; what the queues
+ * mean is up to the policy. A policy supplies:
+ *
+ *   init           set up its per-shard state
+ *   admit          whether a new object of size bytes may be cached
+ *   on_hit         obj was looked up
+ *   on_insert      obj was cached: put it in a queue
+ *   choose_victim  the object to evict next; the shard must hold one
+ *
+ * on_hit runs with no lock held, concurrently with other hits and with
+ * the other hooks, so it only updates obj and shared counters
+ * atomically, and may be told of a hit on an object just evicted. The
+ * others run under the shard's lock, and may move objects between
+ * queues.
+ *
+ *   lru      Least recently used, approximated by CLOCK: a hit sets a
+ *            reference bit, and objects with it set get another pass
+ *   tinylfu  W-TinyLFU: new objects enter a small LRU window; what
+ *            leaves it is only admitted to the main segmented LRU if a
+ *            count-min sketch of recent accesses says it is used more
+ *            often than main's own victim
+ *   s3fifo   S3-FIFO: new objects enter a small FIFO, and only those
+ *            hit again while in it move to the main FIFO, which gives
+ *            objects hit since they last came round another pass; keys
+ *            evicted from the small FIFO are remembered for a while,
+ *            and go straight to main if they come back
+ *   gdsf     Greedy-Dual-Size-Frequency: evicts the lowest priority,
+ *            hits over size plus an inflation value that rises to each
+ *            victim's priority, so small hot objects outlast big cold
+ *            ones and past popularity ages out
+ */
+#ifndef __EVICT_H__
+#define __EVICT_H__
+
+#include "cache.h"
+
+#define EVICT_QUEUES 3
+
+/* Objects in insertion order, oldest at head */
+typedef struct {
+    cache_obj_t *head, *tail;
+    size_t size;                /* Bytes of object data */
+} evict_queue_t;
+
+typedef struct evict {
+    struct evict_policy *policy;
+    evict_queue_t q[EVICT_QUEUES];
+    size_t capacity;            /* Bytes the shard may hold */
+    unsigned long clock;        /* Bumped on every insert and hit */
+    void *priv;                 /* Policy's own state */
+} evict_t;
+
+typedef struct evict_policy {
+    char *name;
+    void (*init)(evict_t *ev);
+    int (*admit)(evict_t *ev, unsigned hash, size_t size);
+    void (*on_hit)(evict_t *ev, cache_obj_t *obj);
+    void (*on_insert)(evict_t *ev, cache_obj_t *obj);
+    cache_obj_t *(*choose_victim)(evict_t *ev);
+} evict_policy_t;
+
+evict_policy_t *evict_policy(char *name);
+void evict_init(evict_t *ev, evict_policy_t *policy, size_t capacity);
+void evict_push(evict_t *ev, int q, cache_obj_t *obj);
+void evict_remove(evict_t *ev, cache_obj_t *obj);
+
+#endif /* __EVICT_H__ */
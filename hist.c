@@ -0,0 +1,52 @@
+/*
+ * hist.c - HDR-style histograms of microsecond values
+ */
+#include "hist.h"
+
+/* hist_bucket - Bucket for value v; values too large share the last */
+int hist_bucket(unsigned long v)
+{
+    int m;
+
+    if (v < HIST_SUB)
+        return v;
+    if (v >> HIST_MAX_BITS)
+        v = (1UL << HIST_MAX_BITS) - 1;
+    m = 63 - __builtin_clzl(v);
+    return ((m - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+        + (v >> (m - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/* hist_bucket_top - Largest value that falls in bucket i */
+unsigned long hist_bucket_top(int i)
+{
+    int shift;
+
+    if (i < HIST_SUB)
+        return i;
+    shift = (i >> HIST_SUB_BITS) - 1;
+    return ((unsigned long)(HIST_SUB + (i & (HIST_SUB - 1))) << shift)
+        + (1UL << shift) - 1;
+}
+
+/*
+ * hist_percentile - Value at or below which fraction q of the count
+ *     values in hist fall, no more than max, the largest recorded
+ */
+unsigned long hist_percentile(unsigned long *hist, unsigned long count,
+        unsigned long max, double q)
+{
+    int i;
+    unsigned long seen = 0, rank = (unsigned long)(q * count + 0.5);
+
+    if (count == 0)
+        return 0;
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        if ((seen += hist[i]) >= rank)
+            break;
+    if (i == HIST_BUCKETS || hist_bucket_top(i) > max)
+        return max;
+    return hist_bucket_top(i);
+}
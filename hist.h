@@ -0,0 +1,24 @@
+/*
+ * hist.h - HDR-style histograms of microsecond values
+ *
+ * A histogram is a plain array of HIST_BUCKETS counts. Below HIST_SUB
+ * every value has a bucket of its own; above, each power of two is
+ * split into HIST_SUB buckets of equal width, so a percentile read back
+ * is within about 3% of the true value whatever its size. Recording is
+ * just hist[hist_bucket(v)]++, and histograms are merged by adding
+ * them up bucket by bucket.
+ */
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#define HIST_SUB_BITS 5             /* 32 buckets per power of two */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40            /* Values up to 2^40 us, about 12 days */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+int hist_bucket(unsigned long v);
+unsigned long hist_bucket_top(int i);
+unsigned long hist_percentile(unsigned long *hist, unsigned long count,
+        unsigned long max, double q);
+
+#endif /* __HIST_H__ */
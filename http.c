@@ -0,0 +1,659 @@
+/*
+ * http.c - HTTP/1.x header parsing, and response framing for persistent
+ *     origin connections
+ *
+ * The header parser makes a single pass over the block: names are
+ * checked and delimited a byte at a time (they are short), values are
+ * skipped with memchr, which glibc vectorizes. Known names are told
+ * apart by length first, so most lines cost one strncasecmp at most.
+ *
+ * Chunked bodies are decoded in place: a chunk's data only ever moves
+ * towards the start of the buffer it arrived in, over the size lines
+ * and CRLFs that preceded it, so no second buffer is needed.
+ */
+#include "http.h"
+
+/* States of a chunked body */
+#define CHUNK_SIZE 0            /* In the hex chunk size */
+#define CHUNK_EXT 1             /* In chunk extensions, up to the LF */
+#define CHUNK_DATA 2            /* remaining bytes of chunk data left */
+#define CHUNK_DATA_END 3        /* CRLF after the chunk data */
+#define CHUNK_TRAILER_BOL 4     /* At the start of a trailer line */
+#define CHUNK_TRAILER 5         /* Inside a trailer line */
+
+/*
+ * http_head_end - Return the length of the header block at the start of
+ *     buf, up to and including the blank line, or 0 if it is incomplete.
+ */
+size_t http_head_end(char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] != '\n')
+            continue;
+        if (i + 1 < len && buf[i + 1] == '\n')
+            return i + 2;
+        if (i + 2 < len && buf[i + 1] == '\r' && buf[i + 2] == '\n')
+            return i + 3;
+    }
+    return 0;
+}
+
+/* Names of the headers in http_hdr_id_t */
+static const struct {
+    char *name;
+    size_t len;
+    http_hdr_id_t id;
+} http_known[] = {
+#define KNOWN(name, id) { name, sizeof(name) - 1, id }
+    KNOWN("Host", HTTP_H_HOST),
+    KNOWN("User-Agent", HTTP_H_USER_AGENT),
+    KNOWN("Connection", HTTP_H_CONNECTION),
+    KNOWN("Proxy-Connection", HTTP_H_PROXY_CONNECTION),
+    KNOWN("Keep-Alive", HTTP_H_KEEP_ALIVE),
+    KNOWN("Content-Length", HTTP_H_CONTENT_LENGTH),
+    KNOWN("Transfer-Encoding", HTTP_H_TRANSFER_ENCODING),
+    KNOWN("Cache-Control", HTTP_H_CACHE_CONTROL),
+    KNOWN("Pragma", HTTP_H_PRAGMA),
+    KNOWN("Expires", HTTP_H_EXPIRES),
+    KNOWN("Vary", HTTP_H_VARY),
+    KNOWN("Date", HTTP_H_DATE),
+    KNOWN("Set-Cookie", HTTP_H_SET_COOKIE),
+#undef KNOWN
+};
+
+/* http_hdr_id - Which of the known headers is name[0..n), if any? */
+static http_hdr_id_t http_hdr_id(char *name, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(http_known) / sizeof(http_known[0]); i++)
+        if (http_known[i].len == n
+                && !strncasecmp(name, http_known[i].name, n))
+            return http_known[i].id;
+    return HTTP_H_OTHER;
+}
+
+/*
+ * http_parse_hdrs - Index the header lines from *pp up to and including
+ *     the blank line that ends the block, and leave *pp after it. Lines
+ *     starting with a blank continue the previous value (obs-fold).
+ *     Returns the number of headers, -1 if the block is malformed or
+ *     has more than HTTP_MAXHDRS of them, or -2 if it is incomplete.
+ */
+static int http_parse_hdrs(char **pp, char *end, http_hdr_t *hdrs)
+{
+    char *p = *pp, *eol, *v, *vend;
+    int n = 0;
+    http_hdr_t *h;
+
+    while (1) {
+        if (p == end)
+            return -2;
+        if (*p == '\r' || *p == '\n') {     /* The blank line */
+            if (*p == '\r' && ++p == end)
+                return -2;
+            if (*p != '\n')
+                return -1;
+            *pp = p + 1;
+            return n;
+        }
+        if (*p == ' ' || *p == '\t') {
+            if (n == 0)
+                return -1;
+            h = &hdrs[n - 1];
+            v = p;
+        }
+        else {
+            if (n == HTTP_MAXHDRS)
+                return -1;
+            h = &hdrs[n++];
+            h->name = p;
+            for (; p < end && *p != ':'; p++)
+                if ((unsigned char)*p <= ' ' || *p == 0x7f)
+                    return -1;          /* Not a token character */
+            if (p == end)
+                return -2;
+            if (p == h->name)
+                return -1;
+            h->namelen = p - h->name;
+            h->id = http_hdr_id(h->name, h->namelen);
+            for (v = p + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+                ;
+            h->value = v;
+        }
+        if (!(eol = memchr(v, '\n', end - v)))
+            return -2;
+        for (vend = eol; vend > h->value && isspace((unsigned char)vend[-1]);
+                vend--)
+            ;
+        h->vallen = vend - h->value;
+        p = eol + 1;
+        h->linelen = p - h->name;
+    }
+}
+
+/*
+ * http_req_parse - Parse the request header block at the start of
+ *     buf[0..len) into rq, skipping any blank lines before it. Returns
+ *     the length of the block (blank lines and all), 0 if it is not all
+ *     there yet, or -1 if it is malformed.
+ */
+ssize_t http_req_parse(char *buf, size_t len, http_req_t *rq)
+{
+    char *p = buf, *end = buf + len, *eol, *sp;
+    int n;
+
+    while (p < end && (*p == '\r' || *p == '\n'))
+        p++;
+    if (!(eol = memchr(p, '\n', end - p)))
+        return 0;
+
+    /* Request line: method SP request-target SP HTTP/1.x */
+    if (!(sp = memchr(p, ' ', eol - p)) || sp == p)
+        return -1;
+    rq->method = p;
+    rq->methodlen = sp - p;
+    rq->uri = p = sp + 1;
+    if (!(sp = memchr(p, ' ', eol - p)) || sp == p)
+        return -1;
+    rq->urilen = sp - p;
+    p = sp + 1;
+    if (eol - p < 8 || strncmp(p, "HTTP/1.", 7)
+            || !isdigit((unsigned char)p[7]) || (eol - p > 8
+                && (eol - p != 9 || p[8] != '\r')))
+        return -1;
+    rq->minor = p[7] - '0';
+
+    p = eol + 1;
+    if ((n = http_parse_hdrs(&p, end, rq->hdrs)) == -2)
+        return 0;
+    if (n < 0)
+        return -1;
+    rq->nhdrs = n;
+    return p - buf;
+}
+
+/*
+ * http_hdr_find - The first header with the given id, or NULL. Lists
+ *     split over several lines have to be walked by the caller.
+ */
+http_hdr_t *http_hdr_find(http_hdr_t *hdrs, int nhdrs, http_hdr_id_t id)
+{
+    int i;
+
+    for (i = 0; i < nhdrs; i++)
+        if (hdrs[i].id == id)
+            return &hdrs[i];
+    return NULL;
+}
+
+/*
+ * http_read_head - Read a response header block, blank line included,
+ *     into buf. Returns its length, 0 if the connection ended or failed
+ *     before the first byte, or -1 if it ended part way or the block
+ *     does not fit in maxlen bytes.
+ */
+ssize_t http_read_head(rio_t *rp, char *buf, size_t maxlen)
+{
+    ssize_t n;
+    size_t len = 0;
+
+    while (1) {
+        if ((n = rio_readlineb(rp, buf + len, maxlen - len)) <= 0)
+            return len ? -1 : 0;
+        if (buf[len + n - 1] != '\n')
+            return -1;          /* Line too long, or cut short */
+        len += n;
+        if (n <= 2 && (buf[len - n] == '\n' || buf[len - n] == '\r')
+                && len > (size_t)n)
+            return len;
+    }
+}
+
+/*
+ * http_hasval - Is token one of the comma separated values in v[0..n)?
+ *     Trailing CR and LF are ignored, so v may be the rest of a line.
+ */
+int http_hasval(char *v, size_t n, char *token)
+{
+    size_t i = 0, j, tlen = strlen(token);
+
+    while (i < n) {
+        while (i < n && (v[i] == ' ' || v[i] == '\t' || v[i] == ','))
+            i++;
+        for (j = i; j < n && v[j] != ','; j++)
+            ;
+        while (j > i && isspace((unsigned char)v[j - 1]))
+            j--;
+        if (j - i == tlen && !strncasecmp(v + i, token, tlen))
+            return 1;
+        while (i < n && v[i] != ',')
+            i++;
+    }
+    return 0;
+}
+
+/* http_lastval - Is token the last of the comma separated values? */
+static int http_lastval(char *v, size_t n, char *token)
+{
+    size_t i = n, tlen = strlen(token);
+
+    while (i > 0 && (v[i - 1] == ' ' || v[i - 1] == '\t'))
+        i--;
+    return i >= tlen && !strncasecmp(v + i - tlen, token, tlen)
+        && (i == tlen || v[i - tlen - 1] == ',' || v[i - tlen - 1] == ' ');
+}
+
+/* http_put - Append s[0..n) to the output, if it fits */
+static int http_put(char **p, char *end, char *s, size_t n)
+{
+    if ((size_t)(end - *p) < n)
+        return -1;
+    memcpy(*p, s, n);
+    *p += n;
+    return 0;
+}
+
+/*
+ * http_resp_parse - Work out the framing of the response whose header
+ *     block is head[0..len), and write the block as the client should
+ *     see it to out: hop-by-hop headers removed, Transfer-Encoding too
+ *     if the body is chunked (the body is decoded on the way), any
+ *     Content-Length if there is a Transfer-Encoding, and a
+ *     Connection header of our own added: "keep-alive" when the client
+ *     can tell where the body ends (Content-Length or no body), so its
+ *     connection can carry on, else "close". Returns the length of
+ *     out, or -1 if the response is malformed or out is too small.
+ */
+ssize_t http_resp_parse(char *head, size_t len, http_resp_t *rp,
+        char *out, size_t outmax)
+{
+    char *line, *end = head + len, *p = out, *oend = out + outmax;
+    int i, nhdrs, http11, chunked = 0, te, conn_close = 0, conn_keep = 0;
+    int have_len = 0;
+    unsigned long cl = 0;
+    http_hdr_t hdrs[HTTP_MAXHDRS], *h;
+
+    /* Status line: HTTP/1.x NNN reason */
+    if (len < 12 || strncmp(head, "HTTP/1.", 7) || head[8] != ' ')
+        return -1;
+    http11 = (head[7] != '0');
+    if (!isdigit((unsigned char)head[9]) || !isdigit((unsigned char)head[10])
+            || !isdigit((unsigned char)head[11]))
+        return -1;
+    rp->status = atoi(head + 9);
+    if (!(line = memchr(head, '\n', len)))
+        return -1;
+    if (http_put(&p, oend, head, line - head - (line[-1] == '\r')) < 0
+            || http_put(&p, oend, "\r\n", 2) < 0)
+        return -1;
+    line++;
+    if ((nhdrs = http_parse_hdrs(&line, end, hdrs)) < 0)
+        return -1;
+
+    /* Transfer-Encoding overrides Content-Length (RFC 9112 6.3), which
+       would then not match the body the client gets, so it goes */
+    te = (http_hdr_find(hdrs, nhdrs, HTTP_H_TRANSFER_ENCODING) != NULL);
+
+    for (i = 0; i < nhdrs; i++) {
+        h = &hdrs[i];
+        switch (h->id) {
+        case HTTP_H_CONNECTION:
+        case HTTP_H_PROXY_CONNECTION:
+            conn_close |= http_hasval(h->value, h->vallen, "close");
+            conn_keep |= http_hasval(h->value, h->vallen, "keep-alive");
+            continue;
+        case HTTP_H_KEEP_ALIVE:
+            continue;
+        case HTTP_H_TRANSFER_ENCODING:
+            if ((chunked = http_lastval(h->value, h->vallen, "chunked")))
+                continue;
+            break;
+        case HTTP_H_CONTENT_LENGTH:
+            if (te)
+                continue;
+            if (h->vallen == 0 || !isdigit((unsigned char)*h->value))
+                return -1;
+            cl = strtoul(h->value, NULL, 10);
+            have_len = 1;
+            break;
+        default:
+            break;
+        }
+        if (http_put(&p, oend, h->name, h->value + h->vallen - h->name) < 0
+                || http_put(&p, oend, "\r\n", 2) < 0)
+            return -1;
+    }
+
+    if (rp->status < 200 || rp->status == 204 || rp->status == 304)
+        rp->framing = HTTP_BODY_NONE;
+    else if (chunked)
+        rp->framing = HTTP_BODY_CHUNKED;
+    else if (have_len && !te)
+        rp->framing = HTTP_BODY_LENGTH;
+    else
+        rp->framing = HTTP_BODY_EOF;
+    rp->length = cl;
+    rp->keepalive = (http11 ? !conn_close : conn_keep)
+        && rp->framing != HTTP_BODY_EOF && rp->status >= 200;
+
+    if (rp->framing == HTTP_BODY_LENGTH || rp->framing == HTTP_BODY_NONE) {
+        if (http_put(&p, oend, HTTP_KEEPALIVE, strlen(HTTP_KEEPALIVE)) < 0)
+            return -1;
+    }
+    else if (http_put(&p, oend, "Connection: close\r\n\r\n", 21) < 0)
+        return -1;
+    return p - out;
+}
+
+/*
+ * http_resp_persists - Does the response at data[0..n), as rewritten by
+ *     http_resp_parse, leave the client connection open afterwards?
+ *     Cached objects and followed fetches are checked this way.
+ */
+int http_resp_persists(char *data, size_t n)
+{
+    size_t len = strlen(HTTP_KEEPALIVE), end = http_head_end(data, n);
+
+    return end >= len && !memcmp(data + end - len, HTTP_KEEPALIVE, len);
+}
+
+/*
+ * http_resp_status - Status code of the response starting at
+ *     data[0..n), or 0 if its status line is not all there
+ */
+int http_resp_status(char *data, size_t n)
+{
+    if (n < 12 || strncmp(data, "HTTP/", 5))
+        return 0;
+    return atoi(data + 9);
+}
+
+/*
+ * http_resp_interim - Is the response head at data[0..n) an interim
+ *     one (1xx: 100 Continue, 103 Early Hints and the like) that the
+ *     final response follows on the same connection? 101 Switching
+ *     Protocols is final: the connection stops carrying HTTP.
+ */
+int http_resp_interim(char *data, size_t n)
+{
+    int status = http_resp_status(data, n);
+
+    return status >= 100 && status < 200 && status != 101;
+}
+
+/* Longest lifetime honored, as RFC 7234 caps delta-seconds */
+#define HTTP_MAX_TTL 2147483648L
+
+/*
+ * http_date - The time an IMF-fixdate (Sun, 06 Nov 1994 08:49:37 GMT)
+ *     in v[0..n) stands for, or -1 if it is not one
+ */
+static long http_date(char *v, size_t n)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char buf[64], mon[4], *m;
+    int day, year, hour, min, sec, end = 0;
+    long y, era, yoe, doy;
+
+    if (n >= sizeof(buf))
+        return -1;
+    memcpy(buf, v, n);
+    buf[n] = '\0';
+    if (sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n", &day, mon, &year,
+                &hour, &min, &sec, &end) != 6 || end != (int)n
+            || !(m = strstr(months, mon)) || (m - months) % 3)
+        return -1;
+
+    /* Days since 1970-01-01 of a proleptic Gregorian date, with the
+       year starting in March so that leap days come last */
+    y = year - ((m - months) / 3 < 2);
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * ((m - months) / 3 + ((m - months) / 3 < 2 ? 10 : -2)) + 2) / 5
+        + day - 1;
+    return ((era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468)
+            * 24 + hour) * 3600L + min * 60 + sec;
+}
+
+/*
+ * http_resp_ttl - How many seconds the response whose header block
+ *     starts data[0..n) may be served from a shared cache keyed by URL
+ *     alone. 0 if it must not be stored: Cache-Control no-store,
+ *     private or no-cache (or Pragma: no-cache without Cache-Control),
+ *     Set-Cookie, any Vary, or a lifetime already over. Otherwise
+ *     Cache-Control s-maxage, then max-age, then Expires less Date (or
+ *     the time now), and deflt if the response gives none of them.
+ */
+long http_resp_ttl(char *data, size_t n, long deflt)
+{
+    char *line, *end = data + n, *v;
+    int i, nhdrs, cc = 0, pragma = 0;
+    long ttl = -1, smax = -1, expires = -1, date = -1;
+    size_t j, k, len;
+    http_hdr_t hdrs[HTTP_MAXHDRS], *h;
+
+    if (!(line = memchr(data, '\n', n)))
+        return 0;
+    line++;
+    if ((nhdrs = http_parse_hdrs(&line, end, hdrs)) < 0)
+        return 0;
+
+    for (i = 0; i < nhdrs; i++) {
+        h = &hdrs[i];
+        switch (h->id) {
+        case HTTP_H_SET_COOKIE:
+        case HTTP_H_VARY:
+            return 0;
+        case HTTP_H_PRAGMA:
+            pragma |= http_hasval(h->value, h->vallen, "no-cache");
+            break;
+        case HTTP_H_EXPIRES:
+            expires = http_date(h->value, h->vallen);
+            expires = (expires < 0) ? 0 : expires;  /* Invalid: past */
+            break;
+        case HTTP_H_DATE:
+            date = http_date(h->value, h->vallen);
+            break;
+        case HTTP_H_CACHE_CONTROL:
+            /* Directives, each a token or token=value */
+            cc = 1;
+            v = h->value;
+            for (j = 0; j < h->vallen; j = k + 1) {
+                while (j < h->vallen && (v[j] == ' ' || v[j] == '\t'))
+                    j++;
+                for (k = j; k < h->vallen && v[k] != ','; k++)
+                    ;
+                for (len = 0; j + len < k && v[j + len] != '='
+                        && v[j + len] != ' ' && v[j + len] != '\t'; len++)
+                    ;
+                if ((len == 8 && !strncasecmp(v + j, "no-store", 8))
+                        || (len == 7 && !strncasecmp(v + j, "private", 7))
+                        || (len == 8 && !strncasecmp(v + j, "no-cache", 8)))
+                    return 0;
+                if (j + len < k && v[j + len] == '=') {
+                    if (len == 8 && !strncasecmp(v + j, "s-maxage", 8))
+                        smax = strtol(v + j + 9, NULL, 10);
+                    else if (len == 7 && !strncasecmp(v + j, "max-age", 7))
+                        ttl = strtol(v + j + 8, NULL, 10);
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (pragma && !cc)
+        return 0;
+    if (smax >= 0)
+        ttl = smax;
+    else if (ttl < 0 && expires >= 0)
+        ttl = expires - (date >= 0 ? date : (long)time(NULL));
+    else if (ttl < 0)
+        ttl = deflt;
+    if (ttl <= 0)
+        return 0;
+    return (ttl < HTTP_MAX_TTL) ? ttl : HTTP_MAX_TTL;
+}
+
+/* http_body_init - Start following the body of response rp */
+void http_body_init(http_body_t *bp, http_resp_t *rp)
+{
+    bp->framing = rp->framing;
+    bp->state = CHUNK_SIZE;
+    bp->remaining = (rp->framing == HTTP_BODY_LENGTH) ? rp->length : 0;
+    bp->done = (rp->framing == HTTP_BODY_NONE)
+        || (rp->framing == HTTP_BODY_LENGTH && rp->length == 0);
+    bp->extra = 0;
+}
+
+/*
+ * http_body_want - How many bytes can be read without any risk of
+ *     reading past the end of the body: 0 once it is done.
+ */
+size_t http_body_want(http_body_t *bp)
+{
+    if (bp->done)
+        return 0;
+    switch (bp->framing) {
+    case HTTP_BODY_LENGTH:
+        return bp->remaining;
+    case HTTP_BODY_CHUNKED:
+        return (bp->state == CHUNK_DATA) ? bp->remaining : 1;
+    default:
+        return (size_t)-1;
+    }
+}
+
+/*
+ * http_body_room - How many bytes to ask for in a single read of at
+ *     most max, for readers that pay a syscall per read: http_body_want,
+ *     except that a chunked body is read max at a time, size lines and
+ *     all, as its decoder finds the last chunk by itself and flags
+ *     whatever follows it as extra.
+ */
+size_t http_body_room(http_body_t *bp, size_t max)
+{
+    size_t want = http_body_want(bp);
+
+    if (bp->framing == HTTP_BODY_CHUNKED && !bp->done)
+        return max;
+    return (want < max) ? want : max;
+}
+
+/*
+ * http_body_decode - Feed the n bytes at buf to the decoder, n == 0
+ *     meaning the origin closed. Leaves the body bytes among them at the
+ *     start of buf and returns how many there are, or -1 if the body is
+ *     malformed or cut short.
+ */
+ssize_t http_body_decode(http_body_t *bp, char *buf, size_t n)
+{
+    size_t i = 0, out = 0, m;
+    int d;
+
+    if (n == 0) {
+        if (bp->framing != HTTP_BODY_EOF && !bp->done)
+            return -1;
+        bp->done = 1;
+        return 0;
+    }
+    if (bp->done) {
+        bp->extra = 1;
+        return 0;
+    }
+
+    switch (bp->framing) {
+    case HTTP_BODY_EOF:
+        return n;
+    case HTTP_BODY_LENGTH:
+        if (n >= bp->remaining) {
+            bp->extra = (n > bp->remaining);
+            n = bp->remaining;
+            bp->done = 1;
+        }
+        bp->remaining -= n;
+        return n;
+    default:
+        break;
+    }
+
+    /* Chunked */
+    while (i < n && !bp->done) {
+        char c = buf[i];
+
+        switch (bp->state) {
+        case CHUNK_SIZE:
+            i++;
+            if (isxdigit((unsigned char)c)) {
+                d = isdigit((unsigned char)c) ? c - '0'
+                    : tolower((unsigned char)c) - 'a' + 10;
+                if (bp->remaining > ((size_t)-1 >> 4))
+                    return -1;
+                bp->remaining = bp->remaining * 16 + d;
+            }
+            else if (c == ';' || c == ' ' || c == '\t' || c == '\r')
+                bp->state = CHUNK_EXT;
+            else if (c == '\n')
+                bp->state = bp->remaining ? CHUNK_DATA : CHUNK_TRAILER_BOL;
+            else
+                return -1;
+            break;
+        case CHUNK_EXT:
+            i++;
+            if (c == '\n')
+                bp->state = bp->remaining ? CHUNK_DATA : CHUNK_TRAILER_BOL;
+            break;
+        case CHUNK_DATA:
+            m = n - i;
+            if (m > bp->remaining)
+                m = bp->remaining;
+            memmove(buf + out, buf + i, m);
+            out += m;
+            i += m;
+            if ((bp->remaining -= m) == 0)
+                bp->state = CHUNK_DATA_END;
+            break;
+        case CHUNK_DATA_END:
+            i++;
+            if (c == '\n')
+                bp->state = CHUNK_SIZE;
+            else if (c != '\r')
+                return -1;
+            break;
+        case CHUNK_TRAILER_BOL:
+            i++;
+            if (c == '\n')
+                bp->done = 1;
+            else if (c != '\r')
+                bp->state = CHUNK_TRAILER;
+            break;
+        case CHUNK_TRAILER:
+            i++;
+            if (c == '\n')
+                bp->state = CHUNK_TRAILER_BOL;
+            break;
+        }
+    }
+    if (i < n)
+        bp->extra = 1;
+    return out;
+}
+
+/*
+ * http_body_skip - n body bytes went past without being decoded (they
+ *     were spliced), then the origin closed if eof is set. Only valid
+ *     for Content-Length and close-delimited bodies.
+ */
+void http_body_skip(http_body_t *bp, size_t n, int eof)
+{
+    if (bp->framing == HTTP_BODY_LENGTH) {
+        bp->remaining -= (n < bp->remaining) ? n : bp->remaining;
+        bp->done = (bp->remaining == 0);
+    }
+    else if (eof)
+        bp->done = 1;
+}
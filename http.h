@@ -0,0 +1,111 @@
+/*
+ * http.h - HTTP/1.x header parsing, and response framing for persistent
+ *     origin connections
+ *
+ * Header blocks, requests and responses alike, are parsed in one pass
+ * into an index of (name, value) slices of the buffer they arrived in,
+ * each tagged with an http_hdr_id_t if it is a header the proxy cares
+ * about, so nothing after the parser compares header names again.
+ *
+ * The proxy talks HTTP/1.1 to origins so that it can reuse their
+ * connections, which means it has to find where each response ends
+ * rather than read until the origin closes. http_resp_parse reads the
+ * framing out of a response header block and rewrites the block for
+ * the client; an http_body_t then follows the body as it streams past,
+ * decoding chunked bodies in place, so the client and the cache always
+ * see a plain, close-delimited or Content-Length response. Only the
+ * latter let the client's own connection carry another request.
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* Last header of a response that the client connection outlives */
+#define HTTP_KEEPALIVE "Connection: keep-alive\r\n\r\n"
+
+#define HTTP_MAXHDRS 100        /* Headers indexed per message */
+
+/* Headers the proxy looks at, found by http_hdr_find */
+typedef enum {
+    HTTP_H_OTHER,
+    HTTP_H_HOST,
+    HTTP_H_USER_AGENT,
+    HTTP_H_CONNECTION,
+    HTTP_H_PROXY_CONNECTION,
+    HTTP_H_KEEP_ALIVE,
+    HTTP_H_CONTENT_LENGTH,
+    HTTP_H_TRANSFER_ENCODING,
+    HTTP_H_CACHE_CONTROL,
+    HTTP_H_PRAGMA,
+    HTTP_H_EXPIRES,
+    HTTP_H_VARY,
+    HTTP_H_DATE,
+    HTTP_H_SET_COOKIE
+} http_hdr_id_t;
+
+/* One header line; the slices point into the parsed buffer */
+typedef struct {
+    char *name;
+    size_t namelen;
+    char *value;                /* Without surrounding blanks */
+    size_t vallen;
+    size_t linelen;             /* Whole line from name on, line end and
+                                   any folded lines included */
+    http_hdr_id_t id;
+} http_hdr_t;
+
+/* A parsed request header block */
+typedef struct {
+    char *method;
+    size_t methodlen;
+    char *uri;
+    size_t urilen;
+    int minor;                  /* HTTP/1.minor */
+    int nhdrs;
+    http_hdr_t hdrs[HTTP_MAXHDRS];
+} http_req_t;
+
+/* How the end of a response body is found */
+typedef enum {
+    HTTP_BODY_NONE,             /* No body (1xx, 204, 304) */
+    HTTP_BODY_LENGTH,           /* Content-Length bytes */
+    HTTP_BODY_CHUNKED,          /* Transfer-Encoding: chunked */
+    HTTP_BODY_EOF               /* Until the origin closes */
+} http_framing_t;
+
+typedef struct {
+    int status;
+    int keepalive;              /* Origin lets us reuse the connection */
+    http_framing_t framing;
+    size_t length;              /* Content-Length, for HTTP_BODY_LENGTH */
+} http_resp_t;
+
+/* Incremental body decoder */
+typedef struct {
+    http_framing_t framing;
+    int state;                  /* Where we are in a chunked body */
+    size_t remaining;           /* Bytes left in the body or chunk */
+    int done;                   /* The whole body has gone past */
+    int extra;                  /* Bytes followed the end of the body */
+} http_body_t;
+
+size_t http_head_end(char *buf, size_t len);
+ssize_t http_req_parse(char *buf, size_t len, http_req_t *rq);
+http_hdr_t *http_hdr_find(http_hdr_t *hdrs, int nhdrs, http_hdr_id_t id);
+int http_hasval(char *v, size_t n, char *token);
+ssize_t http_read_head(rio_t *rp, char *buf, size_t maxlen);
+ssize_t http_resp_parse(char *head, size_t len, http_resp_t *rp,
+        char *out, size_t outmax);
+int http_resp_persists(char *data, size_t n);
+int http_resp_status(char *data, size_t n);
+int http_resp_interim(char *data, size_t n);
+long http_resp_ttl(char *data, size_t n, long deflt);
+
+void http_body_init(http_body_t *bp, http_resp_t *rp);
+size_t http_body_want(http_body_t *bp);
+size_t http_body_room(http_body_t *bp, size_t max);
+ssize_t http_body_decode(http_body_t *bp, char *buf, size_t n);
+void http_body_skip(http_body_t *bp, size_t n, int eof);
+
+#endif /* __HTTP_H__ */
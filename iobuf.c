@@ -0,0 +1,141 @@
+/*
+ * iobuf.c - Pool of fixed-size, reference-counted I/O buffers
+ *
+ * Each thread keeps its free buffers on a list of its own, so getting
+ * and putting a buffer takes no lock. The shared depot holds batches
+ * of IOBUF_BATCH free buffers, each a chain through next, that threads
+ * with too many free buffers give back and threads with none take.
+ * Buffers are only ever malloc'd when the depot is empty as well.
+ */
+#include "iobuf.h"
+
+#define IOBUF_BATCH 32          /* Buffers moved to or from the depot */
+#define IOBUF_MAXIOV 64         /* Buffers written per iobuf_write */
+
+static __thread iobuf_t *iobuf_free;    /* This thread's free buffers */
+static __thread int iobuf_nfree;
+
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static iobuf_t **depot;                 /* Stack of batches */
+static int ndepot, depotcap;
+
+/*
+ * iobuf_get - Return an empty buffer with one reference, held by the
+ *     caller, from this thread's freelist, then the depot, then malloc.
+ */
+iobuf_t *iobuf_get(void)
+{
+    iobuf_t *b;
+
+    if (!iobuf_free) {
+        pthread_mutex_lock(&depot_lock);
+        if (ndepot > 0) {
+            iobuf_free = depot[--ndepot];
+            iobuf_nfree = IOBUF_BATCH;
+        }
+        pthread_mutex_unlock(&depot_lock);
+    }
+    if ((b = iobuf_free)) {
+        iobuf_free = b->next;
+        iobuf_nfree--;
+    }
+    else
+        b = Malloc(sizeof(iobuf_t));
+    b->next = NULL;
+    b->refcnt = 1;
+    b->len = 0;
+    return b;
+}
+
+/* iobuf_ref - Take another reference to b */
+void iobuf_ref(iobuf_t *b)
+{
+    __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * iobuf_put - Drop a reference to b. The last one puts b on this
+ *     thread's freelist; once that holds two batches, the older one
+ *     goes to the depot.
+ */
+void iobuf_put(iobuf_t *b)
+{
+    int i;
+    iobuf_t *p;
+
+    if (__atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    b->next = iobuf_free;
+    iobuf_free = b;
+    if (++iobuf_nfree < 2 * IOBUF_BATCH)
+        return;
+
+    for (p = iobuf_free, i = 1; i < IOBUF_BATCH; i++)
+        p = p->next;
+    pthread_mutex_lock(&depot_lock);
+    if (ndepot == depotcap) {
+        depotcap = depotcap ? 2 * depotcap : 16;
+        depot = Realloc(depot, depotcap * sizeof(iobuf_t *));
+    }
+    depot[ndepot++] = p->next;
+    pthread_mutex_unlock(&depot_lock);
+    p->next = NULL;
+    iobuf_nfree = IOBUF_BATCH;
+}
+
+/*
+ * iobuf_put_chain - Drop a reference to each buffer in the chain at b.
+ *     Each next is read before its buffer is put, as another holder of
+ *     the chain may free the buffers behind us.
+ */
+void iobuf_put_chain(iobuf_t *b)
+{
+    iobuf_t *next;
+
+    for (; b; b = next) {
+        next = b->next;
+        iobuf_put(b);
+    }
+}
+
+/*
+ * iobuf_write - Write as much of the chain at b as fd will take,
+ *     starting off bytes in. Returns the number of bytes written, 0 if
+ *     there were none left, or -1 with errno set.
+ */
+ssize_t iobuf_write(int fd, iobuf_t *b, size_t off)
+{
+    struct iovec iov[IOBUF_MAXIOV];
+    int n;
+
+    for (; b && off >= b->len; b = b->next)
+        off -= b->len;
+    for (n = 0; b && n < IOBUF_MAXIOV; b = b->next) {
+        if (b->len == off)
+            continue;
+        iov[n].iov_base = b->data + off;
+        iov[n++].iov_len = b->len - off;
+        off = 0;
+    }
+    return n ? writev(fd, iov, n) : 0;
+}
+
+/*
+ * iobuf_send - Write all of the chain at b to the blocking descriptor
+ *     fd. Returns 0, or -1 if the write failed.
+ */
+int iobuf_send(int fd, iobuf_t *b)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while ((n = iobuf_write(fd, b, off)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * iobuf.h - Pool of fixed-size, reference-counted I/O buffers
+ *
+ * Response bodies are read from the origin straight into pool buffers.
+ * The same buffers are written to the client, read by the followers of
+ * the fetch and, once the response is complete, kept by the cache;
+ * each holder takes its own reference instead of a copy. Buffers are
+ * linked into chains through next, and a chain never changes once it
+ * has more than one holder, so holders can share it.
+ *
+ * A buffer whose last reference is dropped goes on its thread's
+ * freelist. A freelist that grows long gives a batch of buffers back
+ * to a shared depot, and an empty one takes a batch from it, so once
+ * the pool has warmed up, relaying and caching a response calls malloc
+ * for none of its bytes.
+ */
+#ifndef __IOBUF_H__
+#define __IOBUF_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+
+#define IOBUF_SIZE 16384        /* Bytes of data per buffer */
+
+typedef struct iobuf {
+    struct iobuf *next;         /* Next in its chain, or on a freelist */
+    int refcnt;
+    size_t len;                 /* Bytes of data in use */
+    char data[IOBUF_SIZE];
+} iobuf_t;
+
+iobuf_t *iobuf_get(void);
+void iobuf_ref(iobuf_t *b);
+void iobuf_put(iobuf_t *b);
+void iobuf_put_chain(iobuf_t *b);
+ssize_t iobuf_write(int fd, iobuf_t *b, size_t off);
+int iobuf_send(int fd, iobuf_t *b);
+
+#endif /* __IOBUF_H__ */
@@ -0,0 +1,486 @@
+/*
+ * loadgen.c - Load generator for the proxy
+ *
+ * usage: loadgen [-c conns] [-d secs] [-n requests] [-r rate] [-C]
+ *            [-p host:port] [-t timeout] [-a ms] [-f mixfile] [-b label]
+ *            [url ...]
+ *
+ * Each of the conns connections is a thread of its own that sends GET
+ * requests on it one at a time, to the proxy at -p if one is given,
+ * else straight to the URL's server. Every request picks its URL at
+ * random from the mix: URLs on the command line weigh 1 each, and a
+ * mix file holds "weight url" lines. A connection is kept for as long
+ * as the server lets it be, unless -C is given, in which case every
+ * request opens a connection of its own and asks for it to be closed.
+ *
+ * Without -r the load is closed-loop: a connection sends its next
+ * request as soon as the last response is in, and a request's latency
+ * runs from sending it to the end of its response. With -r the load is
+ * open-loop at rate requests per second in all: each request is due at
+ * a fixed time, the connections taking turns, and its latency runs from
+ * when it was due rather than from when it went out. A server that
+ * stalls then shows up in the percentiles of every request it held
+ * back, instead of as a single slow one followed by a lull in which no
+ * requests were measured ("coordinated omission").
+ *
+ * With -a every request is abandoned: sent on a connection of its own,
+ * none of the response read, and the connection reset ms milliseconds
+ * later, the way a client that gives up on a slow download does. Small
+ * segments and a small receive buffer keep what the server can write
+ * before it has to wait down to a few tens of KB, even over loopback,
+ * so a server that writes a larger response sees its client vanish
+ * part way through, and anyone relaying the same response has to get
+ * all of it regardless.
+ *
+ * The run stops after secs seconds, or after requests requests if -n
+ * is given, and prints requests and bytes per second, errors, and the
+ * latency percentiles; -b prints them as one line headed by label.
+ */
+#include <netinet/tcp.h>
+#include "csapp.h"
+#include "http.h"
+#include "hist.h"
+
+#define LG_MAXURLS 256
+#define LG_ABANDON_RCVBUF 1024  /* Receive buffer of an abandoning client */
+#define LG_ABANDON_MSS 536      /* and its segment size */
+
+/* A server to connect to, resolved once up front */
+typedef struct lg_target {
+    char host[MAXLINE];
+    char port[16];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct lg_target *next;
+} lg_target_t;
+
+typedef struct {
+    unsigned long weight;       /* Up to and including this URL */
+    lg_target_t *target;        /* Where its requests go */
+    char *req;                  /* The request, ready to send */
+    size_t reqlen;
+} lg_url_t;
+
+/* One connection's thread and what it measured */
+typedef struct {
+    pthread_t tid;
+    int id;
+    unsigned int seed;
+    unsigned long requests, errors, non2xx, bytes, max;
+    unsigned long hist[HIST_BUCKETS];
+} lg_conn_t;
+
+/* Outcomes of a request */
+#define LG_KEEP 1               /* Done, and the connection carries on */
+#define LG_DONE 0               /* Done, and the connection is finished */
+#define LG_ERROR -1             /* Failed */
+#define LG_CLOSED -2            /* Connection closed before any response */
+
+static lg_url_t lg_urls[LG_MAXURLS];
+static int lg_nurls;
+static unsigned long lg_weight;         /* Of all the URLs */
+static lg_target_t *lg_targets, *lg_proxy;
+static int lg_nconns = 16, lg_close, lg_timeout = 5;
+static int lg_abandon;                  /* ms to wait before a reset */
+static double lg_rate;                  /* Requests/s, 0 for closed-loop */
+static long long lg_start, lg_end;      /* us */
+static unsigned long lg_limit, lg_issued;
+
+/* lg_now - Monotonic clock in us */
+static long long lg_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* lg_sleep_until - Sleep until the monotonic clock reads t us */
+static void lg_sleep_until(long long t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = t % 1000000 * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*
+ * lg_target - The target for host:port, resolved the first time it is
+ *     asked for to the first address that takes a connection
+ */
+static lg_target_t *lg_target(char *host, char *port)
+{
+    lg_target_t *t;
+    struct addrinfo hints, *list, *p;
+    int fd, rc;
+
+    for (t = lg_targets; t; t = t->next)
+        if (!strcmp(t->host, host) && !strcmp(t->port, port))
+            return t;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(host, port, &hints, &list)) != 0) {
+        fprintf(stderr, "loadgen: %s:%s: %s\n", host, port, gai_strerror(rc));
+        exit(1);
+    }
+    for (p = list; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        rc = connect(fd, p->ai_addr, p->ai_addrlen);
+        close(fd);
+        if (rc == 0)
+            break;
+    }
+    if (!p) {
+        fprintf(stderr, "loadgen: cannot connect to %s:%s\n", host, port);
+        exit(1);
+    }
+    t = Calloc(1, sizeof(lg_target_t));
+    snprintf(t->host, sizeof(t->host), "%s", host);
+    snprintf(t->port, sizeof(t->port), "%s", port);
+    memcpy(&t->addr, p->ai_addr, p->ai_addrlen);
+    t->addrlen = p->ai_addrlen;
+    freeaddrinfo(list);
+    t->next = lg_targets;
+    lg_targets = t;
+    return t;
+}
+
+/*
+ * lg_add_url - Add url to the mix with the given weight, building the
+ *     request that fetches it
+ */
+static void lg_add_url(char *url, unsigned long weight)
+{
+    char host[MAXLINE], port[16] = "80", *p, *path, *hostport;
+    size_t n;
+    lg_url_t *u;
+
+    if (strncasecmp(url, "http://", 7) || weight == 0) {
+        fprintf(stderr, "loadgen: bad URL %s\n", url);
+        exit(1);
+    }
+    if (lg_nurls == LG_MAXURLS) {
+        fprintf(stderr, "loadgen: more than %d URLs\n", LG_MAXURLS);
+        exit(1);
+    }
+    hostport = url + 7;
+    path = hostport + strcspn(hostport, "/");
+    n = strcspn(hostport, ":/");
+    if (n == 0 || n >= sizeof(host)) {
+        fprintf(stderr, "loadgen: bad URL %s\n", url);
+        exit(1);
+    }
+    memcpy(host, hostport, n);
+    host[n] = '\0';
+    if (hostport[n] == ':')
+        snprintf(port, sizeof(port), "%.*s", (int)(path - hostport - n - 1),
+                hostport + n + 1);
+
+    u = &lg_urls[lg_nurls++];
+    u->weight = (lg_weight += weight);
+    u->target = lg_proxy ? lg_proxy : lg_target(host, port);
+    n = strlen(url) + strlen(hostport) + 64;
+    p = u->req = Malloc(n);
+    u->reqlen = snprintf(p, n, "GET %s%s HTTP/1.1\r\nHost: %.*s\r\n%s\r\n",
+            lg_proxy ? url : "", lg_proxy ? "" : (*path ? path : "/"),
+            (int)(path - hostport), hostport,
+            lg_close ? "Connection: close\r\n" : "");
+}
+
+/* lg_read_mix - Add the "weight url" lines of file to the mix */
+static void lg_read_mix(char *file)
+{
+    FILE *fp;
+    char line[MAXLINE], url[MAXLINE];
+    unsigned long weight;
+
+    if (!(fp = fopen(file, "r"))) {
+        fprintf(stderr, "loadgen: %s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#')
+            continue;
+        if (sscanf(line, "%lu %s", &weight, url) != 2) {
+            fprintf(stderr, "loadgen: %s: bad line %s", file, line);
+            exit(1);
+        }
+        lg_add_url(url, weight);
+    }
+    fclose(fp);
+}
+
+/* lg_pick - A URL from the mix, chosen at random by weight */
+static lg_url_t *lg_pick(lg_conn_t *c)
+{
+    unsigned long r = rand_r(&c->seed) % lg_weight;
+    int lo = 0, hi = lg_nurls - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (lg_urls[mid].weight > r)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return &lg_urls[lo];
+}
+
+/* lg_connect - Open a connection to t; returns its fd or -1 */
+static int lg_connect(lg_target_t *t)
+{
+    int fd, rcvbuf = LG_ABANDON_RCVBUF, mss = LG_ABANDON_MSS;
+    struct timeval tv = { lg_timeout, 0 };
+
+    if ((fd = socket(t->addr.ss_family, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (lg_abandon) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss));
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (SA *)&t->addr, t->addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * lg_fetch - Send u's request on fd and read the whole response.
+ *     Returns one of the LG_ outcomes.
+ */
+static int lg_fetch(lg_conn_t *c, int fd, rio_t *rio, lg_url_t *u)
+{
+    char head[MAXBUF], out[MAXBUF], buf[MAXBUF];
+    ssize_t n;
+    size_t want;
+    http_resp_t resp;
+    http_body_t body;
+    struct linger lin = { 1, 0 };
+
+    if (rio_writen(fd, u->req, u->reqlen) < 0)
+        return LG_CLOSED;
+    if (lg_abandon) {
+        usleep(lg_abandon * 1000);
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+        return LG_DONE;         /* Closed, and so reset, by the caller */
+    }
+    if ((n = http_read_head(rio, head, sizeof(head))) == 0)
+        return LG_CLOSED;
+    if (n < 0 || http_resp_parse(head, n, &resp, out, sizeof(out)) < 0)
+        return LG_ERROR;
+    c->bytes += n;
+    if (resp.status < 200 || resp.status > 299)
+        c->non2xx++;
+
+    http_body_init(&body, &resp);
+    while ((want = http_body_want(&body)) > 0) {
+        if (want > sizeof(buf))
+            want = sizeof(buf);
+        if ((n = rio_readnb(rio, buf, want)) < 0
+                || http_body_decode(&body, buf, n) < 0)
+            return LG_ERROR;
+        c->bytes += n;
+    }
+    return (resp.keepalive && !lg_close) ? LG_KEEP : LG_DONE;
+}
+
+/*
+ * lg_run - One connection's thread: send requests until the run is
+ *     over, recording each one's latency
+ */
+static void *lg_run(void *vargp)
+{
+    lg_conn_t *c = vargp;
+    lg_target_t *t = NULL;
+    lg_url_t *u;
+    rio_t rio;
+    unsigned long k, us;
+    long long due;
+    int fd = -1, rc, reused;
+
+    for (k = 0; ; k++) {
+        if (lg_rate > 0) {
+            due = lg_start + (long long)((c->id + (double)k * lg_nconns)
+                    * 1000000 / lg_rate);
+            if (due >= lg_end)
+                break;
+            lg_sleep_until(due);
+        }
+        else if ((due = lg_now()) >= lg_end)
+            break;
+        if (lg_limit && __atomic_fetch_add(&lg_issued, 1, __ATOMIC_RELAXED)
+                >= lg_limit)
+            break;
+
+        /* A connection the server closed while it sat idle gets one
+           retry on a fresh connection */
+        u = lg_pick(c);
+        do {
+            if (fd >= 0 && t != u->target) {
+                close(fd);
+                fd = -1;
+            }
+            if ((reused = (fd >= 0)) == 0) {
+                t = u->target;
+                if ((fd = lg_connect(t)) < 0) {
+                    rc = LG_ERROR;
+                    break;
+                }
+                Rio_readinitb(&rio, fd);
+            }
+            if ((rc = lg_fetch(c, fd, &rio, u)) != LG_KEEP) {
+                close(fd);
+                fd = -1;
+            }
+        } while (rc == LG_CLOSED && reused);
+
+        if (rc < 0) {
+            c->errors++;
+            if (lg_rate == 0)
+                usleep(1000);   /* Do not spin on a dead server */
+            continue;
+        }
+        us = lg_now() - due;
+        c->hist[hist_bucket(us)]++;
+        if (us > c->max)
+            c->max = us;
+        c->requests++;
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/* lg_report - Add up what the connections measured and print it */
+static void lg_report(lg_conn_t *conns, double secs, char *label)
+{
+    unsigned long hist[HIST_BUCKETS], requests = 0, errors = 0, non2xx = 0;
+    unsigned long bytes = 0, max = 0;
+    int i, j;
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < lg_nconns; i++) {
+        requests += conns[i].requests;
+        errors += conns[i].errors;
+        non2xx += conns[i].non2xx;
+        bytes += conns[i].bytes;
+        if (conns[i].max > max)
+            max = conns[i].max;
+        for (j = 0; j < HIST_BUCKETS; j++)
+            hist[j] += conns[i].hist[j];
+    }
+
+#define LG_P(q) hist_percentile(hist, requests, max, q)
+    if (label) {
+        printf("%-14s %10.1f %8.2f %8lu %8lu %8lu %8lu %6lu\n", label,
+                requests / secs, bytes / secs / 1e6, LG_P(0.5), LG_P(0.99),
+                LG_P(0.999), max, errors + non2xx);
+        return;
+    }
+    printf("%d connections, %s, ", lg_nconns,
+            lg_close ? "one request each" : "keep-alive");
+    if (lg_rate > 0)
+        printf("open loop at %.1f req/s, ", lg_rate);
+    else
+        printf("closed loop, ");
+    printf("%.2f s\n", secs);
+    printf("  requests  %lu (%.1f/s)\n", requests, requests / secs);
+    printf("  errors    %lu, non-2xx responses %lu\n", errors, non2xx);
+    printf("  received  %.2f MB (%.2f MB/s)\n", bytes / 1e6, bytes / secs / 1e6);
+    printf("  latency   p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  max %lu us%s\n",
+            LG_P(0.5), LG_P(0.9), LG_P(0.99), LG_P(0.999), max,
+            (lg_rate > 0) ? " (from when due)" : "");
+#undef LG_P
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c conns] [-d secs] [-n requests] "
+            "[-r rate] [-C]\n"
+            "           [-p host:port] [-t timeout] [-a ms] [-f mixfile] "
+            "[-b label]\n           [url ...]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int i, opt;
+    double secs = 5;
+    char *mix = NULL, *label = NULL, *proxy = NULL, *colon;
+    lg_conn_t *conns;
+
+    while ((opt = getopt(argc, argv, "c:d:n:r:Cp:t:a:f:b:")) != -1) {
+        switch (opt) {
+        case 'c':
+            lg_nconns = atoi(optarg);
+            break;
+        case 'd':
+            secs = atof(optarg);
+            break;
+        case 'n':
+            lg_limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            lg_rate = atof(optarg);
+            break;
+        case 'C':
+            lg_close = 1;
+            break;
+        case 'p':
+            proxy = optarg;
+            break;
+        case 't':
+            lg_timeout = atoi(optarg);
+            break;
+        case 'a':
+            lg_abandon = atoi(optarg);
+            break;
+        case 'f':
+            mix = optarg;
+            break;
+        case 'b':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (lg_nconns < 1 || secs <= 0 || lg_rate < 0 || lg_timeout < 1
+            || lg_abandon < 0
+            || (optind == argc && !mix))
+        usage(argv[0]);
+    Signal(SIGPIPE, SIG_IGN);
+
+    if (proxy) {
+        if (!(colon = strrchr(proxy, ':')))
+            usage(argv[0]);
+        *colon = '\0';
+        lg_proxy = lg_target(proxy, colon + 1);
+    }
+    if (mix)
+        lg_read_mix(mix);
+    for (i = optind; i < argc; i++)
+        lg_add_url(argv[i], 1);
+
+    conns = Calloc(lg_nconns, sizeof(lg_conn_t));
+    lg_start = lg_now();
+    lg_end = lg_start + (long long)(secs * 1000000);
+    for (i = 0; i < lg_nconns; i++) {
+        conns[i].id = i;
+        conns[i].seed = i * 2654435761U + getpid();
+        Pthread_create(&conns[i].tid, NULL, lg_run, &conns[i]);
+    }
+    for (i = 0; i < lg_nconns; i++)
+        Pthread_join(conns[i].tid, NULL);
+
+    lg_report(conns, (lg_now() - lg_start) / 1e6, label);
+    exit(0);
+}
@@ -0,0 +1,406 @@
+/*
+ * mbench.c - Microbenchmarks for the proxy's per-request string code
+ *
+ * usage: mbench [-n rounds] [-f corpus] [benchmark ...]
+ *
+ * Times the routines every request goes through on its way in, and
+ * clienterror on the way out for those that fail, over a corpus of
+ * request header blocks:
+ *
+ *   parse_uri          the URI of each request into host, port and path
+ *   rio_readlineb      the block a line at a time from a rio buffer
+ *   read_request       the whole of it as a worker thread does: read
+ *                      from a rio buffer, parse, build_request and
+ *                      build_requesthdrs into the connection's arena
+ *   build_requesthdrs  the header rewrite on its own, from a parse
+ *   clienterror        an error page for the request, to /dev/null
+ *   cache_lookup       a cache hit on the request's key, and releasing
+ *                      the object again
+ *
+ * The rio buffer is filled from memory before each call, so nothing is
+ * read from a descriptor, and every request's key is cached, as a
+ * response of one pool buffer, before the benchmarks start. Each
+ * benchmark makes rounds passes over the corpus after one to warm up,
+ * and reports nanoseconds and heap allocations per call, and TSC cycles
+ * per byte of input (of the page written, for clienterror; of the key,
+ * for cache_lookup). Allocations are counted by wrapping
+ * malloc, calloc and realloc at link time, so they are the proxy's own;
+ * any libc makes for itself are not counted.
+ *
+ * The corpus is built in, or read from a file of header blocks, each
+ * ended by an empty line; lines get CRLF endings either way. Naming
+ * benchmarks runs just those.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "http.h"
+#include "arena.h"
+#include "cache.h"
+
+#define MB_MAXREQS 256
+
+/* One request of the corpus */
+typedef struct {
+    char *block;                /* Header block, CRLF line ends */
+    size_t len;
+    char *uri;                  /* Its URI, NUL-terminated */
+    char *key;                  /* Its cache key */
+    http_req_t hr;              /* Its parse, for build_requesthdrs */
+} mb_req_t;
+
+typedef struct {
+    char *name;
+    size_t (*run)(mb_req_t *q);     /* Returns the bytes it went over */
+} mb_bench_t;
+
+static char *mb_builtin[] = {
+    /* A browser */
+    "GET http://www.example.com/index.html HTTP/1.1\n"
+    "Host: www.example.com\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 "
+        "Firefox/120.0\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/avif,image/webp,*/*;q=0.8\n"
+    "Accept-Language: en-US,en;q=0.5\n"
+    "Accept-Encoding: gzip, deflate\n"
+    "Connection: keep-alive\n"
+    "Upgrade-Insecure-Requests: 1\n"
+    "Cache-Control: max-age=0\n"
+    "\n",
+    /* curl */
+    "GET http://localhost:8080/godzilla.jpg HTTP/1.1\n"
+    "Host: localhost:8080\n"
+    "User-Agent: curl/8.5.0\n"
+    "Accept: */*\n"
+    "Proxy-Connection: Keep-Alive\n"
+    "\n",
+    /* HTTP/1.0, no Host, asking to be kept */
+    "GET http://cs.cmu.edu:80/~213/index.html HTTP/1.0\n"
+    "Connection: keep-alive\n"
+    "\n",
+    /* An API call with a long query string and a cookie */
+    "GET http://api.example.org/v2/search?q=proxy+cache+eviction&lang=en"
+        "&page=3&per_page=50&sort=relevance&fields=id,title,url,snippet"
+        "&session=7f3a9c2e41b84d0f9a6e5c1b2d3f4a5b HTTP/1.1\n"
+    "Host: api.example.org\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) "
+        "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/119.0.0.0 "
+        "Safari/537.36\n"
+    "Accept: application/json\n"
+    "Accept-Encoding: gzip, deflate, br\n"
+    "Accept-Language: en-GB,en;q=0.9\n"
+    "Cookie: sid=4c2a8e1f9b7d6a5c3e2f1a0b9c8d7e6f; theme=dark; "
+        "consent=1; _ga=GA1.2.1234567890.1700000000\n"
+    "Referer: http://www.example.org/search\n"
+    "X-Requested-With: XMLHttpRequest\n"
+    "Connection: keep-alive\n"
+    "\n",
+    /* A bare one */
+    "GET http://10.0.0.7/ HTTP/1.1\n"
+    "Host: 10.0.0.7\n"
+    "Connection: close\n"
+    "\n",
+};
+
+static mb_req_t mb_reqs[MB_MAXREQS];
+static int mb_nreqs;
+static unsigned long mb_allocs;
+static arena_t mb_arena;
+static rio_t mb_rio;
+static int mb_null;
+
+/* Allocation counting, through ld --wrap */
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t nmemb, size_t n);
+void *__real_realloc(void *p, size_t n);
+
+void *__wrap_malloc(size_t n)
+{
+    mb_allocs++;
+    return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t n)
+{
+    mb_allocs++;
+    return __real_calloc(nmemb, n);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+    mb_allocs++;
+    return __real_realloc(p, n);
+}
+
+/* mb_ns - Monotonic clock in ns */
+static long long mb_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* mb_cycles - The time stamp counter, or 0 where there is none */
+static unsigned long long mb_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * mb_add - Add the header block in s, n bytes with lines ended by LF
+ *     or CRLF, to the corpus
+ */
+static void mb_add(char *s, size_t n)
+{
+    mb_req_t *q;
+    char *p, *end = s + n, *host, *port, *path;
+    size_t len = 0;
+
+    if (mb_nreqs == MB_MAXREQS)
+        app_error("mbench: too many requests in the corpus");
+    q = &mb_reqs[mb_nreqs];
+    q->block = Malloc(2 * n + 1);
+    for (p = s; p < end; p++) {
+        if (*p == '\r')
+            continue;
+        if (*p == '\n')
+            q->block[len++] = '\r';
+        q->block[len++] = *p;
+    }
+    q->block[len] = '\0';
+    q->len = len;
+    if (len > RIO_BUFSIZE)
+        app_error("mbench: request larger than a rio buffer");
+    if (http_req_parse(q->block, len, &q->hr) <= 0) {
+        fprintf(stderr, "mbench: cannot parse request %d\n", mb_nreqs + 1);
+        exit(1);
+    }
+    q->uri = Malloc(q->hr.urilen + 1);
+    memcpy(q->uri, q->hr.uri, q->hr.urilen);
+    q->uri[q->hr.urilen] = '\0';
+
+    /* Built as build_request does */
+    host = Malloc(q->hr.urilen + 1);
+    port = Malloc(q->hr.urilen + 3);
+    path = Malloc(q->hr.urilen + 2);
+    parse_uri(q->uri, host, port, path);
+    len = strlen(host) + strlen(port) + strlen(path) + 2;
+    q->key = Malloc(len);
+    cache_key(q->key, len, host, port, path);
+    Free(host);
+    Free(port);
+    Free(path);
+    mb_nreqs++;
+}
+
+/* mb_read_corpus - Add the header blocks in file to the corpus */
+static void mb_read_corpus(char *file)
+{
+    FILE *fp;
+    char line[MAXLINE], block[RIO_BUFSIZE];
+    size_t len = 0, n;
+
+    if (!(fp = fopen(file, "r")))
+        unix_error("mbench: cannot open corpus");
+    while (fgets(line, sizeof(line), fp)) {
+        n = strlen(line);
+        if (len + n >= sizeof(block))
+            app_error("mbench: request larger than a rio buffer");
+        memcpy(block + len, line, n);
+        len += n;
+        if (line[0] == '\n' || (line[0] == '\r' && line[1] == '\n')) {
+            if (len > n)
+                mb_add(block, len);
+            len = 0;
+        }
+    }
+    if (len > 0)
+        mb_add(block, len);
+    fclose(fp);
+}
+
+/* mb_fill - Put q's header block in the rio buffer, as if just read */
+static void mb_fill(mb_req_t *q)
+{
+    mb_rio.rio_fd = -1;
+    memcpy(mb_rio.rio_buf, q->block, q->len);
+    mb_rio.rio_cnt = q->len;
+    mb_rio.rio_bufptr = mb_rio.rio_buf;
+}
+
+static size_t mb_parse_uri(mb_req_t *q)
+{
+    char host[MAXLINE], port[MAXLINE], path[MAXLINE];
+
+    parse_uri(q->uri, host, port, path);
+    return q->hr.urilen;
+}
+
+static size_t mb_rio_readlineb(mb_req_t *q)
+{
+    char line[MAXLINE];
+    ssize_t n;
+
+    mb_fill(q);
+    while ((n = rio_readlineb(&mb_rio, line, sizeof(line))) > 2)
+        ;
+    return q->len;
+}
+
+static size_t mb_read_request(mb_req_t *q)
+{
+    request_t r;
+
+    arena_reset(&mb_arena);
+    request_init(&r);
+    mb_fill(q);
+    if (read_request(&mb_rio, mb_null, &mb_arena, &r) < 0)
+        app_error("mbench: read_request failed");
+    return q->len;
+}
+
+static size_t mb_build_requesthdrs(mb_req_t *q)
+{
+    upreq_t up;
+    int keep = q->hr.minor >= 1;
+
+    up.iovcnt = 0;
+    up.len = 0;
+    build_requesthdrs(&q->hr, &up, "www.example.com", &keep);
+    return q->len;
+}
+
+static size_t mb_clienterror(mb_req_t *q)
+{
+    ssize_t n;
+
+    n = clienterror(mb_null, q->uri, "404", "Not found",
+            "Proxy couldn't find this file");
+    return (n > 0) ? n : 0;
+}
+
+static size_t mb_cache_lookup(mb_req_t *q)
+{
+    cache_obj_t *obj;
+
+    if (!(obj = cache_lookup(q->key)))
+        app_error("mbench: cache_lookup missed");
+    cache_release(obj);
+    return strlen(q->key);
+}
+
+static mb_bench_t mb_benches[] = {
+    { "parse_uri", mb_parse_uri },
+    { "rio_readlineb", mb_rio_readlineb },
+    { "read_request", mb_read_request },
+    { "build_requesthdrs", mb_build_requesthdrs },
+    { "clienterror", mb_clienterror },
+    { "cache_lookup", mb_cache_lookup },
+};
+
+#define MB_NBENCHES ((int)(sizeof(mb_benches) / sizeof(mb_benches[0])))
+
+/* mb_run - One warm-up pass over the corpus, then rounds timed ones */
+static void mb_run(mb_bench_t *b, unsigned long rounds)
+{
+    unsigned long i, ops = rounds * mb_nreqs, allocs;
+    unsigned long long cycles;
+    long long ns;
+    size_t bytes = 0;
+    int j;
+
+    for (j = 0; j < mb_nreqs; j++)
+        b->run(&mb_reqs[j]);
+    allocs = mb_allocs;
+    ns = mb_ns();
+    cycles = mb_cycles();
+    for (i = 0; i < rounds; i++)
+        for (j = 0; j < mb_nreqs; j++)
+            bytes += b->run(&mb_reqs[j]);
+    cycles = mb_cycles() - cycles;
+    ns = mb_ns() - ns;
+    allocs = mb_allocs - allocs;
+
+    printf("%-18s %10lu %10.1f %10.3f ", b->name, ops,
+            (double)ns / ops, (double)allocs / ops);
+    if (cycles && bytes)
+        printf("%10.2f\n", (double)cycles / bytes);
+    else
+        printf("%10s\n", "-");
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-n rounds] [-f corpus] [benchmark ...]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int i, j, opt;
+    unsigned long rounds = 100000;
+    char *corpus = NULL;
+    iobuf_t *b;
+
+    while ((opt = getopt(argc, argv, "n:f:")) != -1) {
+        switch (opt) {
+        case 'n':
+            rounds = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            corpus = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (rounds == 0)
+        usage(argv[0]);
+    for (i = optind; i < argc; i++) {
+        for (j = 0; j < MB_NBENCHES; j++)
+            if (!strcmp(argv[i], mb_benches[j].name))
+                break;
+        if (j == MB_NBENCHES)
+            usage(argv[0]);
+    }
+
+    if (corpus)
+        mb_read_corpus(corpus);
+    else
+        for (i = 0; i < (int)(sizeof(mb_builtin) / sizeof(char *)); i++)
+            mb_add(mb_builtin[i], strlen(mb_builtin[i]));
+    if (mb_nreqs == 0)
+        app_error("mbench: empty corpus");
+    mb_null = Open("/dev/null", O_WRONLY, 0);
+    arena_init(&mb_arena);
+    cache_init(NULL, MAX_CACHE_SIZE);
+    for (i = 0; i < mb_nreqs; i++) {
+        b = iobuf_get();
+        b->len = IOBUF_SIZE;
+        cache_insert(mb_reqs[i].key, b, b->len, 0);
+    }
+
+    printf("%d requests, %lu rounds\n", mb_nreqs, rounds);
+    printf("%-18s %10s %10s %10s %10s\n", "benchmark", "calls", "ns/call",
+            "allocs", "cycles/B");
+    for (j = 0; j < MB_NBENCHES; j++) {
+        if (optind < argc) {
+            for (i = optind; i < argc; i++)
+                if (!strcmp(argv[i], mb_benches[j].name))
+                    break;
+            if (i == argc)
+                continue;
+        }
+        mb_run(&mb_benches[j], rounds);
+    }
+    exit(0);
+}
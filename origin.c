@@ -0,0 +1,416 @@
+/*
+ * origin.c - Origin server simulator for benchmarking the proxy
+ *
+ * usage: origin [-f scenario] <port>
+ *
+ * Serves synthetic objects over HTTP/1.1, a thread per connection, with
+ * keep-alive and pipelining, so that a benchmark measures the proxy
+ * rather than an origin that, like tiny, serves one request at a time.
+ * What each request gets is decided by the route whose prefix is the
+ * longest to match its path. A scenario file holds one route per line:
+ *
+ *   <path prefix> [key=value ...]
+ *
+ * with blank lines and lines starting with # ignored. Prefixes and
+ * cache values are at most 255 bytes long. The keys are
+ *
+ *   size=D       Body size in bytes (default 1024). The same URL always
+ *                gets the same size, drawn from D by a hash of the URL.
+ *   delay=D      Think time in us before the response starts (default 0)
+ *   status=N     Status code (default 200)
+ *   framing=F    length (Content-Length, the default), chunked, or close
+ *                (the body ends when the connection does)
+ *   chunk=N      Bytes per chunk when chunked (default 4096)
+ *   cache=V      Cache-Control value, e.g. max-age=60 or no-store;
+ *                none is sent by default
+ *   error=P      Probability of a 503 instead
+ *   reset=P      Probability of resetting the connection instead
+ *   truncate=P   Probability of closing the connection half way through
+ *                the body
+ *   headcut=P    Probability of closing the connection half way through
+ *                the response head
+ *   stall=P:D    Probability of pausing half way through the body, and
+ *                for how many us
+ *
+ * where a distribution D is a number, uniform:lo:hi, exp:mean or
+ * pareto:min:alpha[:max]. Without -f, and for paths no route matches,
+ * the route is "/" with every key at its default.
+ */
+#include <math.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+#include "http.h"
+
+#define ORG_MAXROUTES 64
+#define ORG_PATTERN 65536       /* Bytes of body pattern to write from */
+#define ORG_MAXSTR 256          /* Longest prefix or cache value, plus 1 */
+
+typedef enum { DIST_FIXED, DIST_UNIFORM, DIST_EXP, DIST_PARETO } dist_kind_t;
+
+/* A distribution of non-negative values */
+typedef struct {
+    dist_kind_t kind;
+    double a, b, c;             /* Parameters, in the order written */
+} dist_t;
+
+typedef enum { FRAME_LENGTH, FRAME_CHUNKED, FRAME_CLOSE } frame_t;
+
+typedef struct {
+    char prefix[ORG_MAXSTR];
+    size_t prefixlen;
+    dist_t size, delay, stalltime;
+    int status;
+    frame_t framing;
+    size_t chunk;
+    char cache[ORG_MAXSTR];     /* Cache-Control value, "" for none */
+    double error, reset, truncate, headcut, stall;
+} route_t;
+
+static route_t routes[ORG_MAXROUTES], defroute;
+static int nroutes;
+static char pattern[ORG_PATTERN + 26];     /* a-z over and over */
+
+/*
+ * dist_parse - Parse distribution s into d; returns 0, or -1 if s is
+ *     not one
+ */
+static int dist_parse(char *s, dist_t *d)
+{
+    char *end;
+
+    memset(d, 0, sizeof(*d));
+    if (!strncmp(s, "uniform:", 8)) {
+        d->kind = DIST_UNIFORM;
+        return (sscanf(s + 8, "%lf:%lf", &d->a, &d->b) == 2
+                && d->a >= 0 && d->b >= d->a) ? 0 : -1;
+    }
+    if (!strncmp(s, "exp:", 4)) {
+        d->kind = DIST_EXP;
+        return (sscanf(s + 4, "%lf", &d->a) == 1 && d->a >= 0) ? 0 : -1;
+    }
+    if (!strncmp(s, "pareto:", 7)) {
+        d->kind = DIST_PARETO;
+        d->c = HUGE_VAL;
+        return (sscanf(s + 7, "%lf:%lf:%lf", &d->a, &d->b, &d->c) >= 2
+                && d->a > 0 && d->b > 0) ? 0 : -1;
+    }
+    d->kind = DIST_FIXED;
+    d->a = strtod(s, &end);
+    return (end != s && *end == '\0' && d->a >= 0) ? 0 : -1;
+}
+
+/* dist_sample - The value of d at u, a uniform number in [0, 1) */
+static double dist_sample(dist_t *d, double u)
+{
+    double v;
+
+    switch (d->kind) {
+    case DIST_UNIFORM:
+        return d->a + u * (d->b - d->a);
+    case DIST_EXP:
+        return -d->a * log(1 - u);
+    case DIST_PARETO:
+        v = d->a / pow(1 - u, 1 / d->b);
+        return (v < d->c) ? v : d->c;
+    default:
+        return d->a;
+    }
+}
+
+/* rand01 - Uniform number in [0, 1) from the generator at seed */
+static double rand01(unsigned int *seed)
+{
+    return rand_r(seed) / ((double)RAND_MAX + 1);
+}
+
+/* hash01 - Uniform number in [0, 1) that depends only on s[0..n) */
+static double hash01(char *s, size_t n)
+{
+    unsigned long h = 14695981039346656037UL;       /* FNV-1a */
+
+    while (n--)
+        h = (h ^ (unsigned char)*s++) * 1099511628211UL;
+    h ^= h >> 33;                       /* Spread the last bytes' effect */
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    return (h >> 11) / 9007199254740992.0;           /* 2^53 */
+}
+
+/* route_init - Give r its prefix and every key its default */
+static void route_init(route_t *r, char *prefix)
+{
+    memset(r, 0, sizeof(*r));
+    snprintf(r->prefix, sizeof(r->prefix), "%s", prefix);
+    r->prefixlen = strlen(r->prefix);
+    r->size.a = 1024;
+    r->status = 200;
+    r->chunk = 4096;
+}
+
+/* route_set - Set key to value in r; returns 0, or -1 if either is bad */
+static int route_set(route_t *r, char *key, char *value)
+{
+    char *colon;
+
+    if (!strcmp(key, "size"))
+        return dist_parse(value, &r->size);
+    if (!strcmp(key, "delay"))
+        return dist_parse(value, &r->delay);
+    if (!strcmp(key, "status"))
+        return ((r->status = atoi(value)) >= 200 && r->status <= 599) ? 0 : -1;
+    if (!strcmp(key, "chunk"))
+        return ((r->chunk = strtoul(value, NULL, 10)) > 0) ? 0 : -1;
+    if (!strcmp(key, "cache"))
+        return (snprintf(r->cache, sizeof(r->cache), "%s", value)
+                < (int)sizeof(r->cache)) ? 0 : -1;
+    if (!strcmp(key, "framing")) {
+        if (!strcmp(value, "length"))
+            r->framing = FRAME_LENGTH;
+        else if (!strcmp(value, "chunked"))
+            r->framing = FRAME_CHUNKED;
+        else if (!strcmp(value, "close"))
+            r->framing = FRAME_CLOSE;
+        else
+            return -1;
+        return 0;
+    }
+    if (!strcmp(key, "error"))
+        return ((r->error = atof(value)) >= 0) ? 0 : -1;
+    if (!strcmp(key, "reset"))
+        return ((r->reset = atof(value)) >= 0) ? 0 : -1;
+    if (!strcmp(key, "truncate"))
+        return ((r->truncate = atof(value)) >= 0) ? 0 : -1;
+    if (!strcmp(key, "headcut"))
+        return ((r->headcut = atof(value)) >= 0) ? 0 : -1;
+    if (!strcmp(key, "stall")) {
+        if (!(colon = strchr(value, ':')))
+            return -1;
+        *colon = '\0';
+        r->stall = atof(value);
+        return dist_parse(colon + 1, &r->stalltime);
+    }
+    return -1;
+}
+
+/* read_scenario - Load the routes in file */
+static void read_scenario(char *file)
+{
+    FILE *fp;
+    char line[MAXLINE], *tok, *eq, *save;
+    int lineno = 0;
+    route_t *r;
+
+    if (!(fp = fopen(file, "r"))) {
+        fprintf(stderr, "origin: %s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if (!(tok = strtok_r(line, " \t\r\n", &save)) || tok[0] == '#')
+            continue;
+        if (tok[0] != '/' || strlen(tok) >= ORG_MAXSTR
+                || nroutes == ORG_MAXROUTES) {
+            fprintf(stderr, "origin: %s:%d: bad route %s\n", file, lineno, tok);
+            exit(1);
+        }
+        r = &routes[nroutes++];
+        route_init(r, tok);
+        while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+            if (!(eq = strchr(tok, '=')))
+                eq = tok + strlen(tok);
+            else
+                *eq++ = '\0';
+            if (route_set(r, tok, eq) < 0) {
+                fprintf(stderr, "origin: %s:%d: bad %s=%s\n",
+                        file, lineno, tok, eq);
+                exit(1);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+/* route_find - The route with the longest prefix of path[0..n) */
+static route_t *route_find(char *path, size_t n)
+{
+    int i;
+    route_t *best = NULL;
+
+    for (i = 0; i < nroutes; i++)
+        if (routes[i].prefixlen <= n
+                && !strncmp(path, routes[i].prefix, routes[i].prefixlen)
+                && (!best || routes[i].prefixlen > best->prefixlen))
+            best = &routes[i];
+    return best ? best : &defroute;
+}
+
+/* reset_conn - Make the close of fd send a RST rather than a FIN */
+static void reset_conn(int fd)
+{
+    struct linger lg = { 1, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+}
+
+/*
+ * send_body - Write n bytes of body to fd, chunked if r says so,
+ *     pausing for stall us when half of it has gone (if stall > 0) or
+ *     giving up there (if cut). Returns 0, or -1 if fd failed or the
+ *     body was cut.
+ */
+static int send_body(int fd, route_t *r, size_t n, long stall, int cut)
+{
+    char line[32];
+    size_t sent = 0, m, half = n / 2;
+    int len;
+
+    while (sent < n) {
+        m = n - sent;
+        if (r->framing == FRAME_CHUNKED && m > r->chunk)
+            m = r->chunk;
+        if (m > ORG_PATTERN)
+            m = ORG_PATTERN;
+        if (sent < half && sent + m > half)
+            m = half - sent;
+        if (sent == half && n > 0) {
+            if (cut)
+                return -1;
+            if (stall > 0)
+                usleep(stall);
+        }
+        if (r->framing == FRAME_CHUNKED) {
+            len = sprintf(line, "%zx\r\n", m);
+            if (rio_writen(fd, line, len) < 0)
+                return -1;
+        }
+        if (rio_writen(fd, pattern + sent % 26, m) < 0)
+            return -1;
+        if (r->framing == FRAME_CHUNKED && rio_writen(fd, "\r\n", 2) < 0)
+            return -1;
+        sent += m;
+    }
+    if (r->framing == FRAME_CHUNKED && rio_writen(fd, "0\r\n\r\n", 5) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * respond - Answer the request for path[0..n) on fd as its route says.
+ *     Returns 1 if the connection can carry on, else 0.
+ */
+static int respond(int fd, char *path, size_t n, int keep, unsigned int *seed)
+{
+    char head[MAXBUF];
+    route_t *r = route_find(path, n);
+    size_t size = (size_t)dist_sample(&r->size, hash01(path, n));
+    long delay = (long)dist_sample(&r->delay, rand01(seed)), stall = 0;
+    int status = r->status, cut = 0, len;
+
+    if (delay > 0)
+        usleep(delay);
+    if (rand01(seed) < r->reset) {
+        reset_conn(fd);
+        return 0;
+    }
+    if (rand01(seed) < r->error) {
+        len = sprintf(head, "HTTP/1.1 503 Service Unavailable\r\n"
+                "Content-Length: 0\r\n%s\r\n",
+                keep ? "" : "Connection: close\r\n");
+        return rio_writen(fd, head, len) == len && keep;
+    }
+    cut = rand01(seed) < r->truncate;
+    if (rand01(seed) < r->stall)
+        stall = (long)dist_sample(&r->stalltime, rand01(seed));
+    if (r->framing == FRAME_CLOSE)
+        keep = 0;
+    if (status == 204 || status == 304)
+        size = 0;
+
+    len = sprintf(head, "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\n",
+            status, (status == 200) ? "OK" : "Status");
+    if (r->framing == FRAME_LENGTH)
+        len += sprintf(head + len, "Content-Length: %zu\r\n", size);
+    else if (r->framing == FRAME_CHUNKED)
+        len += sprintf(head + len, "Transfer-Encoding: chunked\r\n");
+    if (r->cache[0])
+        len += snprintf(head + len, sizeof(head) - len, "Cache-Control: %s\r\n",
+                r->cache);
+    len += snprintf(head + len, sizeof(head) - len, "%s\r\n",
+            keep ? "" : "Connection: close\r\n");
+    if (rand01(seed) < r->headcut) {
+        rio_writen(fd, head, len / 2);
+        return 0;
+    }
+    if (rio_writen(fd, head, len) < 0 || send_body(fd, r, size, stall, cut) < 0)
+        return 0;
+    return keep;
+}
+
+/*
+ * serve - Answer requests on fd until the client or a response closes
+ *     the connection
+ */
+static void serve(int fd, unsigned int *seed)
+{
+    char buf[MAXBUF];
+    ssize_t n;
+    rio_t rio;
+    http_req_t rq;
+    http_hdr_t *h;
+    int keep;
+
+    Rio_readinitb(&rio, fd);
+    while ((n = http_read_head(&rio, buf, sizeof(buf))) > 0) {
+        if (http_req_parse(buf, n, &rq) < 0)
+            return;
+        h = http_hdr_find(rq.hdrs, rq.nhdrs, HTTP_H_CONNECTION);
+        keep = h ? (rq.minor >= 1 ? !http_hasval(h->value, h->vallen, "close")
+                : http_hasval(h->value, h->vallen, "keep-alive"))
+            : (rq.minor >= 1);
+        if (!respond(fd, rq.uri, rq.urilen, keep, seed))
+            return;
+    }
+}
+
+/* thread - Serve the connection whose descriptor vargp points to */
+static void *thread(void *vargp)
+{
+    int connfd = *((int *)vargp);
+    unsigned int seed = connfd * 2654435761U + (unsigned int)pthread_self();
+    int one = 1;
+
+    Pthread_detach(pthread_self());
+    Free(vargp);
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    serve(connfd, &seed);
+    Close(connfd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, listenfd, *connfdp;
+    size_t i;
+    pthread_t tid;
+
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        if (opt != 'f')
+            break;
+        read_scenario(optarg);
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-f scenario] <port>\n", argv[0]);
+        exit(1);
+    }
+    route_init(&defroute, "/");
+    for (i = 0; i < sizeof(pattern); i++)
+        pattern[i] = 'a' + i % 26;
+    Signal(SIGPIPE, SIG_IGN);
+
+    listenfd = Open_listenfd(argv[optind]);
+    while (1) {
+        connfdp = Malloc(sizeof(int));
+        *connfdp = Accept(listenfd, NULL, NULL);
+        Pthread_create(&tid, NULL, thread, connfdp);
+    }
+}
@@ -0,0 +1,154 @@
+/*
+ * park.c - Idle client connections of the threaded front end
+ *
+ * Parked connections sit in an epoll set and, under one mutex, on a
+ * list in the order they were parked, which the watcher trims from the
+ * front to enforce the idle timeout. The list is threaded through a
+ * table indexed by descriptor, so parking allocates nothing. A parked
+ * connection's rio buffer was empty when it was parked (the worker
+ * serves pipelined requests before parking), so nothing is lost by
+ * handing the bare descriptor back through the sbuf; only the count
+ * of requests it has carried is kept here for the worker that resumes
+ * it.
+ *
+ * The watcher puts readable connections back with sbuf_insert, so when
+ * every worker is busy and the queue full it waits there; the acceptor
+ * sheds new connections meanwhile, and a client already being served
+ * is not turned away.
+ */
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "park.h"
+#include "proxy.h"
+
+#define PARK_MAXCONNS (1 << 20)  /* Most descriptors a table covers */
+#define PARK_MAXEVENTS 64
+#define PARK_TICK 1000           /* ms between idle timeout sweeps */
+
+static void *park_watch(void *vargp);
+
+/* park_unlink - Take fd off the parked list; caller holds pk->lock */
+static void park_unlink(park_t *pk, int fd)
+{
+    park_conn_t *pc = &pk->conns[fd];
+
+    if (pc->prev >= 0)
+        pk->conns[pc->prev].next = pc->next;
+    else
+        pk->head = pc->next;
+    if (pc->next >= 0)
+        pk->conns[pc->next].prev = pc->prev;
+    else
+        pk->tail = pc->prev;
+}
+
+/*
+ * park_init - Set up pk to hand connections back through sp and start
+ *     its watcher thread, pinned to cpu (unless it is -1).
+ */
+void park_init(park_t *pk, sbuf_t *sp, int cpu)
+{
+    pthread_t tid;
+    struct rlimit rl;
+
+    pk->nconns = PARK_MAXCONNS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < PARK_MAXCONNS)
+        pk->nconns = rl.rlim_cur;
+    pk->conns = Calloc(pk->nconns, sizeof(park_conn_t));
+    pk->head = pk->tail = -1;
+    pk->sbuf = sp;
+    pk->cpu = cpu;
+    if ((pk->epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    pthread_mutex_init(&pk->lock, NULL);
+    Pthread_create(&tid, NULL, park_watch, pk);
+}
+
+/*
+ * park_put - Park idle connection fd, which has carried nreq requests.
+ *     Returns 0 if it was parked, or -1 if it could not be and is
+ *     still the caller's.
+ */
+int park_put(park_t *pk, int fd, int nreq)
+{
+    park_conn_t *pc;
+    struct epoll_event ev;
+
+    if (fd >= pk->nconns)
+        return -1;
+    pc = &pk->conns[fd];
+    pc->since = time(NULL);
+    pc->nreq = nreq;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    /* Linked under the lock, so the watcher cannot see it half parked */
+    pthread_mutex_lock(&pk->lock);
+    if (epoll_ctl(pk->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        pthread_mutex_unlock(&pk->lock);
+        pc->nreq = 0;
+        return -1;
+    }
+    pc->prev = pk->tail;
+    pc->next = -1;
+    if (pk->tail >= 0)
+        pk->conns[pk->tail].next = fd;
+    else
+        pk->head = fd;
+    pk->tail = fd;
+    pthread_mutex_unlock(&pk->lock);
+    return 0;
+}
+
+/*
+ * park_requests - Return how many requests connection fd carried
+ *     before it was last parked, 0 for a new connection, and forget it.
+ */
+int park_requests(park_t *pk, int fd)
+{
+    int nreq;
+
+    if (fd >= pk->nconns)
+        return 0;
+    nreq = pk->conns[fd].nreq;
+    pk->conns[fd].nreq = 0;
+    return nreq;
+}
+
+/* park_watch - Watcher thread: resume readable connections, expire idle ones */
+static void *park_watch(void *vargp)
+{
+    park_t *pk = vargp;
+    int i, n, fd;
+    time_t now;
+    struct epoll_event events[PARK_MAXEVENTS];
+
+    Pthread_detach(pthread_self());
+    pin_thread(pk->cpu);
+    while (1) {
+        if ((n = epoll_wait(pk->epfd, events, PARK_MAXEVENTS, PARK_TICK)) < 0) {
+            if (errno != EINTR)
+                unix_error("epoll_wait error");
+            n = 0;
+        }
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+            pthread_mutex_lock(&pk->lock);
+            park_unlink(pk, fd);
+            epoll_ctl(pk->epfd, EPOLL_CTL_DEL, fd, NULL);
+            pthread_mutex_unlock(&pk->lock);
+            sbuf_insert(pk->sbuf, fd);
+        }
+
+        now = time(NULL);
+        pthread_mutex_lock(&pk->lock);
+        while ((fd = pk->head) >= 0
+                && now - pk->conns[fd].since >= client_idle_timeout) {
+            park_unlink(pk, fd);
+            pk->conns[fd].nreq = 0;
+            Close(fd);          /* Which also drops it from the epoll set */
+        }
+        pthread_mutex_unlock(&pk->lock);
+    }
+    return NULL;
+}
@@ -0,0 +1,39 @@
+/*
+ * park.h - Idle client connections of the threaded front end
+ *
+ * A worker that has answered a request on a persistent connection and
+ * finds no next request arriving parks the connection here instead of
+ * blocking in recv for up to client_idle_timeout. One watcher thread
+ * per shard waits on everything parked with epoll, queues a connection
+ * that turns readable back on the shard's sbuf for the next free
+ * worker, and closes those idle for client_idle_timeout seconds. An
+ * idle client so holds a descriptor, not a worker.
+ */
+#ifndef __PARK_H__
+#define __PARK_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+
+/* A parked connection; park_t has one slot per possible descriptor */
+typedef struct {
+    time_t since;            /* When it was parked */
+    int nreq;                /* Requests it has carried so far */
+    int prev, next;          /* In the parked list, oldest first; -1 ends */
+} park_conn_t;
+
+typedef struct {
+    int epfd;
+    int cpu;                 /* Core the watcher runs on, or -1 */
+    sbuf_t *sbuf;            /* Where readable connections go back to */
+    int nconns;              /* Slots in conns */
+    park_conn_t *conns;      /* Indexed by descriptor */
+    int head, tail;          /* Parked list, oldest first; -1 if empty */
+    pthread_mutex_t lock;    /* Protects the parked list */
+} park_t;
+
+void park_init(park_t *pk, sbuf_t *sp, int cpu);
+int park_put(park_t *pk, int fd, int nreq);
+int park_requests(park_t *pk, int fd);
+
+#endif /* __PARK_H__ */
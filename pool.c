@@ -0,0 +1,224 @@
+/*
+ * pool.c - Idle keep-alive connections to origin servers
+ *
+ * Idle connections sit on two lists under one mutex: their origin's
+ * list, newest first, which pool_get takes from, and a list of all of
+ * them, oldest last, which pool_put trims to enforce the idle timeout
+ * and pool_max_idle. Origins are found through a small hash table and
+ * forgotten when their last idle connection goes.
+ *
+ * An idle connection that has become readable has either been closed
+ * by the origin or sent something unasked for; pool_get drops those.
+ * The origin can still close a connection just as we reuse it, so the
+ * caller retries once on a fresh connection when a reused one fails
+ * before any response arrives.
+ */
+#include <poll.h>
+#include "pool.h"
+#include "dns.h"
+
+#define POOL_BUCKETS 64          /* Must be a power of two */
+#define POOL_KEYLEN (NI_MAXHOST + NI_MAXSERV + 1) /* "host:port" */
+
+typedef struct pool_origin pool_origin_t;
+
+typedef struct pool_conn {
+    int fd;
+    time_t since;                /* When it went idle */
+    pool_origin_t *origin;
+    struct pool_conn *onext;     /* In origin->idle, newest first */
+    struct pool_conn *prev, *next; /* In the pool-wide list, newest first */
+} pool_conn_t;
+
+struct pool_origin {
+    char *key;                   /* host:port */
+    unsigned hash;
+    pool_conn_t *idle;
+    int nidle;
+    struct pool_origin *next;    /* In its bucket */
+};
+
+int pool_max_idle = POOL_MAX_IDLE;
+int pool_max_per_host = POOL_MAX_PER_HOST;
+int pool_idle_timeout = POOL_IDLE_TIMEOUT;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_origin_t *pool_buckets[POOL_BUCKETS];
+static pool_conn_t *pool_head, *pool_tail;
+static int pool_nidle;
+
+/* pool_key - Build "host:port" in key and return its FNV-1a hash */
+static unsigned pool_key(char *key, size_t maxlen, char *host, char *port)
+{
+    unsigned h = 2166136261u;
+    char *p;
+
+    snprintf(key, maxlen, "%s:%s", host, port);
+    for (p = key; *p; p++)
+        h = (h ^ (unsigned char)tolower((unsigned char)*p)) * 16777619u;
+    return h;
+}
+
+/* pool_find - Look up the origin for key, creating it if create is set */
+static pool_origin_t *pool_find(char *key, unsigned hash, int create)
+{
+    pool_origin_t *op, **bp = &pool_buckets[hash & (POOL_BUCKETS - 1)];
+
+    for (op = *bp; op; op = op->next)
+        if (op->hash == hash && !strcasecmp(op->key, key))
+            return op;
+    if (!create)
+        return NULL;
+    op = Calloc(1, sizeof(pool_origin_t));
+    op->key = Malloc(strlen(key) + 1);
+    strcpy(op->key, key);
+    op->hash = hash;
+    op->next = *bp;
+    *bp = op;
+    return op;
+}
+
+/* pool_remove - Take pc off both lists, freeing its origin if now empty.
+ *     Returns pc->fd; the caller either uses or closes it. */
+static int pool_remove(pool_conn_t *pc)
+{
+    int fd = pc->fd;
+    pool_origin_t *op = pc->origin, **opp;
+    pool_conn_t **pp;
+
+    for (pp = &op->idle; *pp != pc; pp = &(*pp)->onext)
+        ;
+    *pp = pc->onext;
+    if (--op->nidle == 0) {
+        for (opp = &pool_buckets[op->hash & (POOL_BUCKETS - 1)]; *opp != op;
+                opp = &(*opp)->next)
+            ;
+        *opp = op->next;
+        Free(op->key);
+        Free(op);
+    }
+
+    if (pc->prev)
+        pc->prev->next = pc->next;
+    else
+        pool_head = pc->next;
+    if (pc->next)
+        pc->next->prev = pc->prev;
+    else
+        pool_tail = pc->prev;
+    pool_nidle--;
+    Free(pc);
+    return fd;
+}
+
+/* pool_expire - Close connections idle for too long. Call with the lock */
+static void pool_expire(time_t now)
+{
+    while (pool_tail && now - pool_tail->since >= pool_idle_timeout)
+        close(pool_remove(pool_tail));
+}
+
+/* pool_alive - Is an idle connection still quietly open? */
+static int pool_alive(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/*
+ * pool_get - Take an idle connection to host:port out of the pool.
+ *     Returns -1 if there is none.
+ */
+int pool_get(char *host, char *port)
+{
+    char key[POOL_KEYLEN];
+    unsigned hash;
+    int fd;
+    pool_origin_t *op;
+
+    if (pool_max_idle <= 0)
+        return -1;
+    hash = pool_key(key, sizeof(key), host, port);
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        pool_expire(time(NULL));
+        if (!(op = pool_find(key, hash, 0))) {
+            pthread_mutex_unlock(&pool_lock);
+            return -1;
+        }
+        fd = pool_remove(op->idle);
+        pthread_mutex_unlock(&pool_lock);
+        if (pool_alive(fd))
+            return fd;
+        close(fd);
+    }
+}
+
+/*
+ * pool_put - Park fd, a connection to host:port with no response
+ *     outstanding, for reuse. Closes it instead if the pool is off or
+ *     the origin already has pool_max_per_host idle connections; makes
+ *     room by closing the oldest idle connection if the pool is full.
+ */
+void pool_put(char *host, char *port, int fd)
+{
+    char key[POOL_KEYLEN];
+    unsigned hash;
+    time_t now = time(NULL);
+    pool_origin_t *op;
+    pool_conn_t *pc;
+
+    if (pool_max_idle <= 0) {
+        close(fd);
+        return;
+    }
+    hash = pool_key(key, sizeof(key), host, port);
+
+    pthread_mutex_lock(&pool_lock);
+    pool_expire(now);
+    if ((op = pool_find(key, hash, 0)) && op->nidle >= pool_max_per_host) {
+        pthread_mutex_unlock(&pool_lock);
+        close(fd);
+        return;
+    }
+    if (pool_nidle >= pool_max_idle)
+        close(pool_remove(pool_tail));  /* May free op */
+    op = pool_find(key, hash, 1);
+
+    pc = Malloc(sizeof(pool_conn_t));
+    pc->fd = fd;
+    pc->since = now;
+    pc->origin = op;
+    pc->onext = op->idle;
+    op->idle = pc;
+    op->nidle++;
+    pc->prev = NULL;
+    pc->next = pool_head;
+    if (pool_head)
+        pool_head->prev = pc;
+    else
+        pool_tail = pc;
+    pool_head = pc;
+    pool_nidle++;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * pool_connect - Return a connection to host:port, from the pool if
+ *     possible, else a new one. *reused says which. Returns -1 with
+ *     errno set if a new connection could not be opened.
+ */
+int pool_connect(char *host, char *port, int *reused)
+{
+    int fd;
+
+    if ((fd = pool_get(host, port)) >= 0) {
+        *reused = 1;
+        return fd;
+    }
+    *reused = 0;
+    return dns_open_clientfd(host, port);
+}
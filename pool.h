@@ -0,0 +1,30 @@
+/*
+ * pool.h - Idle keep-alive connections to origin servers
+ *
+ * After a response that leaves its origin connection reusable, the
+ * connection is parked here under its host:port instead of being
+ * closed, and the next request for that origin picks it up, saving
+ * the lookup and the TCP handshake. Limits (set with -k):
+ *
+ *   pool_max_idle      idle connections kept in all
+ *   pool_max_per_host  idle connections kept per host:port
+ *   pool_idle_timeout  seconds an idle connection is kept
+ *
+ * A pool_max_idle of 0 turns pooling off.
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+
+#define POOL_MAX_IDLE 64
+#define POOL_MAX_PER_HOST 8
+#define POOL_IDLE_TIMEOUT 15
+
+extern int pool_max_idle, pool_max_per_host, pool_idle_timeout;
+
+int pool_get(char *host, char *port);
+void pool_put(char *host, char *port, int fd);
+int pool_connect(char *host, char *port, int *reused);
+
+#endif /* __POOL_H__ */
@@ -9,9 +9,37 @@
  *    1. Accept connections and parses requests back to clients. 
  *    PS: This works for all http connections. 
  *    2. Handles multiple concurrent connections using the 
- *    Pthread POSIX Library. Each client request is spawned into
- *    a new thread. 
- *    3. Caches some object using a Most Recently Used List
+ *    Pthread POSIX Library. A fixed pool of worker threads is
+ *    spawned at startup and fed accepted connections through a
+ *    bounded queue (sbuf). When the queue is full the acceptor
+ *    answers 503 itself, so memory and thread count stay flat
+ *    under overload. 
+ *    With -e, a handful of epoll event loops (event.c) carry all
+ *    connections instead, so slow origins do not pin threads.
+ *    With -a N, N SO_REUSEPORT listeners are opened, each with its
+ *    own accept loop and workers pinned to one core, so the kernel
+ *    spreads connection setup across CPUs.
+ *    With -u, worker threads relay responses through io_uring
+ *    (uring.c) when the kernel supports it, and Rio otherwise.
+ *    Origins are spoken to in HTTP/1.1 and their connections kept
+ *    in a keep-alive pool (pool.c) between requests; responses are
+ *    delimited by their framing (http.c) rather than by the origin
+ *    closing. Client connections persist too, within an idle timeout
+ *    and a cap on requests set by -c, whenever the response tells the
+ *    client where it ends; pipelined requests are served in order.
+ *    Between requests a worker parks an idle client connection
+ *    (park.c) rather than waiting on it, so idle clients do not keep
+ *    workers from the queue.
+ *    Origin names are looked up through a caching resolver (dns.c)
+ *    rather than getaddrinfo on every request; -D names the nameserver
+ *    and -H a hosts file.
+ *    3. Caches web objects of up to MAX_OBJECT_SIZE bytes, at most
+ *    MAX_CACHE_SIZE in total, evicting the least recently used
+ *    (cache.c). Hits are served from memory without contacting the
+ *    origin, and concurrent hits only share a read lock.
+ *    Responses that are not being cached are spliced from origin to
+ *    client inside the kernel (splice.c); kill -USR1 reports how many
+ *    bytes took that path.
  *
  *    ============
  *    Handling Bad Input for Robustness and Resiliency
@@ -27,7 +55,6 @@
  *    ============
  *    Things that are not working
  *    ============
- *    - Server does not have caching enabled. This was still on my todo list
  *    - Some http images such as revolving banners do not get loaded.
  *    Ex: http://www.cs.cmu.edu  The Top Banner. 
  *    Direct urls of these banners show up though
@@ -36,207 +63,930 @@
  */
 
 #include <stdio.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
+#include "proxy.h"
+#include "sbuf.h"
+#include "park.h"
+#include "event.h"
+#include "uring.h"
+#include "cache.h"
+#include "evict.h"
+#include "iobuf.h"
+#include "splice.h"
+#include "http.h"
+#include "pool.h"
+#include "dns.h"
+#include "stats.h"
+#include "alog.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_PORT_SIZE 6 
+/* Default worker pool size and connection queue depth */
+#define NTHREADS 16
+#define SBUFSIZE 64
+#define ACCEPT_BACKOFF_MS 10        /* Retry delay when out of descriptors */
+#define PARK_GRACE_MS 10            /* Wait for a next request before parking */
+
+/* Persistent client connections: idle timeout and requests per connection */
+int client_idle_timeout = CLIENT_IDLE_TIMEOUT;
+int client_max_requests = CLIENT_MAX_REQUESTS;
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\n";
 
-void doit(int clientfd);
-void build_get(char *http_hdr, char * method, char *path, char *version); 
-void build_requesthdrs(rio_t *rpi, char *http_hdr, char *host); 
-void read_n_send(int serverfd, int clientfd, rio_t *rio);
-void parse_uri(char *uri, char *host, char *port, char *path);
-void clienterror(int fd, char *cause, char *errnum, 
-        char *shortmsg, char *longmsg);
+/*
+ * One acceptor shard: a listening socket, its accept loop and the
+ * workers (or event loops) fed by it. Without -a there is a single
+ * unpinned shard; with -a each shard has its own SO_REUSEPORT listener
+ * and all of its threads are pinned to one core.
+ */
+typedef struct {
+    int listenfd;
+    int cpu;         /* Core this shard's threads run on, or -1 */
+    sbuf_t sbuf;     /* Shared buffer of connected descriptors */
+    park_t park;     /* Its idle connections, if client_idle_timeout > 0 */
+} shard_t;
+
+void *acceptor(void *vargp);
 void *thread(void *vargp);
+static int serve(shard_t *sp, int connfd);
+static int respond(int clientfd, request_t *r);
+static int follow(int clientfd, cache_flight_t *fl, request_t *r);
+static void upreq_add(upreq_t *up, void *s, size_t n);
+static int relay_write(int *clientfd, cache_flight_t *fl, char *buf, size_t n);
 
+/* Built with -DPROXY_NO_MAIN for programs that call into the proxy */
+#ifndef PROXY_NO_MAIN
 int main(int argc, char **argv) 
 {
-    int listenfd, *connfdp;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int i, j, opt, ncpus;
+    int nthreads = NTHREADS, sbufsize = SBUFSIZE, nloops = 0, nshards = 0;
+    int logfd = STDOUT_FILENO;
+    char *nameserver = NULL, *hostsfile = NULL;
+    evict_policy_t *policy = evict_policy(NULL);
+    shard_t *shards, *sp;
     pthread_t tid; /* Thread ID for concurrent threads */ 
+    pthread_attr_t attr;
 
     /* Blocking SIGPIPE Signal */
     Signal(SIGPIPE, SIG_IGN);
+    /* kill -USR1 reports how many bytes went through splice */
+    Signal(SIGUSR1, splice_report);
 
     /* Default code */
     printf("%s\n", user_agent_hdr); 
 
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "t:q:e:a:uk:c:D:H:l:p:")) != -1) {
+        switch (opt) {
+        case 'p':
+            if (!(policy = evict_policy(optarg)))
+                nthreads = 0;
+            break;
+        case 'l':
+            logfd = Open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+            break;
+        case 'D':
+            nameserver = optarg;
+            break;
+        case 'H':
+            hostsfile = optarg;
+            break;
+        case 'c':
+            sscanf(optarg, "%d,%d", &client_idle_timeout,
+                    &client_max_requests);
+            break;
+        case 'k':
+            sscanf(optarg, "%d,%d,%d", &pool_max_idle, &pool_max_per_host,
+                    &pool_idle_timeout);
+            break;
+        case 'u':
+            uring_enabled = 1;
+            break;
+        case 'a':
+            nshards = atoi(optarg);
+            if (nshards <= 0)
+                nthreads = 0;
+            break;
+        case 'e':
+            nloops = atoi(optarg);
+            if (nloops <= 0)
+                nthreads = 0;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'q':
+            sbufsize = atoi(optarg);
+            break;
+        default:
+            nthreads = 0;
+        }
+    }
+    if (optind != argc - 1 || nthreads <= 0 || sbufsize <= 0) {
+        fprintf(stderr, "usage: %s [-t threads] [-q queue depth] "
+                "[-e event loops] [-a acceptors] [-u]\n"
+                "       [-k max idle[,per host[,idle timeout]]]\n"
+                "       [-c idle timeout[,max requests]]\n"
+                "       [-D nameserver[:port]] [-H hosts file]"
+                " [-l access log]\n"
+                "       [-p lru|tinylfu|s3fifo|gdsf] <port>\n",
+                argv[0]);
         exit(1);
     }
+    if (client_idle_timeout <= 0)   /* -c 0: one request per connection */
+        client_max_requests = 1;
+
+    stats_init();
+    alog_init(logfd);
+    cache_init(policy, MAX_CACHE_SIZE);
+    dns_init(nameserver, hostsfile);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+
+    /* Open every listener before starting any thread */
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    shards = Calloc(nshards ? nshards : 1, sizeof(shard_t));
+    if (nshards == 0) {
+        shards[0].listenfd = Open_listenfd(argv[optind]);
+        shards[0].cpu = -1;
+        nshards = 1;
+    }
+    else {
+        for (i = 0; i < nshards; i++) {
+            shards[i].listenfd = Open_listenfd_reuseport(argv[optind]);
+            shards[i].cpu = i % ncpus;
+        }
+    }
+
+    for (i = 0; i < nshards; i++) {
+        sp = &shards[i];
+        if (nloops > 0) {
+            event_run(sp->listenfd, nloops, sp->cpu);
+            continue;
+        }
+        sbuf_init(&sp->sbuf, sbufsize);
+        if (client_idle_timeout > 0)
+            park_init(&sp->park, &sp->sbuf, sp->cpu);
+        for (j = 0; j < nthreads; j++)  /* Create worker threads */
+            Pthread_create(&tid, &attr, thread, sp);
+        Pthread_create(&tid, &attr, acceptor, sp);
+    }
+    Pthread_exit(NULL);     /* Shards keep running without main */
+}
+#endif /* PROXY_NO_MAIN */
+
+/*
+ * pin_thread - Bind the calling thread to one core. Raw syscall, as
+ *  the glibc wrapper needs _GNU_SOURCE, which clashes with csapp.h.
+ */
+void pin_thread(int cpu)
+{
+    unsigned long mask[16];
+
+    if (cpu < 0 || cpu >= (int)(8 * sizeof(mask)))
+        return;
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / (8 * sizeof(long))] = 1UL << (cpu % (8 * sizeof(long)));
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)
+        fprintf(stderr, "sched_setaffinity error: %s\n", strerror(errno));
+}
+
+/*
+ * client_nodelay - Turn off Nagle on an accepted client connection, so
+ *     the last segment of a response is not held back waiting for the
+ *     client to ACK the rest, which it delays while it has nothing to send
+ */
+void client_nodelay(int fd)
+{
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * accept_shed - accept() on listenfd has just failed. If that was for
+ *     want of descriptors, close the connection at the head of the
+ *     queue unserved, using the descriptor held in reserve in *spare
+ *     (-1 if there is none), so that the listener does not stay ready
+ *     with nothing accepted, then take the reserve back. Returns 1 if
+ *     a connection was shed, else 0.
+ */
+int accept_shed(int listenfd, int *spare)
+{
+    int fd;
+
+    if (errno != EMFILE && errno != ENFILE)
+        return 0;
+    if (*spare < 0 && (*spare = open("/dev/null", O_RDONLY)) < 0)
+        return 0;
+    Close(*spare);
+    if ((fd = accept(listenfd, NULL, NULL)) >= 0) {
+        Close(fd);
+        stats_add(STATS_ACCEPT_SHED, 1);
+    }
+    *spare = open("/dev/null", O_RDONLY);
+    return fd >= 0;
+}
+
+/* acceptor routine - accept loop for one shard's listener */
+void *acceptor(void *vargp)
+{
+    shard_t *sp = vargp;
+    int connfd;
 
-    listenfd = Open_listenfd(argv[1]);
+    Pthread_detach(pthread_self()); 
+    pin_thread(sp->cpu);
     while (1) {
-        clientlen = sizeof(clientaddr);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen); 
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        Pthread_create(&tid, NULL, thread, connfdp);
+        if ((connfd = accept(sp->listenfd, NULL, NULL)) < 0) {
+            if (errno == EMFILE || errno == ENFILE)
+                /* Leave the rest queued until workers close some */
+                usleep(ACCEPT_BACKOFF_MS * 1000);
+            else if (errno != EINTR && errno != ECONNABORTED)
+                unix_error("Accept error");
+            continue;
+        }
+        client_nodelay(connfd);
+
+        /* Shed load rather than queueing without bound; the 503 is
+           best effort, as a client that does not read it must not
+           hold up accepting everyone else */
+        if (sbuf_tryinsert(&sp->sbuf, connfd) < 0) {
+            fcntl(connfd, F_SETFL, O_NONBLOCK);
+            clienterror(connfd, "", "503", "Service Unavailable",
+                    "Proxy Server is overloaded, try again later");
+            Close(connfd);
+        }
     }
+    return NULL;
 }
 
-/* thread routine */
+/* thread routine - worker that services connections from its shard */
 void *thread(void *vargp) 
 {  
-    int connfd = *((int *)vargp);
+    shard_t *sp = vargp;
+
     Pthread_detach(pthread_self()); 
-    Free(vargp);
-    doit(connfd);                                       //line:proxy:doit
-    Close(connfd);                                      //line:proxy:close
+    pin_thread(sp->cpu);
+    while (1) {
+        int connfd = sbuf_remove(&sp->sbuf);
+        if (!serve(sp, connfd))                         //line:proxy:doit
+            Close(connfd);                              //line:proxy:close
+    }
     return NULL;
 }
 /* $end echoservertmain */
 
+/*
+ * client_waiting - Wait up to ms milliseconds for fd to have something
+ *     to read. Returns 1 if it does, else 0.
+ */
+static int client_waiting(int fd, int ms)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, ms) > 0;
+}
 
 /*
- * doit - handle one HTTP request/response transaction
+ * serve - Handle requests on one client connection of shard sp until
+ *     the client or a response ends it, it has been idle for
+ *     client_idle_timeout seconds, or it has carried client_max_requests
+ *     requests. Requests the client pipelined are already waiting in
+ *     rio_c's buffer. A connection with no request on its way within
+ *     PARK_GRACE_MS, or at once if other connections are queued for a
+ *     worker, is parked (park.c) rather than waited for; returns 1 if
+ *     it was, and 0 if the caller is to close it.
  */
-/* $begin doit */
-void doit(int clientfd) 
+static int serve(shard_t *sp, int connfd)
 {
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char http_hdr[MAXLINE], host[MAXLINE], path[MAXLINE];
-    char port[MAX_PORT_SIZE]; 
+    int n, rc, grace, parked = 0;
+    park_t *pk = client_idle_timeout > 0 ? &sp->park : NULL;
+    int nreq = pk ? park_requests(pk, connfd) : 0;
+    rio_t rio_c;
+    arena_t a;
+    struct timeval tv;
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+    alog_peer_t peer;
+
+    /* A read that times out fails, and rio hands that back as -1; a
+       connection coming back from the park has it set already */
+    tv.tv_sec = client_idle_timeout;
+    tv.tv_usec = 0;
+    if (client_max_requests > 1 && nreq == 0)
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-    int serverfd; 
+    /* For the access log; the acceptor does not pass it on */
+    ss.ss_family = AF_UNSPEC;
+    getpeername(connfd, (SA *)&ss, &sslen);
+    alog_peer(&peer, (SA *)&ss);
 
-    rio_t rio_c, rio_s;
+    Rio_readinitb(&rio_c, connfd);
+    arena_init(&a);
+    for (n = nreq; n < client_max_requests; n++) {
+        if (pk && rio_c.rio_cnt == 0) {
+            grace = sbuf_waiting(&sp->sbuf) ? 0 : PARK_GRACE_MS;
+            if (!client_waiting(connfd, grace)
+                    && park_put(pk, connfd, n) == 0) {
+                parked = 1;
+                break;
+            }
+        }
+        rc = doit(connfd, &rio_c, &a, &peer);
+        arena_reset(&a);
+        if (!rc)
+            break;
+    }
+    arena_free(&a);
+    return parked;
+}
+
+
+/*
+ * doit - handle one HTTP request/response transaction on clientfd,
+ *  reading the request through rio_c into the connection's arena a,
+ *  and log it as coming from peer. Returns 1 if the connection can
+ *  carry another request, 0 if it has to be closed.
+ */
+/* $begin doit */
+int doit(int clientfd, rio_t *rio_c, arena_t *a, alog_peer_t *peer) 
+{
+    int keep;
+    unsigned long sent = stats_own(STATS_BYTES_OUT);
+    request_t *r = arena_alloc(a, sizeof(request_t));
 
     /* Read request line and headers */
-    Rio_readinitb(&rio_c, clientfd);
-    if (!Rio_readlineb(&rio_c, buf, MAXLINE)) 
-        return;
-    sscanf(buf, "%s %s %s", method, uri, version);   
-    strcpy(version, "HTTP/1.0");                    
+    request_init(r);
+    keep = read_request(rio_c, clientfd, a, r) == 0 && respond(clientfd, r);
+    r->sent = stats_own(STATS_BYTES_OUT) - sent;
+    access_log(peer, r);
+    return keep;
+}
+/* $end doit */
+
+/*
+ * respond - Answer request r from clientfd: from the cache, by following
+ *     another fetch of the same object, or from the origin. Returns 1 if
+ *     the connection can carry another request, 0 if it has to be closed.
+ */
+static int respond(int clientfd, request_t *r)
+{
+    char *host, *port;
+    char head[MAXBUF], out[2 * MAXBUF];
+
+    int serverfd, reused, rc, keep; 
+    ssize_t n, outlen;
+    long long t;
+
+    rio_t rio_s;
+    cache_obj_t *obj;
+    cache_flight_t *fl;
+    http_resp_t resp;
+    http_body_t body;
+
+    host = r->host;
+    port = r->port;
+    keep = r->keep;
+
+    /* Requests for the stats page are ours to answer */
+    if (stats_wanted(host, r->path)) {
+        r->status = 200;
+        stats_serve(clientfd);
+        return 0;
+    }
+
+    r->cache = 'M';
+    switch (cache_start(r->key, &obj, &fl, -1)) {
+    case CACHE_HIT:
+        /* Serve cache hits straight from memory */
+        r->cache = 'H';
+        r->status = http_resp_status(obj->bufs->data, obj->bufs->len);
+        if (iobuf_send(clientfd, obj->bufs) < 0)
+            keep = 0;
+        else {
+            stats_add(STATS_BYTES_OUT, obj->size);
+            stats_time(STATS_TOTAL, r->start);
+            keep = keep && http_resp_persists(obj->bufs->data, obj->bufs->len);
+        }
+        cache_release(obj);
+        return keep;
+    case CACHE_FOLLOW:
+        /* Someone is already fetching it; fetch it ourselves only if
+           they fail before we have sent anything */
+        r->cache = 'F';
+        if ((rc = follow(clientfd, fl, r)) >= 0) {
+            stats_time(STATS_TOTAL, r->start);
+            return keep && rc;
+        }
+        r->cache = 'M';
+        fl = NULL;
+        break;
+    }
+
+    /* Send the request, over a pooled connection to the origin if
+       there is one. A pooled connection that the origin has closed in
+       the meantime fails before any response arrives; retry on a new
+       connection then. */
+    do {
+        if ((serverfd = pool_connect(host, port, &reused)) < 0) {
+            cache_flight_finish(fl, 0);
+            request_error(r, clientfd, "GET", "400", "Bad Request",
+                    "Malformed URL");
+            return 0;
+        }
+        Rio_readinitb(&rio_s, serverfd);
+        n = 0;
+        if (upreq_send(serverfd, &r->up) == 0) {
+            t = stats_now();
+            if ((n = http_read_head(&rio_s, head, MAXBUF)) > 0)
+                stats_time(STATS_FIRST_BYTE, t);
+            /* Interim responses are dropped; the final one follows */
+            while (n > 0 && http_resp_interim(head, n)) {
+                stats_add(STATS_BYTES_IN, n);
+                if ((n = http_read_head(&rio_s, head, MAXBUF)) == 0)
+                    n = -1;     /* Not a pooled connection gone stale */
+            }
+            if (n > 0)
+                stats_add(STATS_BYTES_IN, n);
+        }
+        if (n <= 0)
+            Close(serverfd);
+    } while (n == 0 && reused);
+
+    /* Handling invalid response from upstream server */
+    if (n <= 0
+            || (outlen = http_resp_parse(head, n, &resp, out, sizeof(out))) < 0) {
+        if (n > 0)
+            Close(serverfd);
+        cache_flight_finish(fl, 0);
+        request_error(r, clientfd, "GET", "502", "Bad Gateway",
+                "Client not understood due to malformed syntax");
+        return 0;
+    }
+
+    /* Reads from server and sends to client, then keeps the connection
+       if the origin allows and the response ended where it said */
+    r->status = resp.status;
+    http_body_init(&body, &resp);
+    rc = -1;
+    t = stats_now();
+    if (relay_out(&clientfd, fl, out, outlen) == 0) {
+        if (uring_ready())
+            rc = uring_relay(serverfd, clientfd, &rio_s, &body, fl);
+        else
+            rc = read_n_send(serverfd, clientfd, &rio_s, &body, fl);
+    }
+    if (rc == 0) {
+        stats_time(STATS_BODY, t);
+        stats_time(STATS_TOTAL, r->start);
+    }
+    if (rc == 0 && resp.keepalive && !body.extra && rio_s.rio_cnt == 0)
+        pool_put(host, port, serverfd);
+    else
+        Close(serverfd);
+    return keep && rc == 0 && clientfd >= 0 && http_resp_persists(out, outlen);
+}
+
+/*
+ * follow - Relay another thread's fetch of the same object to clientfd,
+ *     noting the status it gets in r. Returns 1 if all of it was sent and the client connection can
+ *     carry on, 0 if it has to be closed, or -1 if that fetch failed
+ *     before anything was sent, in which case the caller should try
+ *     for itself.
+ */
+static int follow(int clientfd, cache_flight_t *fl, request_t *r)
+{
+    ssize_t n;
+    size_t sent = 0;
+    char *data;
+    int persists = 0;
+    cache_cursor_t cur = { NULL, 0, 0, NULL };
+
+    while ((n = cache_flight_next(fl, &cur, &data, 1)) > 0) {
+        if (sent == 0) {
+            persists = http_resp_persists(data, n);
+            r->status = http_resp_status(data, n);
+        }
+        if (rio_writen(clientfd, data, n) != n)
+            break;
+        stats_add(STATS_BYTES_OUT, n);
+        sent += n;
+    }
+    cache_flight_leave(fl, &cur);
+    if (n < 0 && sent == 0)
+        return -1;
+    return n == 0 && persists;
+}
+
+/*
+ * read_request - Read the request line and headers from rp into the
+ *  arena a, parse them into r and hand them to build_request. Blank
+ *  lines left between pipelined requests are skipped.
+ *
+ * Returns 0 on success. Returns -1 if there is nothing to forward,
+ * either because the client went away or because an error page has
+ * already been sent to clientfd.
+ */
+/* $begin read_request */
+int read_request(rio_t *rp, int clientfd, arena_t *a, request_t *r)
+{
+    char *buf = NULL, *line;
+    ssize_t n;
+    size_t len = 0;
+    int bol, at_bol = 1;        /* The last piece ended a line */
+
+    /* Long lines come in pieces: only one that starts a line can be
+       blank, and the rest of a line skipped goes too */
+    while ((n = rio_readlinep(rp, &line)) > 0) {
+        bol = at_bol;
+        at_bol = (line[n - 1] == '\n');
+        if (len == 0 && (!bol || *line == '\r' || *line == '\n'))
+            continue;
+        if (len + n > MAXLINE) {
+            request_error(r, clientfd, "GET", "400", "Bad Request",
+                    "Request header too large");
+            return -1;
+        }
+        buf = arena_grow(a, buf, len, len + n);
+        memcpy(buf + len, line, n);
+        len += n;
+        if (bol && at_bol && (n == 1 || (n == 2 && *line == '\r')))
+            break;
+    }
+    if (n <= 0)
+        return -1;
+    r->start = stats_now();
+    if (http_req_parse(buf, len, &r->hr) <= 0) {
+        request_error(r, clientfd, "GET", "400", "Bad Request",
+                "Request could not be parsed");
+        return -1;
+    }
+    if (build_request(r, clientfd, a) < 0)
+        return -1;
+    stats_time(STATS_PARSE, r->start);
+    return 0;
+}
+/* $end read_request */
+
+/*
+ * build_request - Build the request to forward upstream for the parsed
+ *  request r->hr into r->up, and find the origin and the object's cache
+ *  key, all in the arena a. r->up points into r->hr's buffer, which has
+ *  to stay put until the request has been sent.
+ *
+ * r->keep is set if the client wants its connection kept afterwards:
+ * HTTP/1.1 unless it says "Connection: close", HTTP/1.0 only if it
+ * says "Connection: keep-alive".
+ *
+ * Returns 0, or -1 if an error page has been sent to clientfd.
+ */
+/* $begin build_request */
+int build_request(request_t *r, int clientfd, arena_t *a)
+{
+    char *method, *uri, *path;
+    size_t plen;
+    http_req_t *rq = &r->hr;
+    upreq_t *up = &r->up;
+
+    method = arena_strndup(a, rq->method, rq->methodlen);
+    uri = arena_strndup(a, rq->uri, rq->urilen);
+    r->keep = (rq->minor >= 1);
     if (strcasecmp(method, "GET")) {         
-        clienterror(clientfd, method, "501", "Not Implemented",
+        request_error(r, clientfd, method, "501", "Not Implemented",
                 "Proxy Server does not implement this method");
-        return;
+        return -1;
     }                                       
 
-    /* Parse URL into host, path, port  */
-    parse_uri(uri, host, port, path);     
-    /* Form new HTTP Request and send it to server */ 
-    build_get(http_hdr, method, path, version);
-    build_requesthdrs(&rio_c, http_hdr, host); 
-    printf("%s", http_hdr);
-
-    /* Open Connection to Server. */ 
-    if((serverfd = open_clientfd(host, port)) < 0) {
-        clienterror(clientfd, method, "400", "Bad Request",
-                "Malformed URL");
-        return;
-    }
-    /* Listen for response from server and forward to client fd */ 
-    Rio_readinitb(&rio_s, serverfd); 
-    if(rio_writen(serverfd, http_hdr, strlen(http_hdr)) > 0) {
-        /* Reads from server and sends to client */
-        read_n_send(serverfd, clientfd, &rio_s);
+    /* Parse URL into host, path, port; none is longer than the URI,
+       and the defaults are "/" and "80" */
+    r->host = arena_alloc(a, rq->urilen + 1);
+    r->port = arena_alloc(a, rq->urilen + 3);
+    r->path = path = arena_alloc(a, rq->urilen + 2);
+    parse_uri(uri, r->host, r->port, path);     
+    if (strlen(r->host) >= NI_MAXHOST) {
+        request_error(r, clientfd, "GET", "400", "Bad Request",
+                "Host name too long");
+        return -1;
     }
-    Close(serverfd);
+    plen = strlen(path);
+    r->key = arena_alloc(a, strlen(r->host) + strlen(r->port) + plen + 2);
+    cache_key(r->key, strlen(r->host) + strlen(r->port) + plen + 2,
+            r->host, r->port, path);
 
+    /* Form new HTTP Request: GET path HTTP/1.1. The path is the tail
+       of the URI unless parse_uri made it up */
+    up->iovcnt = 0;
+    up->len = 0;
+    upreq_add(up, rq->method, rq->methodlen);
+    upreq_add(up, " ", 1);
+    if (plen <= rq->urilen && !memcmp(rq->uri + rq->urilen - plen, path, plen))
+        upreq_add(up, rq->uri + rq->urilen - plen, plen);
+    else
+        upreq_add(up, "/", 1);
+    upreq_add(up, " HTTP/1.1\r\n", 11);
+    build_requesthdrs(rq, up, r->host, &r->keep);
+    return 0;
 }
-/* $end doit */
+/* $end build_request */
 
-/* 
- * build_get - Adds custom GET to new http Request
- *  Uses HTTP/1.0 
+/*
+ * request_init - Start r off with nothing known about it, so that what
+ *     access_log finds filled in is what got that far
+ */
+void request_init(request_t *r)
+{
+    r->hr.method = r->hr.uri = NULL;
+    r->hr.methodlen = r->hr.urilen = 0;
+    r->start = 0;
+    r->status = 0;
+    r->sent = 0;
+    r->cache = '-';
+}
+
+/*
+ * request_error - Send r's client an error page, noting its status and
+ *     size for the access log
+ */
+void request_error(request_t *r, int fd, char *cause, char *errnum,
+        char *shortmsg, char *longmsg)
+{
+    ssize_t n = clienterror(fd, cause, errnum, shortmsg, longmsg);
+
+    r->status = atoi(errnum);
+    r->sent += (n > 0) ? n : 0;
+}
+
+/*
+ * access_log - Log request r from peer, unless the client went away
+ *     before sending one
  */
-void build_get(char *http_hdr, char *method, char *path, char *version)
+void access_log(alog_peer_t *peer, request_t *r)
 {
-    strcpy(http_hdr, method);
-    strcat(http_hdr, " ");
-    strcat(http_hdr, path); 
-    strcat(http_hdr, " "); 
-    strcat(http_hdr, version); 
-    strcat(http_hdr, "\n"); 
+    alog_rec_t *rec;
+    struct timespec ts;
+    size_t n;
+
+    if ((!r->hr.uri && !r->status) || !(rec = alog_start()))
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    rec->duration = r->start ? stats_now() - r->start : 0;
+    rec->sent = r->sent;
+    rec->peer = *peer;
+    rec->status = r->status;
+    rec->cache = r->cache;
+    memset(rec->method, 0, sizeof(rec->method));
+    n = (r->hr.methodlen < sizeof(rec->method))
+        ? r->hr.methodlen : sizeof(rec->method);
+    if (n)
+        memcpy(rec->method, r->hr.method, n);
+    rec->urllen = (r->hr.urilen < ALOG_URLMAX) ? r->hr.urilen : ALOG_URLMAX;
+    if (rec->urllen)
+        memcpy(rec->url, r->hr.uri, rec->urllen);
+    alog_commit();
 }
 
+/*
+ * upreq_add - Append the n bytes at s to up. A slice that starts where
+ *     the last one ends is merged into it, so runs of headers passed on
+ *     unchanged cost one iovec.
+ */
+static void upreq_add(upreq_t *up, void *s, size_t n)
+{
+    struct iovec *last = up->iovcnt ? &up->iov[up->iovcnt - 1] : NULL;
+
+    if (last && (char *)last->iov_base + last->iov_len == s)
+        last->iov_len += n;
+    else {
+        up->iov[up->iovcnt].iov_base = s;
+        up->iov[up->iovcnt++].iov_len = n;
+    }
+    up->len += n;
+}
 
 /*
  * build_requesthdrs - After building the GET, 
  * This function adds onto the the HTTP Request by adding our chosen
- * headers including Proxy Connection: close. 
+ * headers. The client's hop-by-hop Connection headers are replaced
+ * by Connection: keep-alive, as origin connections are pooled; what
+ * the client asked for goes into *keep instead. 
  *
- * It modifies the request so as to port it to server
+ * Headers passed on unchanged are slices of the client's own lines;
+ * only the Host line (if the client sent none) is written out, into
+ * up->hostline.
  */
 /* $begin build_requesthdrs */
-void build_requesthdrs(rio_t *rp, char *http_hdr, char *host) 
+void build_requesthdrs(http_req_t *rq, upreq_t *up, char *host, int *keep) 
 {
-    char buf[MAXLINE];
+    int i, has_host = 0;
+    http_hdr_t *h;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    if (!strstr(buf, "Host: ")) {
-        strcat(http_hdr, "Host: ");
-        strcat(http_hdr, host);
-        strcat(http_hdr, "\n");
-    }
-    else 
-        strcat(http_hdr, buf);
-
-    while(strcmp(buf, "\r\n")) {        
-        Rio_readlineb(rp, buf, MAXLINE);
+    for (i = 0; i < rq->nhdrs; i++) {
+        h = &rq->hdrs[i];
 
         /* Changes to header, change User$-Agent and Connection hdrs */
-        if (strstr(buf, "User-Agent: "))
-            strcat(http_hdr, user_agent_hdr);
-        else if (strstr(buf, "Connection: ")) {
-            strcat(http_hdr, "Connection: close\n");
-            strcat(http_hdr, "Proxy-Connection: close\n");
+        switch (h->id) {
+        case HTTP_H_HOST:
+            has_host = 1;
+            break;
+        case HTTP_H_USER_AGENT:
+            upreq_add(up, (char *)user_agent_hdr, strlen(user_agent_hdr));
+            continue;
+        case HTTP_H_CONNECTION:
+        case HTTP_H_PROXY_CONNECTION:
+            if (http_hasval(h->value, h->vallen, "close"))
+                *keep = 0;
+            else if (http_hasval(h->value, h->vallen, "keep-alive"))
+                *keep = 1;
+            continue;
+        case HTTP_H_KEEP_ALIVE:
+            continue;
+        default:
+            break;
         }
-        else 
-            strcat(http_hdr, buf);
+        upreq_add(up, h->name, h->linelen);
     }
-    return;
+    if (!has_host)
+        upreq_add(up, up->hostline,
+                sprintf(up->hostline, "Host: %s\r\n", host));
+    upreq_add(up, "Connection: keep-alive\r\n\r\n", 26);
 }
 /* $end build_requesthdrs */
 
+/*
+ * upreq_write - Write as much of up as fd will take, starting off bytes
+ *     in. Returns the number of bytes written, or -1 with errno set.
+ */
+ssize_t upreq_write(int fd, upreq_t *up, size_t off)
+{
+    struct iovec iov[UPREQ_MAXIOV];
+    int i = 0, n;
+
+    while (i < up->iovcnt && off >= up->iov[i].iov_len)
+        off -= up->iov[i++].iov_len;
+    for (n = 0; i < up->iovcnt; n++, i++)
+        iov[n] = up->iov[i];
+    if (n == 0)
+        return 0;
+    iov[0].iov_base = (char *)iov[0].iov_base + off;
+    iov[0].iov_len -= off;
+    return writev(fd, iov, n);
+}
+
+/*
+ * upreq_send - Write all of up to the blocking descriptor fd. Returns 0,
+ *     or -1 if the write failed.
+ */
+int upreq_send(int fd, upreq_t *up)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < up->len) {
+        if ((n = upreq_write(fd, up, off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
 
 /*
- * read_n_send - Reads from server and forwards to client
+ * read_n_send - Reads the body described by bp from server and forwards
+ * it to client. Unless fl is NULL, the response is passed on to fl's
+ * followers and cached if it turns out to be a small, complete response.
+ * The body is read into pool buffers that fl keeps as they are, so the
+ * bytes are not copied again on their way to the followers and the
+ * cache. If the client goes away while others are following, the fetch
+ * carries on for their sake. Once no copy is wanted, the rest of the
+ * body is spliced rather than copied. Returns 0 if the whole body was
+ * relayed.
  * 
  * Terminates when
  * 1. Read from the server fails (HTTP 502 code)
- * 2. Write to client fails. (HTTP 400 Code)
- * In both cases, a -1 is the return value of n wc is handled. 
+ * 2. Write to client fails.
+ * In both cases, -1 is returned.
  */
 /* $begin read_n_send */
-void read_n_send(int serverfd, int clientfd, rio_t *rio)
+int read_n_send(int serverfd, int clientfd, rio_t *rio, http_body_t *bp,
+        cache_flight_t *fl)
 {
-    int n;
-    char buf[MAXLINE];
+    ssize_t n = 0;
+    size_t want, room;
+    char *data;
+    iobuf_t *b = iobuf_get();
 
     /* Read from server and send to client */
-    while((n = rio_readnb(rio, buf, MAXLINE)) > 0) {
-        if((rio_writen(clientfd, buf, n) != n)) {
-            clienterror(clientfd, "GET", "400", "Bad Request",
-                    "Client not understood due to malformed syntax");
-            return;
+    while (!bp->done) {
+        if (clientfd >= 0 && !cache_flight_wants(fl)
+                && (n = splice_body(serverfd, clientfd, rio, bp))
+                    != SPLICE_ENOTSUP)
+            break;
+
+        /* Read past what fl already has of b; start a new buffer once
+           b is full, or if fl dropped it */
+        if (b->len == IOBUF_SIZE || (b->len > 0 && !cache_flight_wants(fl))) {
+            iobuf_put(b);
+            b = iobuf_get();
+        }
+        data = b->data + b->len;
+        room = IOBUF_SIZE - b->len;
+        want = http_body_want(bp);
+        if ((n = rio_readnb(rio, data, want < room ? want : room)) < 0)
+            break;
+        stats_add(STATS_BYTES_IN, n);
+        if ((n = http_body_decode(bp, data, n)) < 0)
+            break;
+        cache_flight_append(fl, b, n);
+        if (relay_write(&clientfd, fl, data, n) < 0) {
+            iobuf_put(b);
+            return -1;
         }
     }
+    iobuf_put(b);
+    if (n == SPLICE_ECLIENT) {
+        cache_flight_finish(fl, 0);
+        return -1;
+    }
 
     /* Handling invalid response from upstream server */
-    if (n < 0) {
-        clienterror(clientfd, "GET", "502", "Bad Gateway",
-                "Client not understood due to malformed syntax");
+    if (!bp->done) {
+        cache_flight_finish(fl, 0);
+        if (clientfd >= 0)
+            clienterror(clientfd, "GET", "502", "Bad Gateway",
+                    "Client not understood due to malformed syntax");
+        return -1;
     }
-
+    cache_flight_finish(fl, 1);
+    return 0;
 }
 /* $end read_n_send */
 
+/*
+ * relay_out - Pass n response bytes on to fl and to *clientfd. If the
+ *     client has gone, carry on without it (*clientfd becomes -1) while
+ *     others follow fl; otherwise fail fl and return -1.
+ */
+int relay_out(int *clientfd, cache_flight_t *fl, char *buf, size_t n)
+{
+    cache_flight_add(fl, buf, n);
+    return relay_write(clientfd, fl, buf, n);
+}
+
+/* relay_write - relay_out for bytes that fl already has */
+static int relay_write(int *clientfd, cache_flight_t *fl, char *buf, size_t n)
+{
+    if (*clientfd < 0)
+        return 0;
+    if (rio_writen(*clientfd, buf, n) == (ssize_t)n) {
+        stats_add(STATS_BYTES_OUT, n);
+        return 0;
+    }
+    *clientfd = -1;
+    if (cache_flight_followers(fl) > 0)
+        return 0;
+    cache_flight_finish(fl, 0);
+    return -1;
+}
+
+/*
+ * splice_body - Send what is left in rio's buffer (rio may be NULL),
+ *     then splice the rest of body bp. Chunked bodies need decoding, so
+ *     are never spliced. Returns 0 once the body is done, or a SPLICE_E*
+ *     code; SPLICE_ENOTSUP may come after rio's buffer has been sent.
+ */
+int splice_body(int serverfd, int clientfd, rio_t *rio, http_body_t *bp)
+{
+    ssize_t n;
+    size_t want;
+
+    if (bp->framing == HTTP_BODY_CHUNKED)
+        return SPLICE_ENOTSUP;
+    if (rio && rio->rio_cnt > 0) {
+        n = http_body_decode(bp, rio->rio_bufptr, rio->rio_cnt);
+        if (rio_writen(clientfd, rio->rio_bufptr, n) != n)
+            return SPLICE_ECLIENT;
+        stats_add(STATS_BYTES_IN, rio->rio_cnt);
+        stats_add(STATS_BYTES_OUT, n);
+        rio->rio_cnt = 0;
+    }
+    if (bp->done)
+        return 0;
+    want = http_body_want(bp);
+    if ((n = splice_relay(serverfd, clientfd, want)) < 0)
+        return n;
+    http_body_skip(bp, n, (size_t)n < want);
+    return bp->done ? 0 : SPLICE_ESERVER;
+}
+
 /*
  * parse_uri - parse URI into host, path and port
  * Function can handle URLs with http://, without it, 
@@ -249,7 +999,6 @@ void read_n_send(int serverfd, int clientfd, rio_t *rio)
 /* $begin parse_uri */
 void parse_uri(char *uri, char *host, char *port, char *path) 
 {
-    printf("Url: %s\n", uri);
     char *curr, *next;
     *port = '\0';
     *path = '\0';
@@ -302,16 +1051,10 @@ void parse_uri(char *uri, char *host, char *port, char *path)
     }
 
     /* If path or port still empty, use default values */
-    if (*path == 0) {
-        strncpy(path, "/", 1);
-        path[1] = 0;
-    }
-    if (*port == 0) {
-        strncpy(port, "80", 2);
-        port[2] = 0;
-    }
-
-    printf("\nHost+Port+Path: %s+%s+%s\n\n", host, port, path);
+    if (*path == 0)
+        strcpy(path, "/");
+    if (*port == 0)
+        strcpy(port, "80");
 }
 /* $end parse_uri */
 
@@ -322,29 +1065,33 @@ void parse_uri(char *uri, char *host, char *port, char *path)
  * Write to client terminates in case there is a write error (-1)
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
+ssize_t clienterror(int fd, char *cause, char *errnum, 
         char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char buf[MAXBUF], body[MAXBUF];
+    size_t n;
+
+    stats_error(atoi(errnum));
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Server Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>Tim Kaboya's Proxy Web server</em>\r\n", body);
+    snprintf(body, sizeof(body), "<html><title>Proxy Server Error</title>"
+            "<body bgcolor=""ffffff"">\r\n"
+            "%s: %s\r\n"
+            "<p>%s: %.512s\r\n"
+            "<hr><em>Tim Kaboya's Proxy Web server</em>\r\n",
+            errnum, shortmsg, longmsg, cause);
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\n"
+            "Content-type: text/html\r\n"
+            "Content-length: %d\r\n\r\n",
+            errnum, shortmsg, (int)strlen(body));
     if(rio_writen(fd, buf, strlen(buf)) < 0)
-        return;
-    sprintf(buf, "Content-type: text/html\r\n");
-    if(rio_writen(fd, buf, strlen(buf)) < 0)
-        return;
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    if(rio_writen(fd, buf, strlen(buf)) < 0)
-        return;
+        return -1;
     if(rio_writen(fd, body, strlen(body)) < 0)
-        return;
+        return -1;
+    n = strlen(buf) + strlen(body);
+    stats_add(STATS_BYTES_OUT, n);
+    return n;
 }
 /* $end clienterror */
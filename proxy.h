@@ -0,0 +1,75 @@
+/*
+ * proxy.h - Request handling routines shared by the proxy's
+ *     threaded and event-driven front ends
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "arena.h"
+#include "alog.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Worker threads keep request state in arenas, so need little stack */
+#define WORKER_STACK_SIZE (256 * 1024)
+
+/* Default limits on persistent client connections (-c) */
+#define CLIENT_IDLE_TIMEOUT 5       /* Seconds to wait for a request */
+#define CLIENT_MAX_REQUESTS 100     /* Requests per connection */
+
+/* Iovecs in a request for the origin: four for the request line, at
+   most one per client header, and our own Host and Connection lines */
+#define UPREQ_MAXIOV (HTTP_MAXHDRS + 8)
+
+/* The request to send the origin, mostly slices of the client's */
+typedef struct {
+    struct iovec iov[UPREQ_MAXIOV];
+    int iovcnt;
+    size_t len;                 /* Bytes in all of iov */
+    char hostline[NI_MAXHOST + 10]; /* "Host: " line, if we add one */
+} upreq_t;
+
+/* A client request being handled; lives in its connection's arena */
+typedef struct {
+    http_req_t hr;              /* The client's header block, parsed */
+    upreq_t up;                 /* The request for the origin */
+    char *host, *port, *path;   /* The origin and the object on it */
+    char *key;                  /* Cache key */
+    int keep;                   /* Client wants its connection kept */
+    long long start;            /* stats_now() once its header block was in */
+    int status;                 /* What the client was sent, for the log */
+    size_t sent;                /* Bytes of it */
+    char cache;                 /* H(it), F(ollow), M(iss) or - */
+} request_t;
+
+extern int client_idle_timeout;
+extern int client_max_requests;
+
+int doit(int clientfd, rio_t *rio_c, arena_t *a, alog_peer_t *peer);
+void request_init(request_t *r);
+void request_error(request_t *r, int fd, char *cause, char *errnum,
+        char *shortmsg, char *longmsg);
+void access_log(alog_peer_t *peer, request_t *r);
+int read_request(rio_t *rp, int clientfd, arena_t *a, request_t *r);
+int build_request(request_t *r, int clientfd, arena_t *a);
+void build_requesthdrs(http_req_t *rq, upreq_t *up, char *host, int *keep);
+ssize_t upreq_write(int fd, upreq_t *up, size_t off);
+int upreq_send(int fd, upreq_t *up);
+int read_n_send(int serverfd, int clientfd, rio_t *rio, http_body_t *bp,
+        cache_flight_t *fl);
+int relay_out(int *clientfd, cache_flight_t *fl, char *buf, size_t n);
+int splice_body(int serverfd, int clientfd, rio_t *rio, http_body_t *bp);
+void parse_uri(char *uri, char *host, char *port, char *path);
+ssize_t clienterror(int fd, char *cause, char *errnum,
+        char *shortmsg, char *longmsg);
+void pin_thread(int cpu);
+void client_nodelay(int fd);
+int accept_shed(int listenfd, int *spare);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,84 @@
+/*
+ * sbuf.c - Bounded producer/consumer queue of connected descriptors
+ */
+/* $begin sbufc */
+#include "sbuf.h"
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+/* $begin sbuf_init */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;                       /* Buffer holds max of n items */
+    sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
+    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+}
+/* $end sbuf_init */
+
+/* Clean up buffer sp */
+/* $begin sbuf_deinit */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+}
+/* $end sbuf_deinit */
+
+/* Insert item onto the rear of shared buffer sp */
+/* $begin sbuf_insert */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    P(&sp->slots);                          /* Wait for available slot */
+    P(&sp->mutex);                          /* Lock the buffer */
+    sp->buf[(++sp->rear)%(sp->n)] = item;   /* Insert the item */
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+}
+/* $end sbuf_insert */
+
+/*
+ * sbuf_tryinsert - Like sbuf_insert, but never waits for a slot.
+ *     Returns 0 on success and -1 if the buffer is full.
+ */
+/* $begin sbuf_tryinsert */
+int sbuf_tryinsert(sbuf_t *sp, int item)
+{
+    while (sem_trywait(&sp->slots) < 0) {
+        if (errno != EINTR)
+            return -1;                      /* No free slot */
+    }
+    P(&sp->mutex);
+    sp->buf[(++sp->rear)%(sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+    return 0;
+}
+/* $end sbuf_tryinsert */
+
+/* Remove and return the first item from buffer sp */
+/* $begin sbuf_remove */
+int sbuf_remove(sbuf_t *sp)
+{
+    int item;
+    P(&sp->items);                          /* Wait for available item */
+    P(&sp->mutex);                          /* Lock the buffer */
+    item = sp->buf[(++sp->front)%(sp->n)];  /* Remove the item */
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->slots);                          /* Announce available slot */
+    return item;
+}
+/* $end sbuf_remove */
+
+/* Return how many items are waiting in sp; a hint, as it may change */
+/* $begin sbuf_waiting */
+int sbuf_waiting(sbuf_t *sp)
+{
+    int n;
+
+    if (sem_getvalue(&sp->items, &n) < 0 || n < 0)
+        return 0;
+    return n;
+}
+/* $end sbuf_waiting */
+/* $end sbufc */
@@ -0,0 +1,124 @@
+/*
+ * splice.c - Zero-copy relay of responses through a pipe
+ *
+ * The glibc splice() wrapper needs _GNU_SOURCE, which clashes with
+ * csapp.h, so this goes through syscall() like pin_thread does.
+ *
+ * Blocking relays use one pipe per thread, kept for the thread's
+ * lifetime. A pipe is only reused if it was left empty; a relay that
+ * fails with bytes still in the pipe closes it.
+ */
+#include <sys/syscall.h>
+#include "splice.h"
+#include "stats.h"
+
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+#define SPLICE_F_MORE 4
+#endif
+
+unsigned long splice_bytes = 0;
+
+static __thread int relay_pipe[2] = { -1, -1 };
+static __thread int splice_failed;  /* Not supported here, always copy */
+
+/*
+ * splice_pipe - Create a pipe for non-blocking splice_move calls from
+ *     an event loop. Returns 0, or -1 with errno set.
+ */
+int splice_pipe(int fds[2])
+{
+    if (pipe(fds) < 0)
+        return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/*
+ * splice_move - Move up to n bytes from fromfd to tofd, one of which
+ *     is a pipe. With nonblock set, fails with EAGAIN rather than wait
+ *     for either side. With more set, tells a socket tofd that more of
+ *     the response follows, so a partial segment may wait for it; the
+ *     last bytes of a response must go without. Returns the byte count,
+ *     0 at EOF or -1.
+ */
+ssize_t splice_move(int fromfd, int tofd, size_t n, int nonblock, int more)
+{
+    ssize_t rc;
+    unsigned flags = SPLICE_F_MOVE;
+
+    if (nonblock)
+        flags |= SPLICE_F_NONBLOCK;
+    if (more)
+        flags |= SPLICE_F_MORE;
+    while ((rc = syscall(SYS_splice, fromfd, NULL, tofd, NULL, n, flags)) < 0
+            && errno == EINTR)
+        ;
+    return rc;
+}
+
+/*
+ * splice_relay - Relay len bytes, or until the origin closes, from
+ *     serverfd to clientfd through this thread's pipe. Returns the number
+ *     of bytes relayed, or the SPLICE_E* code of the side that failed.
+ *     SPLICE_ENOTSUP means nothing was consumed from serverfd and the
+ *     caller should relay by copying.
+ */
+ssize_t splice_relay(int serverfd, int clientfd, size_t len)
+{
+    int *p = relay_pipe;
+    ssize_t n, m, rc = 0;
+    size_t moved = 0;
+
+    if (splice_failed || (p[0] < 0 && pipe(p) < 0))
+        return SPLICE_ENOTSUP;
+
+    while (moved < len) {
+        n = (len - moved < SPLICE_CHUNK) ? len - moved : SPLICE_CHUNK;
+        if ((n = splice_move(serverfd, p[1], n, 0, 0)) < 0) {
+            if (!moved && (errno == EINVAL || errno == ENOSYS)) {
+                splice_failed = 1;
+                return SPLICE_ENOTSUP;
+            }
+            rc = SPLICE_ESERVER;
+            break;
+        }
+        if (n == 0)
+            break;
+        while (n > 0) {
+            if ((m = splice_move(p[0], clientfd, n, 0,
+                    moved + n < len)) <= 0) {
+                rc = SPLICE_ECLIENT;
+                break;
+            }
+            n -= m;
+            moved += m;
+            __atomic_add_fetch(&splice_bytes, m, __ATOMIC_RELAXED);
+            stats_add(STATS_BYTES_IN, m);
+            stats_add(STATS_BYTES_OUT, m);
+        }
+        if (n > 0)
+            break;
+    }
+
+    /* Drop a pipe that may still hold part of this response */
+    if (rc == SPLICE_ECLIENT) {
+        close(p[0]);
+        close(p[1]);
+        p[0] = p[1] = -1;
+    }
+    return rc ? rc : (ssize_t)moved;
+}
+
+/* splice_report - SIGUSR1 handler: print the zero-copy byte count */
+void splice_report(int sig)
+{
+    int olderrno = errno;
+
+    sio_puts("spliced ");
+    sio_putl(__atomic_load_n(&splice_bytes, __ATOMIC_RELAXED));
+    sio_puts(" bytes\n");
+    errno = olderrno;
+}
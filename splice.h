@@ -0,0 +1,27 @@
+/*
+ * splice.h - Zero-copy relay of responses through a pipe
+ *
+ * splice(2) moves bytes from the origin socket into a pipe and from
+ * the pipe into the client socket without copying them to user space.
+ * The proxy uses it for responses it is not keeping for the cache.
+ */
+#ifndef __SPLICE_H__
+#define __SPLICE_H__
+
+#include "csapp.h"
+
+#define SPLICE_CHUNK 65536      /* Max bytes per splice: a pipe's capacity */
+
+/* splice_relay failures */
+#define SPLICE_ESERVER (-1)     /* Reading the origin failed */
+#define SPLICE_ECLIENT (-2)     /* Writing the client failed */
+#define SPLICE_ENOTSUP (-3)     /* Nothing moved; copy instead */
+
+extern unsigned long splice_bytes;  /* Bytes relayed zero-copy so far */
+
+int splice_pipe(int fds[2]);
+ssize_t splice_move(int fromfd, int tofd, size_t n, int nonblock, int more);
+ssize_t splice_relay(int serverfd, int clientfd, size_t len);
+void splice_report(int sig);
+
+#endif /* __SPLICE_H__ */
@@ -0,0 +1,193 @@
+/*
+ * stats.c - Per-phase latency histograms and traffic counters
+ *
+ * Each thread gets its own stats_thread_t the first time it records
+ * anything, and links it into a list for stats_serve to walk. Only the
+ * owning thread writes to it, with plain relaxed stores rather than
+ * atomic read-modify-writes; stats_serve reads them with relaxed loads
+ * while they are being updated, so its totals are only as consistent
+ * as a snapshot taken over a few microseconds can be.
+ */
+#include "stats.h"
+#include "splice.h"
+#include "hist.h"
+
+#define STATS_MIN_STATUS 400        /* Errors counted by status code */
+#define STATS_NSTATUS 200
+
+/* Owner-only update that readers may load at any time */
+#define STATS_BUMP(p, n) \
+    __atomic_store_n((p), *(p) + (n), __ATOMIC_RELAXED)
+#define STATS_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+typedef struct stats_thread {
+    unsigned long hist[STATS_NPHASES][HIST_BUCKETS];
+    unsigned long sum[STATS_NPHASES];       /* us, for the mean */
+    unsigned long max[STATS_NPHASES];
+    unsigned long counters[STATS_NCOUNTERS];
+    unsigned long errors[STATS_NSTATUS];
+    struct stats_thread *next;
+} stats_thread_t;
+
+static const char *stats_phase_names[STATS_NPHASES] = {
+    "parse", "dns", "connect", "first_byte", "body", "total"
+};
+static const char *stats_counter_names[STATS_NCOUNTERS] = {
+    "bytes_in", "bytes_out", "cache_hits", "cache_follows", "cache_misses",
+    "log_dropped", "accept_shed"
+};
+
+static __thread stats_thread_t *stats_mine;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_thread_t *stats_all;          /* Every thread's, newest first */
+static long long stats_started;
+
+/* stats_init - Start the uptime clock */
+void stats_init(void)
+{
+    stats_started = stats_now();
+}
+
+/* stats_now - Monotonic clock in us */
+long long stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* stats_self - This thread's stats, created on first use */
+static stats_thread_t *stats_self(void)
+{
+    stats_thread_t *st;
+
+    if ((st = stats_mine))
+        return st;
+    st = stats_mine = Calloc(1, sizeof(stats_thread_t));
+    pthread_mutex_lock(&stats_lock);
+    st->next = stats_all;
+    stats_all = st;
+    pthread_mutex_unlock(&stats_lock);
+    return st;
+}
+
+/* stats_time - Record that phase took from start until now */
+void stats_time(stats_phase_t phase, long long start)
+{
+    stats_thread_t *st = stats_self();
+    long long d = stats_now() - start;
+    unsigned long us = (d > 0) ? d : 0;
+
+    STATS_BUMP(&st->hist[phase][hist_bucket(us)], 1);
+    STATS_BUMP(&st->sum[phase], us);
+    if (us > st->max[phase])
+        __atomic_store_n(&st->max[phase], us, __ATOMIC_RELAXED);
+}
+
+/* stats_add - Add n to a counter */
+void stats_add(stats_counter_t counter, unsigned long n)
+{
+    stats_thread_t *st = stats_self();
+
+    STATS_BUMP(&st->counters[counter], n);
+}
+
+/*
+ * stats_own - This thread's own count so far. A worker thread handles
+ *     one request at a time, so the difference over a request is that
+ *     request's share.
+ */
+unsigned long stats_own(stats_counter_t counter)
+{
+    return stats_self()->counters[counter];
+}
+
+/* stats_error - Count an error page sent with this status */
+void stats_error(int status)
+{
+    stats_thread_t *st = stats_self();
+
+    if (status >= STATS_MIN_STATUS && status < STATS_MIN_STATUS + STATS_NSTATUS)
+        STATS_BUMP(&st->errors[status - STATS_MIN_STATUS], 1);
+}
+
+/* stats_wanted - Is a request for host and path one for the stats page? */
+int stats_wanted(char *host, char *path)
+{
+    return !strcasecmp(host, STATS_HOST) && !strcmp(path, STATS_PATH);
+}
+
+/*
+ * stats_serve - Answer a stats request on fd: every thread's counters
+ *     and histograms added up, as plain text. The connection is closed
+ *     afterwards. Returns the number of bytes sent, or -1.
+ */
+ssize_t stats_serve(int fd)
+{
+    int i, p;
+    size_t len = 0;
+    char body[MAXBUF], head[MAXBUF];
+    unsigned long hist[HIST_BUCKETS], sum, max, count, n;
+    stats_thread_t *st, *all;
+
+    pthread_mutex_lock(&stats_lock);
+    all = stats_all;
+    pthread_mutex_unlock(&stats_lock);
+
+#define STATS_PRINTF(...) \
+    len += snprintf(body + len, (len < sizeof(body)) ? sizeof(body) - len : 0, \
+            __VA_ARGS__)
+
+    STATS_PRINTF("uptime_s %lld\n", (stats_now() - stats_started) / 1000000);
+    for (i = 0; i < STATS_NCOUNTERS; i++) {
+        for (n = 0, st = all; st; st = st->next)
+            n += STATS_LOAD(&st->counters[i]);
+        STATS_PRINTF("%s %lu\n", stats_counter_names[i], n);
+    }
+    STATS_PRINTF("bytes_spliced %lu\n",
+            __atomic_load_n(&splice_bytes, __ATOMIC_RELAXED));
+    for (i = 0; i < STATS_NSTATUS; i++) {
+        for (n = 0, st = all; st; st = st->next)
+            n += STATS_LOAD(&st->errors[i]);
+        if (n)
+            STATS_PRINTF("errors %d %lu\n", STATS_MIN_STATUS + i, n);
+    }
+
+    STATS_PRINTF("\n%-10s %10s %10s %10s %10s %10s %10s %10s (us)\n",
+            "phase", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (p = 0; p < STATS_NPHASES; p++) {
+        memset(hist, 0, sizeof(hist));
+        count = sum = max = 0;
+        for (st = all; st; st = st->next) {
+            for (i = 0; i < HIST_BUCKETS; i++) {
+                n = STATS_LOAD(&st->hist[p][i]);
+                hist[i] += n;
+                count += n;
+            }
+            sum += STATS_LOAD(&st->sum[p]);
+            if ((n = STATS_LOAD(&st->max[p])) > max)
+                max = n;
+        }
+        STATS_PRINTF("%-10s %10lu %10lu %10lu %10lu %10lu %10lu %10lu\n",
+                stats_phase_names[p], count, count ? sum / count : 0,
+                hist_percentile(hist, count, max, 0.5),
+                hist_percentile(hist, count, max, 0.9),
+                hist_percentile(hist, count, max, 0.99),
+                hist_percentile(hist, count, max, 0.999),
+                max);
+    }
+#undef STATS_PRINTF
+    if (len >= sizeof(body))
+        len = sizeof(body) - 1;
+
+    snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", len);
+    if (rio_writen(fd, head, strlen(head)) < 0 || rio_writen(fd, body, len) < 0)
+        return -1;
+    len += strlen(head);
+    stats_add(STATS_BYTES_OUT, len);
+    return len;
+}
@@ -0,0 +1,52 @@
+/*
+ * stats.h - Per-phase latency histograms and traffic counters
+ *
+ * Every thread records into its own histograms and counters, so
+ * recording takes no lock and shares no cache line. Histograms are
+ * HDR-style: 32 linear buckets per power of two of microseconds, so a
+ * reported percentile is within about 3% of the true value. The
+ * threads' numbers are only added up when someone asks, by sending
+ * "GET http://proxy.local/stats" through the proxy, which answers that
+ * request itself (stats_serve) instead of forwarding it.
+ *
+ * A request's time is split into phases: parsing its header block,
+ * resolving the origin, connecting to it, waiting for the response
+ * head after sending the request, and relaying the body. Requests
+ * answered from the cache or by following another fetch only count
+ * towards the total.
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+#define STATS_HOST "proxy.local"    /* GET http://STATS_HOST/STATS_PATH */
+#define STATS_PATH "/stats"
+
+typedef enum {
+    STATS_PARSE, STATS_DNS, STATS_CONNECT, STATS_FIRST_BYTE, STATS_BODY,
+    STATS_TOTAL, STATS_NPHASES
+} stats_phase_t;
+
+typedef enum {
+    STATS_BYTES_IN,             /* Response bytes read from origins */
+    STATS_BYTES_OUT,            /* Bytes written to clients */
+    STATS_CACHE_HITS,
+    STATS_CACHE_FOLLOWS,        /* Misses that followed another fetch */
+    STATS_CACHE_MISSES,
+    STATS_LOG_DROPPED,          /* Access log records lost to full rings */
+    STATS_ACCEPT_SHED,          /* Connections closed unserved for want
+                                   of descriptors */
+    STATS_NCOUNTERS
+} stats_counter_t;
+
+void stats_init(void);
+long long stats_now(void);
+void stats_time(stats_phase_t phase, long long start);
+void stats_add(stats_counter_t counter, unsigned long n);
+unsigned long stats_own(stats_counter_t counter);
+void stats_error(int status);
+int stats_wanted(char *host, char *path);
+ssize_t stats_serve(int fd);
+
+#endif /* __STATS_H__ */
@@ -98,14 +98,14 @@ void doit(int fd)
 /* $begin read_requesthdrs */
 void read_requesthdrs(rio_t *rp) 
 {
-    char buf[MAXLINE];
-
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-        Rio_readlineb(rp, buf, MAXLINE);
-        printf("%s", buf);
-    }
+    char *line = "";
+    ssize_t n;
+
+    /* Zero-copy: each line is printed from where it sits in rp */
+    do {
+        n = Rio_readlinep(rp, &line);
+        printf("%.*s", (int)n, line);
+    } while (n > 0 && (n != 2 || memcmp(line, "\r\n", 2))); //line:netp:readhdrs:checkterm
     return;
 }
 /* $end read_requesthdrs */
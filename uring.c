@@ -0,0 +1,302 @@
+/*
+ * uring.c - Optional io_uring backend for the upstream -> client relay
+ *
+ * Each worker thread lazily sets up its own ring with two registered
+ * (fixed) buffers, using the raw io_uring syscalls so there is no
+ * dependency on liburing. The relay is double buffered: one
+ * io_uring_enter submits the write of the chunk just read together with
+ * the read of the next one and waits for both, so a response costs one
+ * syscall per URING_BUFSIZE chunk rather than a read() and a write()
+ * per RIO_BUFSIZE chunk.
+ *
+ * The read and write are deliberately not linked with IOSQE_IO_LINK: a
+ * linked write needs its length at submission time, and a short socket
+ * read would sever the chain anyway.
+ *
+ * Once nothing keeps a copy of the response, the rest of it is spliced
+ * (splice.c) instead, which avoids even the one copy in and out.
+ */
+#include "proxy.h"
+#include "uring.h"
+#include "cache.h"
+#include "splice.h"
+#include "stats.h"
+
+int uring_enabled = 0;
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 8
+#define URING_NBUF 2
+
+#define URING_READ  0        /* user_data tags for completions */
+#define URING_WRITE 1
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    char *bufs[URING_NBUF];  /* Registered with IORING_REGISTER_BUFFERS */
+} uring_t;
+
+static __thread uring_t *ring;     /* This thread's ring, once set up */
+static __thread int ring_failed;   /* Setup failed, always use Rio */
+
+/*
+ * uring_setup - Create and map a ring and register its buffers.
+ *     Returns NULL (and leaves nothing behind) if the kernel says no.
+ */
+static uring_t *uring_setup(void)
+{
+    int i, fd;
+    size_t sq_sz, cq_sz;
+    char *sq_ptr, *cq_ptr;
+    struct io_uring_params p;
+    struct iovec iov[URING_NBUF];
+    uring_t *ur;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        return NULL;
+
+    sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_sz = cq_sz = (sq_sz > cq_sz) ? sq_sz : cq_sz;
+    sq_ptr = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else if ((cq_ptr = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING))
+            == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    ur = Calloc(1, sizeof(uring_t));
+    ur->fd = fd;
+    ur->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    ur->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    ur->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    ur->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    ur->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    ur->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+    ur->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        close(fd);
+        Free(ur);
+        return NULL;
+    }
+
+    for (i = 0; i < URING_NBUF; i++) {
+        ur->bufs[i] = Malloc(URING_BUFSIZE);
+        iov[i].iov_base = ur->bufs[i];
+        iov[i].iov_len = URING_BUFSIZE;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                iov, URING_NBUF) < 0) {
+        for (i = 0; i < URING_NBUF; i++)
+            Free(ur->bufs[i]);
+        close(fd);
+        Free(ur);
+        return NULL;
+    }
+    return ur;
+}
+
+/* uring_prep - Queue a fixed-buffer read or write of buffer b */
+static void uring_prep(uring_t *ur, int op, int fd, int b, unsigned len)
+{
+    unsigned tail = *ur->sq_tail;
+    unsigned idx = tail & *ur->sq_mask;
+    struct io_uring_sqe *sqe = &ur->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (op == URING_READ) ? IORING_OP_READ_FIXED
+                                     : IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)ur->bufs[b];
+    sqe->len = len;
+    sqe->buf_index = b;
+    sqe->user_data = op;
+    ur->sq_array[idx] = idx;
+    __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * uring_submit_wait - Submit nsubmit queued requests and wait until that
+ *     many have completed. Results are stored in res[] by user_data tag.
+ *     Returns 0, or -1 if io_uring_enter itself failed.
+ */
+static int uring_submit_wait(uring_t *ur, unsigned nsubmit, int res[2])
+{
+    int rc;
+    unsigned head, want = nsubmit, done = 0;
+    struct io_uring_cqe *cqe;
+
+    while (done < want) {
+        rc = syscall(__NR_io_uring_enter, ur->fd, nsubmit, want - done,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        nsubmit -= rc;      /* Number of SQEs the kernel consumed */
+        head = *ur->cq_head;
+        while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ur->cqes[head & *ur->cq_mask];
+            res[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * uring_ready - Is io_uring enabled and working on this thread? Sets
+ *     the thread's ring up on first use.
+ */
+int uring_ready(void)
+{
+    if (!uring_enabled || ring_failed)
+        return 0;
+    if (!ring && !(ring = uring_setup())) {
+        ring_failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * uring_relay - io_uring version of read_n_send, for use once
+ *     uring_ready has said yes. Relays the body bp with the same error
+ *     handling, caching, flight and splice handling as read_n_send, and
+ *     the same result.
+ */
+int uring_relay(int serverfd, int clientfd, rio_t *rio, http_body_t *bp,
+        cache_flight_t *fl)
+{
+    int b = 0, res[2], spliced = SPLICE_ENOTSUP, nsubmit, failed = 0;
+    ssize_t n = 0;          /* Body bytes in bufs[b] still to be written */
+    uring_t *ur = ring;
+
+    /* Bytes already pulled into the rio buffer go out first */
+    if (rio->rio_cnt > 0) {
+        stats_add(STATS_BYTES_IN, rio->rio_cnt);
+        n = http_body_decode(bp, rio->rio_bufptr, rio->rio_cnt);
+        rio->rio_cnt = 0;
+        if (n < 0)
+            failed = 1;
+        else if (relay_out(&clientfd, fl, rio->rio_bufptr, n) < 0)
+            return -1;
+        n = 0;
+    }
+
+    /* Write chunk b while reading the next one into the other buffer.
+       Once the client is gone (but followers are not), only read. */
+    while (!failed) {
+        /* No copy wanted any more: splice the rest */
+        if (clientfd >= 0 && !cache_flight_wants(fl) && !bp->done
+                && bp->framing != HTTP_BODY_CHUNKED) {
+            if (n > 0 && rio_writen(clientfd, ur->bufs[b], n) != n)
+                spliced = SPLICE_ECLIENT;
+            else {
+                stats_add(STATS_BYTES_OUT, n);
+                spliced = splice_body(serverfd, clientfd, NULL, bp);
+            }
+            n = 0;
+            if (spliced != SPLICE_ENOTSUP)
+                break;
+        }
+
+        nsubmit = 0;
+        if (n > 0 && clientfd >= 0) {
+            uring_prep(ur, URING_WRITE, clientfd, b, n);
+            nsubmit++;
+        }
+        if (!bp->done) {
+            uring_prep(ur, URING_READ, serverfd, !b,
+                    http_body_room(bp, URING_BUFSIZE));
+            nsubmit++;
+        }
+        if (nsubmit == 0)
+            break;
+        if (uring_submit_wait(ur, nsubmit, res) < 0)
+            break;
+
+        if (n > 0 && clientfd >= 0) {
+            if (res[URING_WRITE] >= 0 && res[URING_WRITE] < n
+                    && rio_writen(clientfd, ur->bufs[b] + res[URING_WRITE],
+                        n - res[URING_WRITE]) == n - res[URING_WRITE])
+                res[URING_WRITE] = n;   /* Finished a short write */
+            if (res[URING_WRITE] == n)
+                stats_add(STATS_BYTES_OUT, n);
+            else {
+                clientfd = -1;
+                if (!cache_flight_followers(fl)) {
+                    cache_flight_finish(fl, 0);
+                    return -1;
+                }
+            }
+        }
+        n = 0;
+        if (bp->done)
+            break;
+        if (res[URING_READ] < 0)
+            break;
+        stats_add(STATS_BYTES_IN, res[URING_READ]);
+        if ((n = http_body_decode(bp, ur->bufs[!b], res[URING_READ])) < 0)
+            break;
+        b = !b;
+        cache_flight_add(fl, ur->bufs[b], n);
+    }
+
+    if (spliced == SPLICE_ECLIENT) {
+        cache_flight_finish(fl, 0);
+        return -1;
+    }
+
+    /* Handling invalid response from upstream server */
+    if (!bp->done) {
+        cache_flight_finish(fl, 0);
+        if (clientfd >= 0)
+            clienterror(clientfd, "GET", "502", "Bad Gateway",
+                    "Client not understood due to malformed syntax");
+        return -1;
+    }
+    cache_flight_finish(fl, 1);
+    return 0;
+}
+
+#else /* !HAVE_IO_URING */
+
+/* Built without io_uring: always use the Rio path */
+int uring_ready(void)
+{
+    return 0;
+}
+
+int uring_relay(int serverfd, int clientfd, rio_t *rio, http_body_t *bp,
+        cache_flight_t *fl)
+{
+    return read_n_send(serverfd, clientfd, rio, bp, fl);
+}
+
+#endif /* HAVE_IO_URING */
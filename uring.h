@@ -0,0 +1,30 @@
+/*
+ * uring.h - Optional io_uring backend for the upstream -> client relay
+ *
+ * Built whenever the kernel headers provide <linux/io_uring.h> (build
+ * with -DNO_IO_URING to leave it out) and enabled at run time with -u.
+ * If either is missing, or the kernel refuses to set up a ring,
+ * uring_ready says so and the caller uses the Rio path instead.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+
+#if !defined(NO_IO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#define URING_BUFSIZE 65536  /* Size of each registered relay buffer */
+
+extern int uring_enabled;    /* Set by -u */
+
+int uring_ready(void);
+int uring_relay(int serverfd, int clientfd, rio_t *rio, http_body_t *bp,
+        cache_flight_t *fl);
+
+#endif /* __URING_H__ */